@@ -0,0 +1,168 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/failspec.h"
+#include "../src/rule.h"
+
+/* Lookup cost of MALLOC_FAIL_AT specs as they grow.
+ * Each spec has N single points and N ranges spread over the index space;
+ * we walk indices monotonically (what the wrappers do) and also query at
+ * random, checking every answer against a brute-force scan of the sample.
+ * Then compiled MALLOC_FAIL_RULE expressions against the fixed
+ * SIZE_MIN/SIZE_MAX/EVERY checks they replace.
+ */
+
+#define LOOKUPS 20000000ULL
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t *s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+static char *build_spec(size_t n, uint64_t stride) {
+    size_t cap = n * 48 + 1;
+    char *buf = malloc(cap);
+    size_t len = 0;
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t base = 1 + i * stride;
+        len += (size_t)snprintf(buf + len, cap - len, "%s%llu,%llu-%llu", i ? "," : "",
+                                (unsigned long long)base,
+                                (unsigned long long)(base + stride / 2),
+                                (unsigned long long)(base + stride / 2 + stride / 8));
+    }
+    buf[len] = '\0';
+    return buf;
+}
+
+static int brute_contains(const char *spec, uint64_t v) {
+    const char *p = spec;
+    while (*p) {
+        char *end;
+        unsigned long long a = strtoull(p, &end, 10), b = a;
+        if (*end == '-') b = strtoull(end + 1, &end, 10);
+        if (v >= a && v <= b) return 1;
+        p = *end ? end + 1 : end;
+    }
+    return 0;
+}
+
+/* What decide_index_sized does for SIZE_MIN=4096 SIZE_MAX=65536 EVERY=7;
+ * like the config, the values are only known at run time */
+struct fixed_config {
+    uint64_t size_min, size_max, every;
+};
+static volatile struct fixed_config fixed = { 4096, 65536, 7 };
+
+__attribute__((noinline))
+static int fixed_checks(const volatile struct fixed_config *cfg, uint64_t size, uint64_t idx) {
+    if (cfg->size_min > 0 && size < cfg->size_min) return 0;
+    if (cfg->size_max > 0 && size > cfg->size_max) return 0;
+    return cfg->every > 0 && idx % cfg->every == 0;
+}
+
+/* Specialised the way select_decide does it */
+__attribute__((noinline))
+static int rule_checks(const struct rule_set *rules, unsigned fn, uint64_t size, uint64_t idx) {
+    switch (rules->uses) {
+    case 0: return rule_match(rules, 0, fn, size, idx);
+    case RULE_USES_FN: return rule_match(rules, RULE_USES_FN, fn, size, idx);
+    case RULE_USES_IDX: return rule_match(rules, RULE_USES_IDX, fn, size, idx);
+    default: return rule_match(rules, RULE_USES_FN | RULE_USES_IDX, fn, size, idx);
+    }
+}
+
+static int bench_rules(void) {
+    static const char *const exprs[] = {
+        "size>=4K && size<=64K && idx%7==0",
+        "fn==malloc && size>=4K && size<=64K && idx%7==0",
+        "fn==calloc && size>=4K && idx%7==0; fn==realloc; size>1M",
+    };
+    printf("\n%-58s %10s\n", "expression", "ns/check");
+    uint64_t seed = 0x9e3779b97f4a7c15ULL, hits = 0;
+    double t0 = now_ns();
+    for (uint64_t i = 1; i <= LOOKUPS; ++i) hits += (uint64_t)fixed_checks(&fixed, xorshift(&seed) & 0x1ffff, i);
+    printf("%-58s %10.2f\n", "(fixed: SIZE_MIN=4096 SIZE_MAX=65536 EVERY=7)", (now_ns() - t0) / LOOKUPS);
+
+    for (size_t k = 0; k < sizeof(exprs) / sizeof(exprs[0]); ++k) {
+        struct rule_set rules;
+        const char *error, *where;
+        if (rule_parse(&rules, exprs[k], &error, &where) != 0) {
+            fprintf(stderr, "rule: %s at \"%s\"\n", error, where);
+            return 1;
+        }
+        seed = 0x9e3779b97f4a7c15ULL;
+        t0 = now_ns();
+        for (uint64_t i = 1; i <= LOOKUPS; ++i) hits += (uint64_t)rule_checks(&rules, 0, xorshift(&seed) & 0x1ffff, i);
+        double ns = (now_ns() - t0) / LOOKUPS;
+        if (k < 2) { /* same answers as the fixed checks (fn is malloc) */
+            seed = 1;
+            for (uint64_t i = 1; i <= 1000000; ++i) {
+                uint64_t size = xorshift(&seed) & 0x1ffff;
+                if (rule_checks(&rules, 0, size, i) != fixed_checks(&fixed, size, i)) {
+                    fprintf(stderr, "rule mismatch at size %llu idx %llu\n", (unsigned long long)size,
+                            (unsigned long long)i);
+                    return 1;
+                }
+            }
+        }
+        printf("%-58s %10.2f\n", exprs[k], ns);
+    }
+    if (hits == 0) fprintf(stderr, "no hits?\n");
+    return 0;
+}
+
+int main(void) {
+    static const size_t sizes[] = { 1, 16, 256, 4096, 65536, 1048576 };
+    const uint64_t stride = 64;
+    printf("%10s %10s %14s %14s\n", "entries", "intervals", "seq ns/lookup", "rand ns/lookup");
+
+    for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); ++k) {
+        char *text = build_spec(sizes[k], stride);
+        struct failspec spec;
+        if (failspec_parse(&spec, text) != 0) {
+            fprintf(stderr, "parse failed\n");
+            return 1;
+        }
+        uint64_t span = sizes[k] * stride;
+
+        size_t cursor = 0;
+        uint64_t hits = 0;
+        double t0 = now_ns();
+        for (uint64_t i = 1; i <= LOOKUPS; ++i)
+            hits += (uint64_t)failspec_contains(&spec, 1 + (i % span), &cursor);
+        double seq = (now_ns() - t0) / LOOKUPS;
+
+        uint64_t seed = 0x9e3779b97f4a7c15ULL;
+        t0 = now_ns();
+        for (uint64_t i = 0; i < LOOKUPS; ++i)
+            hits += (uint64_t)failspec_contains(&spec, 1 + xorshift(&seed) % span, &cursor);
+        double rnd = (now_ns() - t0) / LOOKUPS;
+
+        /* Spot-check against the naive definition */
+        if (sizes[k] <= 4096) {
+            for (uint64_t v = 0; v < span + 2; v += 7) {
+                if (failspec_contains(&spec, v, &cursor) != brute_contains(text, v)) {
+                    fprintf(stderr, "mismatch at %llu\n", (unsigned long long)v);
+                    return 1;
+                }
+            }
+        }
+
+        printf("%10zu %10zu %14.2f %14.2f\n", sizes[k] * 2, spec.count, seq, rnd);
+        if (hits == 0) fprintf(stderr, "no hits?\n");
+        free(text);
+    }
+    return bench_rules();
+}
@@ -0,0 +1,34 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Cost of one malloc+free pair as seen by the program.
+ * Run it with and without LD_PRELOAD: the difference is what the
+ * interceptor adds in the current configuration.
+ */
+
+#define PAIRS 20000000ULL
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    const char *label = argc > 1 ? argv[1] : "run";
+    unsigned long long pairs = argc > 2 ? strtoull(argv[2], NULL, 10) : PAIRS;
+
+    /* Warm up the allocator's thread cache */
+    for (int i = 0; i < 1000; ++i) free(malloc(64));
+
+    double t0 = now_ns();
+    for (unsigned long long i = 0; i < pairs; ++i) {
+        void *volatile p = malloc(64);
+        free(p);
+    }
+    double ns = (now_ns() - t0) / (double)pairs;
+    printf("%-24s %8.2f ns per malloc+free\n", label, ns);
+    return 0;
+}
@@ -0,0 +1,47 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Cost of starting a process: fork, exec and exit of a small command.
+ * LD_PRELOAD is inherited by the command, so comparing runs with and
+ * without the interceptor (and with more preloaded libraries, which
+ * lengthen every dlsym(RTLD_NEXT) lookup) shows what init adds.
+ *
+ *   bench_startup label runs command [args...]
+ */
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 4) {
+        fprintf(stderr, "usage: bench_startup label runs command [args...]\n");
+        return 2;
+    }
+    const char *label = argv[1];
+    long runs = strtol(argv[2], NULL, 10);
+
+    double t0 = now_ns();
+    for (long i = 0; i < runs; ++i) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            execvp(argv[3], argv + 3);
+            _exit(127);
+        }
+        int status;
+        if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+            WEXITSTATUS(status) == 127) {
+            fprintf(stderr, "bench_startup: cannot run %s\n", argv[3]);
+            return 1;
+        }
+    }
+    double us = (now_ns() - t0) / 1e3 / (double)runs;
+    printf("%-24s %8.1f us per process\n", label, us);
+    return 0;
+}
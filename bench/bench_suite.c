@@ -0,0 +1,210 @@
+#define _GNU_SOURCE
+#include <malloc.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Per-function cost of every wrapped call, from 1 to N threads.
+ *
+ *   bench_suite [-n calls] [-t 1,2,4] [-o results.csv] label
+ *
+ * Each thread allocates a batch of blocks with the function under test,
+ * then frees the batch, and times both halves; realloc resizes blocks
+ * from a malloc batch, free is timed on 64-byte malloc blocks, and
+ * operator new and delete work the same way on new'd blocks. The value
+ * reported is wall time per call per thread, so perfect scaling keeps it
+ * flat as threads are added.
+ *
+ * With -o, rows are appended to a CSV file. A run labelled
+ * "no interceptor" (no LD_PRELOAD) is the baseline: later runs written to
+ * the same file get an overhead column against it.
+ */
+
+#define BATCH 1000
+#define MAX_THREADS 64
+
+enum bench_fn {
+    B_MALLOC, B_CALLOC, B_REALLOC, B_FREE, B_POSIX_MEMALIGN,
+    B_ALIGNED_ALLOC, B_MEMALIGN, B_VALLOC, B_PVALLOC, B_NEW, B_DELETE, B_COUNT
+};
+
+static const char *const fn_names[B_COUNT] = {
+    "malloc", "calloc", "realloc", "free", "posix_memalign",
+    "aligned_alloc", "memalign", "valloc", "pvalloc", "new", "delete",
+};
+
+/* operator new(size_t) and operator delete(void *) by their mangled
+ * names; the suite links libstdc++ so the baseline run has them too */
+void *_Znwm(size_t size);
+void _ZdlPv(void *ptr);
+
+#define BASELINE "no interceptor"
+
+struct worker {
+    pthread_t thread;
+    enum bench_fn fn;
+    long calls;
+};
+
+static pthread_barrier_t start_line;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void *alloc_one(enum bench_fn fn, size_t size) {
+    void *p = NULL;
+    switch (fn) {
+    case B_CALLOC: return calloc(1, size);
+    case B_POSIX_MEMALIGN: return posix_memalign(&p, 64, size) == 0 ? p : NULL;
+    case B_ALIGNED_ALLOC: return aligned_alloc(64, size);
+    case B_MEMALIGN: return memalign(64, size);
+    case B_VALLOC: return valloc(size);
+    case B_PVALLOC: return pvalloc(size);
+    case B_NEW:
+    case B_DELETE: return _Znwm(size);
+    default: return malloc(size);
+    }
+}
+
+/* Only the timed half of each batch counts */
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    void **slots = malloc(BATCH * sizeof(*slots));
+    double timed = 0;
+    pthread_barrier_wait(&start_line);
+    for (long done = 0; done < w->calls; done += BATCH) {
+        size_t size = 64 + (size_t)(done / BATCH % 8) * 16;
+        double t0 = now_ns();
+        if (w->fn == B_REALLOC) {
+            for (int i = 0; i < BATCH; ++i) slots[i] = malloc(size);
+            t0 = now_ns();
+            for (int i = 0; i < BATCH; ++i) slots[i] = realloc(slots[i], size * 2 + 8);
+            timed += now_ns() - t0;
+        } else if (w->fn == B_FREE) {
+            for (int i = 0; i < BATCH; ++i) slots[i] = malloc(size);
+        } else if (w->fn == B_DELETE) {
+            for (int i = 0; i < BATCH; ++i) slots[i] = alloc_one(w->fn, size);
+        } else {
+            for (int i = 0; i < BATCH; ++i) slots[i] = alloc_one(w->fn, size);
+            timed += now_ns() - t0;
+        }
+        t0 = now_ns();
+        if (w->fn == B_NEW || w->fn == B_DELETE)
+            for (int i = 0; i < BATCH; ++i) _ZdlPv(slots[i]);
+        else
+            for (int i = 0; i < BATCH; ++i) free(slots[i]);
+        if (w->fn == B_FREE || w->fn == B_DELETE) timed += now_ns() - t0;
+    }
+    free(slots);
+    double *result = malloc(sizeof(*result));
+    if (result) *result = timed;
+    return result;
+}
+
+/* ns per call per thread, from the slowest thread */
+static double run(enum bench_fn fn, int threads, long calls) {
+    struct worker w[MAX_THREADS];
+    pthread_barrier_init(&start_line, NULL, (unsigned)threads);
+    for (int t = 0; t < threads; ++t) {
+        w[t] = (struct worker){ .fn = fn, .calls = calls };
+        pthread_create(&w[t].thread, NULL, worker_main, &w[t]);
+    }
+    double worst = 0;
+    for (int t = 0; t < threads; ++t) {
+        void *ret = NULL;
+        pthread_join(w[t].thread, &ret);
+        if (ret && *(double *)ret > worst) worst = *(double *)ret;
+        free(ret);
+    }
+    pthread_barrier_destroy(&start_line);
+    long rounded = (calls + BATCH - 1) / BATCH * BATCH;
+    return worst / (double)rounded;
+}
+
+/* Baseline value for (fn, threads) from an existing CSV, or -1 */
+static double baseline(const char *csv, const char *fn, int threads) {
+    FILE *f = csv ? fopen(csv, "r") : NULL;
+    if (!f) return -1;
+    char line[256], label[64], name[32];
+    int t;
+    double ns, found = -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%63[^,],%31[^,],%d,%lf", label, name, &t, &ns) == 4 &&
+            strcmp(label, BASELINE) == 0 && strcmp(name, fn) == 0 && t == threads)
+            found = ns;
+    }
+    fclose(f);
+    return found;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: bench_suite [-n calls] [-t 1,2,4] [-o results.csv] label\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    long calls = 100000;
+    const char *thread_list = "1,2,4";
+    const char *csv = NULL;
+    int c;
+    while ((c = getopt(argc, argv, "n:t:o:")) != -1) {
+        switch (c) {
+        case 'n': calls = strtol(optarg, NULL, 10); break;
+        case 't': thread_list = optarg; break;
+        case 'o': csv = optarg; break;
+        default: usage();
+        }
+    }
+    if (optind + 1 != argc || calls <= 0) usage();
+    const char *label = argv[optind];
+
+    int threads[16], nthreads = 0;
+    for (const char *p = thread_list; *p && nthreads < 16;) {
+        int t = (int)strtol(p, (char **)&p, 10);
+        if (t >= 1 && t <= MAX_THREADS) threads[nthreads++] = t;
+        if (*p) p++;
+    }
+    if (nthreads == 0) usage();
+
+    double ns[B_COUNT][16];
+    for (int fn = 0; fn < B_COUNT; ++fn)
+        for (int i = 0; i < nthreads; ++i) ns[fn][i] = run((enum bench_fn)fn, threads[i], calls);
+
+    printf("%s (ns per call)\n%-16s", label, "");
+    for (int i = 0; i < nthreads; ++i) printf(" %6d thr", threads[i]);
+    printf("\n");
+    for (int fn = 0; fn < B_COUNT; ++fn) {
+        printf("%-16s", fn_names[fn]);
+        for (int i = 0; i < nthreads; ++i) printf(" %10.2f", ns[fn][i]);
+        printf("\n");
+    }
+
+    if (!csv) return 0;
+    /* Read the baseline before appending, in case this run is it */
+    double base[B_COUNT][16];
+    for (int fn = 0; fn < B_COUNT; ++fn)
+        for (int i = 0; i < nthreads; ++i) base[fn][i] = baseline(csv, fn_names[fn], threads[i]);
+    int fresh = access(csv, F_OK) != 0;
+    FILE *f = fopen(csv, "a");
+    if (!f) {
+        perror(csv);
+        return 1;
+    }
+    if (fresh) fprintf(f, "label,function,threads,ns_per_call,overhead_ns\n");
+    for (int fn = 0; fn < B_COUNT; ++fn) {
+        for (int i = 0; i < nthreads; ++i) {
+            fprintf(f, "%s,%s,%d,%.2f,", label, fn_names[fn], threads[i], ns[fn][i]);
+            if (base[fn][i] >= 0 && strcmp(label, BASELINE) != 0)
+                fprintf(f, "%.2f", ns[fn][i] - base[fn][i]);
+            fprintf(f, "\n");
+        }
+    }
+    fclose(f);
+    return 0;
+}
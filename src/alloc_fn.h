@@ -0,0 +1,63 @@
+#ifndef ALLOC_FN_H
+#define ALLOC_FN_H
+
+#include <stdint.h>
+
+/* Intercepted allocation functions, used to index per-function counters
+ * and stored in trace records. Append only: the values are part of the
+ * trace file format.
+ */
+enum alloc_fn {
+    FN_MALLOC,
+    FN_CALLOC,
+    FN_REALLOC,
+    FN_POSIX_MEMALIGN,
+    FN_ALIGNED_ALLOC,
+    FN_MEMALIGN,
+    FN_VALLOC,
+    FN_PVALLOC,
+    /* C++ operator new: FN_NEW plus the NEW_* bits of the variant */
+    FN_NEW,
+    FN_NEW_ARRAY,
+    FN_NEW_ALIGNED,
+    FN_NEW_ARRAY_ALIGNED,
+    FN_NEW_NOTHROW,
+    FN_NEW_ARRAY_NOTHROW,
+    FN_NEW_ALIGNED_NOTHROW,
+    FN_NEW_ARRAY_ALIGNED_NOTHROW,
+    FN_COUNT
+};
+
+#define NEW_ARRAY   1u /* new[] */
+#define NEW_ALIGNED 2u /* takes std::align_val_t */
+#define NEW_NOTHROW 4u /* takes std::nothrow_t: returns NULL instead of throwing */
+
+static inline const char *alloc_fn_name(unsigned fn) {
+    static const char *const names[FN_COUNT] = {
+        [FN_MALLOC] = "malloc",
+        [FN_CALLOC] = "calloc",
+        [FN_REALLOC] = "realloc",
+        [FN_POSIX_MEMALIGN] = "posix_memalign",
+        [FN_ALIGNED_ALLOC] = "aligned_alloc",
+        [FN_MEMALIGN] = "memalign",
+        [FN_VALLOC] = "valloc",
+        [FN_PVALLOC] = "pvalloc",
+        [FN_NEW] = "new",
+        [FN_NEW_ARRAY] = "new_array",
+        [FN_NEW_ALIGNED] = "new_aligned",
+        [FN_NEW_ARRAY_ALIGNED] = "new_array_aligned",
+        [FN_NEW_NOTHROW] = "new_nothrow",
+        [FN_NEW_ARRAY_NOTHROW] = "new_array_nothrow",
+        [FN_NEW_ALIGNED_NOTHROW] = "new_aligned_nothrow",
+        [FN_NEW_ARRAY_ALIGNED_NOTHROW] = "new_array_aligned_nothrow",
+    };
+    return fn < FN_COUNT ? names[fn] : "unknown";
+}
+
+/* Reports list the C functions always and operator new once it is used,
+ * so C programs see the same table as before */
+static inline int alloc_fn_reported(unsigned fn, uint64_t total) {
+    return fn < FN_NEW || total;
+}
+
+#endif
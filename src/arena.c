@@ -0,0 +1,57 @@
+#define _GNU_SOURCE
+#include "arena.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#define ARENA_CHUNK_SIZE (256 * 1024)
+#define ARENA_ALIGN 64
+
+/* Current bump chunk. Arena allocations are rare (thread attach, init,
+ * table growth), so a spinlock is cheaper than anything clever. */
+static atomic_flag arena_lock = ATOMIC_FLAG_INIT;
+static char *arena_cur = NULL;
+static size_t arena_left = 0;
+
+void *arena_map(size_t size) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+void arena_unmap(void *ptr, size_t size) {
+    if (ptr) munmap(ptr, size);
+}
+
+void *arena_alloc(size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    /* Large requests get their own mapping rather than wasting a chunk */
+    if (size > ARENA_CHUNK_SIZE / 4) return arena_map(size);
+
+    while (atomic_flag_test_and_set_explicit(&arena_lock, memory_order_acquire))
+        ;
+    if (size > arena_left) {
+        char *chunk = arena_map(ARENA_CHUNK_SIZE);
+        if (!chunk) {
+            atomic_flag_clear_explicit(&arena_lock, memory_order_release);
+            return NULL;
+        }
+        arena_cur = chunk;
+        arena_left = ARENA_CHUNK_SIZE;
+    }
+    void *p = arena_cur;
+    arena_cur += size;
+    arena_left -= size;
+    atomic_flag_clear_explicit(&arena_lock, memory_order_release);
+    return p;
+}
+
+void arena_fork_prepare(void) {
+    while (atomic_flag_test_and_set_explicit(&arena_lock, memory_order_acquire))
+        ;
+}
+
+void arena_fork_release(void) {
+    atomic_flag_clear_explicit(&arena_lock, memory_order_release);
+}
@@ -0,0 +1,23 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* Internal memory for the interceptor's own bookkeeping.
+ * Everything here is backed by mmap() so it never re-enters the
+ * malloc wrappers, and is safe to use before the real allocator has
+ * been resolved.
+ */
+
+/* Zeroed, cache-line aligned memory that is never returned. */
+void *arena_alloc(size_t size);
+
+/* Dedicated zeroed mapping that can later be released with arena_unmap(). */
+void *arena_map(size_t size);
+void arena_unmap(void *ptr, size_t size);
+
+/* pthread_atfork handlers: keep the arena lock consistent across fork() */
+void arena_fork_prepare(void);
+void arena_fork_release(void);
+
+#endif
@@ -0,0 +1,28 @@
+#include "bootstrap.h"
+
+#include <stdatomic.h>
+
+char bootstrap_arena[BOOTSTRAP_ARENA_SIZE] __attribute__((aligned(64)));
+
+static _Atomic size_t bootstrap_top = 0;
+
+/* Each block is preceded by its size */
+#define HEADER sizeof(size_t)
+
+void *bootstrap_alloc(size_t size, size_t align) {
+    if (align < 2 * HEADER) align = 2 * HEADER;
+    size_t top = atomic_load_explicit(&bootstrap_top, memory_order_relaxed);
+    size_t start, end;
+    do {
+        start = (top + HEADER + align - 1) & ~(align - 1);
+        end = start + size;
+        if (size > BOOTSTRAP_ARENA_SIZE || end > BOOTSTRAP_ARENA_SIZE) return NULL;
+    } while (!atomic_compare_exchange_weak_explicit(&bootstrap_top, &top, end,
+                                                    memory_order_relaxed, memory_order_relaxed));
+    *(size_t *)(bootstrap_arena + start - HEADER) = size;
+    return bootstrap_arena + start;
+}
+
+size_t bootstrap_size(const void *ptr) {
+    return *(const size_t *)((const char *)ptr - HEADER);
+}
@@ -0,0 +1,30 @@
+#ifndef BOOTSTRAP_H
+#define BOOTSTRAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Allocations made while the real allocator is being resolved.
+ *
+ * dlsym may call calloc, which lands back in the wrappers before any
+ * real_* pointer is set. Those calls are served from a static bump arena:
+ * its blocks are zeroed, never reused, and recognised by free and realloc
+ * through a single range check, so they never reach the real allocator.
+ */
+
+#define BOOTSTRAP_ARENA_SIZE (64 * 1024)
+
+extern char bootstrap_arena[BOOTSTRAP_ARENA_SIZE];
+
+/* Zeroed block of size bytes aligned to align (a power of two), or NULL
+ * once the arena is exhausted */
+void *bootstrap_alloc(size_t size, size_t align);
+
+/* Requested size of a block from bootstrap_alloc */
+size_t bootstrap_size(const void *ptr);
+
+static inline int bootstrap_owns(const void *ptr) {
+    return (uintptr_t)ptr - (uintptr_t)bootstrap_arena < BOOTSTRAP_ARENA_SIZE;
+}
+
+#endif
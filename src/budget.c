@@ -0,0 +1,96 @@
+#define _GNU_SOURCE
+#include "budget.h"
+#include "diag.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+_Atomic int64_t budget_live = 0;
+_Atomic int64_t budget_peak = 0;
+static _Atomic uint64_t budget_refused = 0;
+static int64_t budget_limit = 0;
+static size_t (*real_usable_size)(void *) = NULL;
+
+uint64_t budget_parse(const char *s) {
+    char *end;
+    errno = 0;
+    uint64_t v = strtoull(s, &end, 10);
+    if (errno == ERANGE || end == s) return 0;
+    unsigned shift;
+    switch (*end) {
+    case 'k': case 'K': shift = 10; break;
+    case 'm': case 'M': shift = 20; break;
+    case 'g': case 'G': shift = 30; break;
+    case '\0': return v;
+    default: return 0;
+    }
+    if (end[1] != '\0' || v > UINT64_MAX >> shift) return 0;
+    return v << shift;
+}
+
+int budget_init(uint64_t limit) {
+    real_usable_size = dlsym(RTLD_NEXT, "malloc_usable_size");
+    if (!real_usable_size || limit == 0 || limit > INT64_MAX) return -1;
+    budget_limit = (int64_t)limit;
+    /* Blocks already handed out are uncharged when freed, so start from
+     * what the real allocator has in use */
+    struct mallinfo2 (*real_mallinfo2)(void) = dlsym(RTLD_NEXT, "mallinfo2");
+    if (real_mallinfo2) {
+        struct mallinfo2 mi = real_mallinfo2();
+        atomic_store(&budget_live, (int64_t)(mi.uordblks + mi.hblkhd));
+        atomic_store(&budget_peak, atomic_load(&budget_live));
+    }
+    return 0;
+}
+
+size_t budget_usable(void *ptr) {
+    return ptr ? real_usable_size(ptr) : 0;
+}
+
+void budget_raise_peak(int64_t live) {
+    int64_t peak = atomic_load_explicit(&budget_peak, memory_order_relaxed);
+    while (live > peak &&
+           !atomic_compare_exchange_weak_explicit(&budget_peak, &peak, live,
+                                                  memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+void budget_publish(int64_t delta) {
+    int64_t live = atomic_fetch_add_explicit(&budget_live, delta, memory_order_relaxed) + delta;
+    budget_raise_peak(live);
+}
+
+int budget_refuse(struct thread_state *ts, int64_t bytes) {
+    int64_t d = atomic_load_explicit(&ts->live_delta, memory_order_relaxed);
+    int64_t live = atomic_load_explicit(&budget_live, memory_order_relaxed) + d;
+    if (d && live + bytes > budget_limit - BUDGET_BATCH) {
+        /* Near the limit: let the other threads see this one's bytes */
+        budget_publish(d);
+        atomic_store_explicit(&ts->live_delta, 0, memory_order_relaxed);
+        live = atomic_load_explicit(&budget_live, memory_order_relaxed);
+    }
+    if (live + bytes <= budget_limit) return 0;
+    atomic_fetch_add_explicit(&budget_refused, 1, memory_order_relaxed);
+    return 1;
+}
+
+int64_t budget_live_bytes(const struct stats_totals *totals) {
+    return atomic_load(&budget_live) + totals->live_delta;
+}
+
+void budget_report(int fd, const struct stats_totals *totals) {
+    int64_t live = budget_live_bytes(totals);
+    budget_raise_peak(live);
+    char buf[256];
+    int len = snprintf(buf, sizeof(buf),
+                       "limit:           %10" PRId64 " bytes (+%d KiB per other thread), peak %" PRId64
+                       ", live at exit %" PRId64 ", %" PRIu64 " allocations refused\n",
+                       budget_limit, BUDGET_BATCH / 1024, atomic_load(&budget_peak), live,
+                       atomic_load(&budget_refused));
+    if (len > 0) diag_write(fd, buf, (size_t)len);
+}
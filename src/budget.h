@@ -0,0 +1,69 @@
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "thread_state.h"
+
+/* Memory budget (MALLOC_FAIL_LIMIT=<bytes>).
+ *
+ * Live bytes are the usable sizes (malloc_usable_size) of blocks handed
+ * out minus those freed. Each thread accumulates its changes locally and
+ * publishes them to the shared total once they reach BUDGET_BATCH bytes,
+ * so the shared cache line is touched once per batch rather than once per
+ * call. The limit check sees the shared total plus the calling thread's
+ * own pending bytes. Within BUDGET_BATCH of the limit it publishes those
+ * first, so the margin left is what other threads have pending and not
+ * published since (under BUDGET_BATCH each). The peak is raised on every
+ * charge from the shared total plus the thread's own pending bytes.
+ *
+ * The total starts from the real allocator's bytes in use at init
+ * (mallinfo2), so freeing a block handed out before the limit took
+ * effect takes back bytes that were counted.
+ */
+
+#define BUDGET_BATCH (64 * 1024)
+
+/* Parse "<n>[K|M|G]". Returns 0 for an invalid, overflowing or zero
+ * limit. */
+uint64_t budget_parse(const char *s);
+
+/* Set the limit, resolve malloc_usable_size and take the bytes already
+ * in use. Returns 0 on success. */
+int budget_init(uint64_t limit);
+
+/* Usable size of a block from the real allocator, 0 for NULL */
+size_t budget_usable(void *ptr);
+
+/* Whether charging bytes more would cross the limit; counts refusals */
+int budget_refuse(struct thread_state *ts, int64_t bytes);
+
+/* Move a thread's pending bytes to the shared total */
+void budget_publish(int64_t delta);
+
+/* Shared total and its high-water mark, for budget_charge */
+extern _Atomic int64_t budget_live;
+extern _Atomic int64_t budget_peak;
+void budget_raise_peak(int64_t live);
+
+/* Account bytes (negative on free) to the calling thread */
+static inline void budget_charge(struct thread_state *ts, int64_t bytes) {
+    int64_t d = atomic_load_explicit(&ts->live_delta, memory_order_relaxed) + bytes;
+    if (d >= BUDGET_BATCH || d <= -BUDGET_BATCH) {
+        budget_publish(d);
+        d = 0;
+    } else if (bytes > 0) {
+        int64_t live = atomic_load_explicit(&budget_live, memory_order_relaxed) + d;
+        if (live > atomic_load_explicit(&budget_peak, memory_order_relaxed)) budget_raise_peak(live);
+    }
+    atomic_store_explicit(&ts->live_delta, d, memory_order_relaxed);
+}
+
+/* Live bytes including every thread's pending delta */
+int64_t budget_live_bytes(const struct stats_totals *totals);
+
+/* Append limit, peak and refusals to the statistics report */
+void budget_report(int fd, const struct stats_totals *totals);
+
+#endif
@@ -0,0 +1,118 @@
+#define _GNU_SOURCE
+#include "control.h"
+#include "arena.h"
+#include "diag.h"
+#include "threads.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* The file, split into NUL-terminated "NAME=VALUE" lines */
+struct control_file {
+    char *text;
+    size_t len;
+};
+
+static const char *control_path = NULL;
+static control_apply_fn control_apply = NULL;
+static sem_t control_wake;
+static _Atomic unsigned long control_applied = 0;
+
+/* sem_post is async-signal-safe, which is all the handler may do */
+static void control_signal(int signo) {
+    (void)signo;
+    int saved = errno;
+    sem_post(&control_wake);
+    errno = saved;
+}
+
+const char *control_get(const struct control_file *file, const char *name) {
+    size_t n = strlen(name);
+    for (size_t pos = 0; pos < file->len; pos += strlen(file->text + pos) + 1) {
+        const char *line = file->text + pos;
+        while (*line == ' ' || *line == '\t') line++;
+        if (strncmp(line, name, n) == 0 && line[n] == '=') return line + n + 1;
+    }
+    return NULL;
+}
+
+unsigned long control_generation(void) {
+    return atomic_load_explicit(&control_applied, memory_order_acquire);
+}
+
+static void control_reload(void) {
+    char msg[320];
+    int len;
+    int fd = open(control_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        len = snprintf(msg, sizeof(msg), "interceptor: control: cannot read %s\n", control_path);
+        if (len > 0) diag_write(2, msg, (size_t)len);
+        if (fd >= 0) close(fd);
+        return;
+    }
+
+    /* The text only lives through apply: the compiled policy keeps no
+     * pointers into it */
+    size_t cap = (size_t)st.st_size + 1;
+    char *text = arena_map(cap);
+    size_t got = 0;
+    ssize_t r;
+    while (text && got + 1 < cap && (r = read(fd, text + got, cap - 1 - got)) > 0) got += (size_t)r;
+    close(fd);
+    if (!text) return;
+    for (size_t i = 0; i < got; ++i)
+        if (text[i] == '\n' || text[i] == '\r') text[i] = '\0';
+    text[got] = '\0';
+
+    struct control_file file = { text, got };
+    control_apply(&file);
+    arena_unmap(text, cap);
+    atomic_fetch_add_explicit(&control_applied, 1, memory_order_release);
+
+    len = snprintf(msg, sizeof(msg), "interceptor: control: applied %s\n", control_path);
+    if (len > 0) diag_write(2, msg, (size_t)len);
+}
+
+static void *control_main(void *arg) {
+    (void)arg;
+    /* Leave every signal to the application's own threads */
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    for (;;) {
+        while (sem_wait(&control_wake) != 0 && errno == EINTR)
+            ;
+        control_reload();
+    }
+    return NULL;
+}
+
+int control_start(const char *path, control_apply_fn apply) {
+    control_path = path;
+    control_apply = apply;
+    if (sem_init(&control_wake, 0, 0) != 0) return -1;
+
+    pthread_t thread;
+    if (thread_create_internal(&thread, control_main, "malloc-control") != 0) return -1;
+    pthread_detach(thread);
+    return 0;
+}
+
+int control_listen(int signo) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = control_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    return sigaction(signo, &sa, NULL);
+}
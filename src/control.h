@@ -0,0 +1,32 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+/* Runtime reconfiguration (MALLOC_FAIL_CONTROL=<file>).
+ *
+ * The control signal (SIGUSR2 unless MALLOC_FAIL_CONTROL_SIGNAL says
+ * otherwise) only wakes a background thread; that thread reads the file
+ * and hands it to the interceptor, which compiles a new policy and
+ * swaps it in. Nothing is parsed in signal context and the allocation
+ * path never waits for the thread.
+ *
+ * The file holds NAME=VALUE lines using the environment variable names;
+ * blank lines and lines starting with '#' are ignored.
+ */
+
+struct control_file;
+
+typedef void (*control_apply_fn)(const struct control_file *file);
+
+/* Start the thread. Returns 0 on success. */
+int control_start(const char *path, control_apply_fn apply);
+
+/* Install the handler that triggers reloads on signo */
+int control_listen(int signo);
+
+/* Reloads applied so far; advances once the new policy is in place */
+unsigned long control_generation(void);
+
+/* Value of NAME in the file, or NULL if it is not set */
+const char *control_get(const struct control_file *file, const char *name);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef DIAG_H
+#define DIAG_H
+
+#include <errno.h>
+#include <stddef.h>
+#include <unistd.h>
+
+/* Write a warning, a report or a record to fd. Short writes and EINTR
+ * are retried; any other failure, including a write of 0 bytes, gives
+ * up and returns -1. Warnings and reports ignore the result: there is
+ * nowhere left to report a failed write to stderr or the report file. */
+static inline int diag_write(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,101 @@
+#include "failspec.h"
+#include "arena.h"
+#include "sort.h"
+
+static int is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static uint64_t parse_u64(const char **p) {
+    uint64_t v = 0;
+    while (is_digit(**p)) {
+        uint64_t d = (uint64_t)(**p - '0');
+        v = (v > (UINT64_MAX - d) / 10) ? UINT64_MAX : v * 10 + d;
+        ++*p;
+    }
+    return v;
+}
+
+/* Parse one comma-separated entry at *p into r. Returns 1 if it is a
+ * usable interval; always advances *p past the entry. */
+static int parse_entry(const char **p, struct fail_range *r) {
+    const char *s = *p;
+    int ok = 0;
+    while (*s == ' ') s++;
+    if (is_digit(*s)) {
+        uint64_t a = parse_u64(&s);
+        uint64_t b = a;
+        while (*s == ' ') s++;
+        if (*s == '-') {
+            s++;
+            while (*s == ' ') s++;
+            b = is_digit(*s) ? parse_u64(&s) : 0;
+        }
+        if (a > b) { uint64_t t = a; a = b; b = t; }
+        if (a > 0) { /* ignore zero or invalid ranges */
+            r->lo = a;
+            r->hi = b;
+            ok = 1;
+        }
+    }
+    while (*s && *s != ',') s++;
+    if (*s == ',') s++;
+    *p = s;
+    return ok;
+}
+
+static int range_cmp(const void *a, const void *b) {
+    uint64_t x = ((const struct fail_range *)a)->lo, y = ((const struct fail_range *)b)->lo;
+    return (x > y) - (x < y);
+}
+
+int failspec_parse(struct failspec *spec, const char *s) {
+    spec->ranges = NULL;
+    spec->count = 0;
+    if (!s) return 0;
+
+    size_t entries = 1;
+    for (const char *c = s; *c; ++c)
+        if (*c == ',') entries++;
+
+    struct fail_range *ranges = arena_alloc(entries * sizeof(*ranges));
+    if (!ranges) return -1;
+
+    size_t n = 0;
+    const char *p = s;
+    while (*p)
+        if (parse_entry(&p, &ranges[n])) n++;
+    if (n == 0) return 0;
+
+    /* Sort, then merge overlapping and touching intervals in place */
+    sort_heap(ranges, n, sizeof(*ranges), range_cmp);
+    size_t out = 0;
+    for (size_t i = 1; i < n; ++i) {
+        struct fail_range *last = &ranges[out];
+        if (ranges[i].lo <= last->hi || ranges[i].lo - 1 == last->hi) {
+            if (ranges[i].hi > last->hi) last->hi = ranges[i].hi;
+        } else {
+            ranges[++out] = ranges[i];
+        }
+    }
+
+    spec->ranges = ranges;
+    spec->count = out + 1;
+    return 0;
+}
+
+int failspec_search(const struct failspec *spec, uint64_t v, size_t *cursor) {
+    /* Find the last interval whose lower bound is <= v */
+    size_t lo = 0, hi = spec->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (spec->ranges[mid].lo <= v) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == 0) {
+        *cursor = 0;
+        return 0;
+    }
+    *cursor = lo - 1;
+    return v <= spec->ranges[lo - 1].hi;
+}
@@ -0,0 +1,52 @@
+#ifndef FAILSPEC_H
+#define FAILSPEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Closed interval of allocation indices, lo <= hi */
+struct fail_range {
+    uint64_t lo;
+    uint64_t hi;
+};
+
+/* A parsed MALLOC_FAIL_AT spec: sorted, non-overlapping, non-adjacent
+ * intervals. Storage comes from the arena, so there is no size cap and
+ * parsing never calls malloc.
+ */
+struct failspec {
+    struct fail_range *ranges;
+    size_t count;
+};
+
+/* Parse "5,10-12,20" into spec. Zero and malformed entries are ignored.
+ * Returns 0 on success, -1 if memory could not be mapped. */
+int failspec_parse(struct failspec *spec, const char *s);
+
+/* Slow path of failspec_contains: binary search, updates the cursor */
+int failspec_search(const struct failspec *spec, uint64_t v, size_t *cursor);
+
+/* Is v inside any interval?
+ * The cursor is a per-thread hint (the interval last looked at). Indices
+ * grow monotonically, so checking the hinted interval and its successor
+ * answers almost every query in O(1); anything else falls back to an
+ * O(log N) search.
+ */
+static inline int failspec_contains(const struct failspec *spec, uint64_t v, size_t *cursor) {
+    size_t n = spec->count;
+    size_t i = *cursor;
+    if (n == 0) return 0;
+    if (i < n && v >= spec->ranges[i].lo) {
+        if (v <= spec->ranges[i].hi) return 1;
+        if (i + 1 == n || v < spec->ranges[i + 1].lo) return 0;
+        if (v <= spec->ranges[i + 1].hi) {
+            *cursor = i + 1;
+            return 1;
+        }
+    } else if (i == 0) {
+        return 0; /* below the first interval */
+    }
+    return failspec_search(spec, v, cursor);
+}
+
+#endif
@@ -0,0 +1,60 @@
+#define _GNU_SOURCE
+#include "forksrv.h"
+#include "diag.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static int read_full(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+int forksrv_serve(int ctl_fd, uint64_t first_failable, uint64_t *fail_index) {
+    int st_fd = ctl_fd + 1;
+    /* A controller hands over two pipes; whatever else the program has on
+     * these fds is not ours to write to */
+    struct stat ctl_st, st_st;
+    if (fstat(ctl_fd, &ctl_st) != 0 || !S_ISFIFO(ctl_st.st_mode)) return -1;
+    if (fstat(st_fd, &st_st) != 0 || !S_ISFIFO(st_st.st_mode)) return -1;
+    if (diag_write(st_fd, &first_failable, sizeof(first_failable)) != 0) return -1;
+
+    /* Children are reaped explicitly below */
+    signal(SIGCHLD, SIG_DFL);
+
+    for (;;) {
+        uint64_t req;
+        if (read_full(ctl_fd, &req, sizeof(req)) != 0) _exit(0);
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(ctl_fd);
+            close(st_fd);
+            *fail_index = req;
+            return 0;
+        }
+
+        int32_t reply = (int32_t)pid;
+        if (diag_write(st_fd, &reply, sizeof(reply)) != 0) _exit(0);
+        if (pid < 0) {
+            reply = 127 << 8; /* report as "could not run" */
+        } else {
+            int status = 0;
+            while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+                ;
+            reply = (int32_t)status;
+        }
+        if (diag_write(st_fd, &reply, sizeof(reply)) != 0) _exit(0);
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef FORKSRV_H
+#define FORKSRV_H
+
+#include <stdint.h>
+
+/* Fork server (MALLOC_FAIL_FORKSRV=<index>|hook).
+ *
+ * The target runs normally until the stop point, then turns into a server
+ * that forks one child per request; each child resumes right there with a
+ * different failure index. The controller talks to it over two inherited
+ * pipe fds, <fd> for requests and <fd>+1 for replies. All messages are
+ * native-endian fixed-size integers:
+ *
+ *   server -> controller  uint64_t  hello: first visible index a child can fail
+ *   controller -> server  uint64_t  MALLOC_FAIL_AT value for one child (0: none)
+ *   server -> controller  int32_t   child pid
+ *   server -> controller  int32_t   child wait status, once it has exited
+ *
+ * The server exits when the request pipe is closed.
+ *
+ * The server runs, and forks, from inside the allocation call that reached
+ * the stop point. The program's other threads are not stopped: they keep
+ * running in the server process, and each child starts with only the
+ * calling thread, so locks they held stay locked in the child.
+ */
+
+#define FORKSRV_FD_DEFAULT 198
+
+/* Serve requests on ctl_fd/ctl_fd+1. Returns 0 in a forked child with
+ * *fail_index set, or -1 immediately if no controller is listening: both
+ * fds must be pipes and the hello must go through (the caller then just
+ * carries on). Never returns in the server process. */
+int forksrv_serve(int ctl_fd, uint64_t first_failable, uint64_t *fail_index);
+
+#endif
@@ -0,0 +1,353 @@
+#define _GNU_SOURCE
+#include "heapprof.h"
+#include "arena.h"
+#include "diag.h"
+#include "rng.h"
+#include "sites.h"
+#include "threads.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HEAP_BUCKETS 4096           /* distinct stacks, power of two */
+#define HEAP_OBJECTS_INITIAL 1024   /* sampled live blocks, power of two */
+#define HEAP_OUT_BUFFER 65536
+
+/* Samples from one stack */
+struct heap_bucket {
+    uint64_t hash;          /* 0 = empty */
+    uint64_t inuse_objs;
+    uint64_t inuse_bytes;
+    uint64_t alloc_objs;
+    uint64_t alloc_bytes;
+    uint32_t depth;
+    uintptr_t pcs[HEAP_MAX_DEPTH];
+};
+
+_Atomic uint32_t heapprof_filter[HEAP_FILTER_SIZE];
+
+static const char *profile_path;
+static pid_t profile_pid;
+static uint64_t sample_mean;
+static uint64_t sample_seed;
+
+/* One lock for both tables: only sampled blocks ever take it */
+static atomic_flag table_lock = ATOMIC_FLAG_INIT;
+static struct heap_bucket *buckets;
+static uint64_t dropped;             /* samples with no room left */
+static struct heap_object *objects;
+static size_t objects_mask;          /* capacity - 1, or 0 before first use */
+static size_t objects_used;
+
+static sem_t dump_wake;
+static unsigned dumps;               /* numbered profiles, dumper-owned */
+
+static void lock(void) {
+    while (atomic_flag_test_and_set_explicit(&table_lock, memory_order_acquire))
+        ;
+}
+
+static void unlock(void) {
+    atomic_flag_clear_explicit(&table_lock, memory_order_release);
+}
+
+/* Bytes until the next sample: exponential with mean sample_mean. log2
+ * of u comes from its float bits, the exponent plus a quadratic for the
+ * mantissa, so no libm is needed; the error is below 0.01. */
+static int64_t next_interval(uint64_t *rng) {
+    union { double d; uint64_t i; } u = { .d = (double)((rng_next(rng) >> 11) + 1) * 0x1p-53 };
+    int e = (int)(u.i >> 52 & 0x7ff) - 1023;
+    u.i = (u.i & ((1ULL << 52) - 1)) | (1023ULL << 52); /* mantissa in [1, 2) */
+    double log2u = e - 1 + (-0.34484843 * u.d + 2.02466578) * u.d - 0.67487759;
+    return (int64_t)(-log2u * 0.69314718055994531 * (double)sample_mean) + 1;
+}
+
+static uint64_t hash_pcs(const uintptr_t *pcs, unsigned n) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (unsigned i = 0; i < n; ++i) h = (h ^ pcs[i]) * 0x100000001b3ULL;
+    return h | 1;
+}
+
+static inline uint64_t hash_ptr(uintptr_t ptr) {
+    return (uint64_t)(ptr >> 4) * 0x9e3779b97f4a7c15ULL;
+}
+
+/* Bucket of a stack, created if needed. Called locked. */
+static uint32_t bucket_find(const uintptr_t *pcs, unsigned n) {
+    uint64_t h = hash_pcs(pcs, n);
+    for (uint32_t probe = 0; probe < HEAP_BUCKETS; ++probe) {
+        uint32_t i = (uint32_t)(h + probe) & (HEAP_BUCKETS - 1);
+        struct heap_bucket *b = &buckets[i];
+        if (!b->hash) {
+            b->hash = h;
+            b->depth = n;
+            memcpy(b->pcs, pcs, n * sizeof(*pcs));
+            return i;
+        }
+        if (b->hash == h && b->depth == n && memcmp(b->pcs, pcs, n * sizeof(*pcs)) == 0) return i;
+    }
+    return UINT32_MAX;
+}
+
+/* Double the object table (or create it). Called locked. */
+static int objects_grow(void) {
+    size_t cap = objects_mask ? (objects_mask + 1) * 2 : HEAP_OBJECTS_INITIAL;
+    struct heap_object *slots = arena_map(cap * sizeof(*slots));
+    if (!slots) return -1;
+    for (size_t i = 0; objects_mask && i <= objects_mask; ++i) {
+        if (!objects[i].ptr) continue;
+        size_t j = hash_ptr(objects[i].ptr) & (cap - 1);
+        while (slots[j].ptr) j = (j + 1) & (cap - 1);
+        slots[j] = objects[i];
+    }
+    if (objects_mask) arena_unmap(objects, (objects_mask + 1) * sizeof(*objects));
+    objects = slots;
+    objects_mask = cap - 1;
+    return 0;
+}
+
+/* Add a block and count it as in use. Called locked. */
+static int object_insert(const struct heap_object *obj) {
+    if ((objects_used + 1) * 4 > (objects_mask + 1) * 3 && objects_grow() != 0) return -1;
+    size_t i = hash_ptr(obj->ptr) & objects_mask;
+    while (objects[i].ptr && objects[i].ptr != obj->ptr) i = (i + 1) & objects_mask;
+    if (!objects[i].ptr) objects_used++;
+    objects[i] = *obj;
+    buckets[obj->bucket].inuse_objs++;
+    buckets[obj->bucket].inuse_bytes += obj->size;
+    atomic_fetch_add_explicit(&heapprof_filter[heapprof_slot((void *)obj->ptr)], 1, memory_order_relaxed);
+    return 0;
+}
+
+void heapprof_sample(struct thread_state *ts, void *p, size_t size, const void *caller) {
+    if (!ts->heap_rng) {
+        /* First allocation of this thread: only arm the countdown */
+        ts->heap_rng = rng_stream_state(sample_seed, ts->tid);
+        ts->heap_countdown = next_interval(&ts->heap_rng);
+        return;
+    }
+    ts->heap_countdown = next_interval(&ts->heap_rng);
+    if (ts->internal) return; /* the frame walk's own allocations */
+
+    uintptr_t pcs[HEAP_MAX_DEPTH];
+    ts->internal++;
+    unsigned n = sites_capture(ts, pcs, HEAP_MAX_DEPTH, (uintptr_t)caller, __builtin_frame_address(0));
+    ts->internal--;
+
+    lock();
+    uint32_t b = bucket_find(pcs, n);
+    struct heap_object obj = { (uintptr_t)p, size, b };
+    if (b == UINT32_MAX || object_insert(&obj) != 0) {
+        dropped++;
+    } else {
+        buckets[b].alloc_objs++;
+        buckets[b].alloc_bytes += size;
+    }
+    unlock();
+}
+
+int heapprof_forget(void *p, struct heap_object *out) {
+    uintptr_t ptr = (uintptr_t)p;
+    lock();
+    if (!objects_mask) {
+        unlock();
+        return -1;
+    }
+    size_t i = hash_ptr(ptr) & objects_mask;
+    while (objects[i].ptr && objects[i].ptr != ptr) i = (i + 1) & objects_mask;
+    if (!objects[i].ptr) {
+        unlock();
+        return -1;
+    }
+    struct heap_object obj = objects[i];
+
+    /* Backward-shift deletion, as in the live-allocation table */
+    size_t hole = i;
+    for (size_t j = (i + 1) & objects_mask; objects[j].ptr; j = (j + 1) & objects_mask) {
+        size_t home = hash_ptr(objects[j].ptr) & objects_mask;
+        if (((j - home) & objects_mask) >= ((j - hole) & objects_mask)) {
+            objects[hole] = objects[j];
+            hole = j;
+        }
+    }
+    objects[hole].ptr = 0;
+    objects_used--;
+    buckets[obj.bucket].inuse_objs--;
+    buckets[obj.bucket].inuse_bytes -= obj.size;
+    atomic_fetch_sub_explicit(&heapprof_filter[heapprof_slot(p)], 1, memory_order_relaxed);
+    unlock();
+    if (out) *out = obj;
+    return 0;
+}
+
+void heapprof_restore(const struct heap_object *obj) {
+    lock();
+    if (object_insert(obj) != 0) dropped++;
+    unlock();
+}
+
+/* Buffered writes to the profile; it must not allocate */
+struct out {
+    int fd;
+    size_t len;
+    char *buf;
+};
+
+static void out_flush(struct out *o) {
+    diag_write(o->fd, o->buf, o->len);
+    o->len = 0;
+}
+
+__attribute__((format(printf, 2, 3)))
+static void out_printf(struct out *o, const char *fmt, ...) {
+    if (o->len + 512 > HEAP_OUT_BUFFER) out_flush(o);
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(o->buf + o->len, HEAP_OUT_BUFFER - o->len, fmt, ap);
+    va_end(ap);
+    if (n > 0) o->len += (size_t)n < HEAP_OUT_BUFFER - o->len ? (size_t)n : HEAP_OUT_BUFFER - o->len - 1;
+}
+
+/* heap_v2: a totals header, one line per stack, then the mappings pprof
+ * symbolizes against. Counts are the raw samples; pprof scales them. */
+static void write_profile(const char *path) {
+    size_t bytes = HEAP_BUCKETS * sizeof(*buckets);
+    struct heap_bucket *snap = arena_map(bytes);
+    char *buf = arena_map(HEAP_OUT_BUFFER);
+    if (!snap || !buf) {
+        if (snap) arena_unmap(snap, bytes);
+        if (buf) arena_unmap(buf, HEAP_OUT_BUFFER);
+        return;
+    }
+    lock();
+    memcpy(snap, buckets, bytes);
+    uint64_t lost = dropped;
+    unlock();
+
+    struct out o = { open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644), 0, buf };
+    if (o.fd < 0) {
+        char msg[320];
+        int len = snprintf(msg, sizeof(msg), "interceptor: cannot write heap profile %s\n", path);
+        if (len > 0) diag_write(2, msg, (size_t)len);
+    } else {
+        uint64_t t[4] = { 0 }, stacks = 0;
+        for (size_t i = 0; i < HEAP_BUCKETS; ++i) {
+            if (!snap[i].alloc_objs) continue;
+            t[0] += snap[i].inuse_objs;
+            t[1] += snap[i].inuse_bytes;
+            t[2] += snap[i].alloc_objs;
+            t[3] += snap[i].alloc_bytes;
+            stacks++;
+        }
+        out_printf(&o, "heap profile: %6" PRIu64 ": %8" PRIu64 " [%6" PRIu64 ": %8" PRIu64 "] @ heap_v2/%" PRIu64 "\n",
+                   t[0], t[1], t[2], t[3], sample_mean);
+        for (size_t i = 0; i < HEAP_BUCKETS; ++i) {
+            const struct heap_bucket *b = &snap[i];
+            if (!b->alloc_objs) continue;
+            out_printf(&o, "%6" PRIu64 ": %8" PRIu64 " [%6" PRIu64 ": %8" PRIu64 "] @",
+                       b->inuse_objs, b->inuse_bytes, b->alloc_objs, b->alloc_bytes);
+            for (uint32_t d = 0; d < b->depth; ++d) out_printf(&o, " 0x%016" PRIxPTR, b->pcs[d]);
+            out_printf(&o, "\n");
+        }
+        out_printf(&o, "\nMAPPED_LIBRARIES:\n");
+        out_flush(&o);
+        int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+        ssize_t n;
+        while (maps >= 0 && (n = read(maps, buf, HEAP_OUT_BUFFER)) > 0) {
+            o.len = (size_t)n;
+            out_flush(&o);
+        }
+        if (maps >= 0) close(maps);
+        close(o.fd);
+
+        char msg[320];
+        int len = snprintf(msg, sizeof(msg), "interceptor: heap profile %s: %" PRIu64 " samples from %" PRIu64
+                           " stacks, %" PRIu64 " in use\n", path, t[2], stacks, t[0]);
+        if (len > 0) diag_write(2, msg, (size_t)len);
+        if (lost) {
+            len = snprintf(msg, sizeof(msg), "interceptor: heap profile: %" PRIu64 " samples dropped (tables full)\n", lost);
+            if (len > 0) diag_write(2, msg, (size_t)len);
+        }
+    }
+    arena_unmap(buf, HEAP_OUT_BUFFER);
+    arena_unmap(snap, bytes);
+}
+
+/* Forked children write their own files */
+static void profile_name(char *buf, size_t len, unsigned seq) {
+    int child = getpid() != profile_pid;
+    if (seq && child) snprintf(buf, len, "%s.%d.%u", profile_path, (int)getpid(), seq);
+    else if (seq) snprintf(buf, len, "%s.%u", profile_path, seq);
+    else if (child) snprintf(buf, len, "%s.%d", profile_path, (int)getpid());
+    else snprintf(buf, len, "%s", profile_path);
+}
+
+/* sem_post is async-signal-safe, which is all the handler may do */
+static void dump_signal(int signo) {
+    (void)signo;
+    int saved = errno;
+    sem_post(&dump_wake);
+    errno = saved;
+}
+
+static void *dumper_main(void *arg) {
+    (void)arg;
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+    for (;;) {
+        while (sem_wait(&dump_wake) != 0 && errno == EINTR)
+            ;
+        char path[256];
+        profile_name(path, sizeof(path), ++dumps);
+        write_profile(path);
+    }
+    return NULL;
+}
+
+int heapprof_init(const char *path, uint64_t sample_bytes, int signo) {
+    profile_path = path;
+    profile_pid = getpid();
+    sample_mean = sample_bytes ? sample_bytes : 512 * 1024;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    sample_seed = rng_splitmix((uint64_t)now.tv_nsec ^ ((uint64_t)now.tv_sec << 20) ^ (uint64_t)profile_pid);
+    buckets = arena_map(HEAP_BUCKETS * sizeof(*buckets));
+    if (!buckets) return -1;
+    if (signo <= 0) return 0;
+
+    if (sem_init(&dump_wake, 0, 0) != 0) return -1;
+    pthread_t thread;
+    if (thread_create_internal(&thread, dumper_main, "malloc-heapprof") != 0) return -1;
+    pthread_detach(thread);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = dump_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    return sigaction(signo, &sa, NULL);
+}
+
+void heapprof_finish(void) {
+    if (!profile_path) return;
+    char path[256];
+    profile_name(path, sizeof(path), 0);
+    write_profile(path);
+}
+
+void heapprof_fork_prepare(void) {
+    lock();
+}
+
+void heapprof_fork_release(void) {
+    unlock();
+}
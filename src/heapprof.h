@@ -0,0 +1,72 @@
+#ifndef HEAPPROF_H
+#define HEAPPROF_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "thread_state.h"
+
+/* Sampling heap profiler (MALLOC_FAIL_HEAP_PROFILE=<file>).
+ *
+ * As in tcmalloc, about one allocation per MALLOC_FAIL_HEAP_SAMPLE bytes
+ * (512 KiB by default) is sampled. Each thread counts down a random,
+ * exponentially distributed number of bytes, so an unsampled allocation
+ * costs one subtraction. A sampled block's stack is captured with the
+ * call-site frame walk, and the block stays in a table until it is freed.
+ * free() first checks a counting filter indexed by pointer hash, so
+ * freeing an unsampled block takes no lock. Profiles are written in
+ * gperftools' heap_v2 text format (pprof does the unsampling) at exit and
+ * on MALLOC_FAIL_HEAP_SIGNAL.
+ */
+
+#define HEAP_MAX_DEPTH 32
+#define HEAP_FILTER_SIZE 65536 /* power of two */
+
+/* A sampled block, as saved across realloc */
+struct heap_object {
+    uintptr_t ptr;      /* 0 = empty slot */
+    uint64_t size;
+    uint32_t bucket;    /* stack it was allocated from */
+};
+
+extern _Atomic uint32_t heapprof_filter[HEAP_FILTER_SIZE];
+
+/* Set up sampling every sample_bytes on average. signo > 0 also writes a
+ * numbered profile each time that signal arrives. Returns 0 on success. */
+int heapprof_init(const char *path, uint64_t sample_bytes, int signo);
+
+/* Slow path of heapprof_alloc: re-arm the countdown, record the block */
+void heapprof_sample(struct thread_state *ts, void *p, size_t size, const void *caller);
+
+/* Drop a sampled block, copying it to *out if out is non-NULL. Returns 0
+ * if p was sampled. */
+int heapprof_forget(void *p, struct heap_object *out);
+
+/* Put back a block heapprof_forget removed (a realloc that failed) */
+void heapprof_restore(const struct heap_object *obj);
+
+static inline unsigned heapprof_slot(const void *p) {
+    return (unsigned)(((uintptr_t)p >> 4) * 0x9e3779b97f4a7c15ULL >> 48) & (HEAP_FILTER_SIZE - 1);
+}
+
+/* A block of size bytes was handed out */
+static inline void heapprof_alloc(struct thread_state *ts, void *p, size_t size, const void *caller) {
+    ts->heap_countdown -= (int64_t)size;
+    if (__builtin_expect(ts->heap_countdown < 0, 0)) heapprof_sample(ts, p, size, caller);
+}
+
+/* p is about to be freed. Returns 0 if it was sampled (and saves it). */
+static inline int heapprof_free(void *p, struct heap_object *out) {
+    if (!atomic_load_explicit(&heapprof_filter[heapprof_slot(p)], memory_order_relaxed)) return -1;
+    return heapprof_forget(p, out);
+}
+
+/* Write the final profile */
+void heapprof_finish(void);
+
+/* pthread_atfork handlers: the table lock is not held across fork() */
+void heapprof_fork_prepare(void);
+void heapprof_fork_release(void);
+
+#endif
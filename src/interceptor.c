@@ -1,5 +1,6 @@
 #define _GNU_SOURCE
 #include <dlfcn.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdatomic.h>
@@ -8,217 +9,1001 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <fcntl.h>
+
+#include <pthread.h>
+#include <signal.h>
+
+#include "arena.h"
+#include "bootstrap.h"
+#include "budget.h"
+#include "control.h"
+#include "diag.h"
+#include "failspec.h"
+#include "forksrv.h"
+#include "heapprof.h"
+#include "latency.h"
+#include "plan.h"
+#include "record.h"
+#include "rng.h"
+#include "rule.h"
+#include "shmstats.h"
+#include "sites.h"
+#include "thread_state.h"
+#include "threads.h"
+#include "trace.h"
+#include "track.h"
+#include "tree.h"
+
+/* Stand-ins for the real functions until resolve_real() has run: the
+ * first call resolves all of them at once, calls made while dlsym is
+ * working are served from the bootstrap arena. Wrappers therefore call
+ * through the pointers unconditionally. */
+static void *boot_malloc(size_t size);
+static void *boot_calloc(size_t nmemb, size_t size);
+static void *boot_realloc(void *ptr, size_t size);
+static void boot_free(void *ptr);
+static int boot_posix_memalign(void **memptr, size_t alignment, size_t size);
+static void *boot_aligned_alloc(size_t alignment, size_t size);
+static void *boot_memalign(size_t alignment, size_t size);
+static void *boot_valloc(size_t size);
+static void *boot_pvalloc(size_t size);
 
 /* Function pointers to real allocation functions */
-static void *(*real_malloc)(size_t) = NULL;
-static void *(*real_calloc)(size_t, size_t) = NULL;
-static void *(*real_realloc)(void *, size_t) = NULL;
-static void (*real_free)(void *) = NULL;
-static int (*real_posix_memalign)(void **, size_t, size_t) = NULL;
-static void *(*real_aligned_alloc)(size_t, size_t) = NULL;
-static void *(*real_memalign)(size_t, size_t) = NULL;
-static void *(*real_valloc)(size_t) = NULL;
-static void *(*real_pvalloc)(size_t) = NULL;
+static void *(*real_malloc)(size_t) = boot_malloc;
+static void *(*real_calloc)(size_t, size_t) = boot_calloc;
+static void *(*real_realloc)(void *, size_t) = boot_realloc;
+static void (*real_free)(void *) = boot_free;
+static int (*real_posix_memalign)(void **, size_t, size_t) = boot_posix_memalign;
+static void *(*real_aligned_alloc)(size_t, size_t) = boot_aligned_alloc;
+static void *(*real_memalign)(size_t, size_t) = boot_memalign;
+static void *(*real_valloc)(size_t) = boot_valloc;
+static void *(*real_pvalloc)(size_t) = boot_pvalloc;
+
+enum { UNRESOLVED, RESOLVING, RESOLVED };
+static _Atomic int resolve_state = UNRESOLVED;
+
+/* What a symbol the next library does not provide turns into */
+static void *missing_alloc(size_t size) {
+    (void)size;
+    errno = ENOMEM;
+    return NULL;
+}
+static void *missing_alloc2(size_t a, size_t b) {
+    (void)a, (void)b;
+    errno = ENOMEM;
+    return NULL;
+}
+static void *missing_realloc(void *ptr, size_t size) {
+    (void)ptr, (void)size;
+    errno = ENOMEM;
+    return NULL;
+}
+static void missing_free(void *ptr) {
+    (void)ptr;
+}
+static int missing_posix_memalign(void **memptr, size_t alignment, size_t size) {
+    (void)memptr, (void)alignment, (void)size;
+    return ENOMEM;
+}
+
+#define RESOLVE(ptr, name, missing) do { \
+    void *sym = dlsym(RTLD_NEXT, name); \
+    ptr = sym ? (__typeof__(ptr))sym : (missing); \
+    if (!sym) missing_count++; \
+} while (0)
+
+/* Look up every real function once. Until it returns, calls from dlsym
+ * itself (or from another thread) are served by the bootstrap arena. */
+static void resolve_real(void) {
+    int expected = UNRESOLVED;
+    if (!atomic_compare_exchange_strong(&resolve_state, &expected, RESOLVING)) return;
+    int missing_count = 0;
+    RESOLVE(real_malloc, "malloc", missing_alloc);
+    RESOLVE(real_calloc, "calloc", missing_alloc2);
+    RESOLVE(real_realloc, "realloc", missing_realloc);
+    RESOLVE(real_free, "free", missing_free);
+    RESOLVE(real_posix_memalign, "posix_memalign", missing_posix_memalign);
+    RESOLVE(real_aligned_alloc, "aligned_alloc", missing_alloc2);
+    RESOLVE(real_memalign, "memalign", missing_alloc2);
+    RESOLVE(real_valloc, "valloc", missing_alloc);
+    RESOLVE(real_pvalloc, "pvalloc", missing_alloc);
+    atomic_store_explicit(&resolve_state, RESOLVED, memory_order_release);
+    if (missing_count) {
+        /* Use write() to avoid malloc recursion */
+        const char *msg = "interceptor: warning: dlsym failed to load real allocators\n";
+        diag_write(2, msg, strlen(msg));
+    }
+}
+
+/* Non-zero while the stand-ins must serve calls themselves */
+static int bootstrapping(void) {
+    if (atomic_load_explicit(&resolve_state, memory_order_acquire) == UNRESOLVED) resolve_real();
+    return atomic_load_explicit(&resolve_state, memory_order_acquire) != RESOLVED;
+}
+
+static void *boot_malloc(size_t size) {
+    return bootstrapping() ? bootstrap_alloc(size, 16) : real_malloc(size);
+}
+
+static void *boot_calloc(size_t nmemb, size_t size) {
+    if (!bootstrapping()) return real_calloc(nmemb, size);
+    if (size && nmemb > SIZE_MAX / size) return NULL;
+    return bootstrap_alloc(nmemb * size, 16); /* arena memory is never reused: already zero */
+}
+
+static void *boot_realloc(void *ptr, size_t size) {
+    if (!bootstrapping()) return real_realloc(ptr, size);
+    void *p = bootstrap_alloc(size, 16);
+    if (p && ptr) { /* nothing but arena blocks exists yet */
+        size_t old = bootstrap_size(ptr);
+        memcpy(p, ptr, old < size ? old : size);
+    }
+    return p;
+}
+
+static void boot_free(void *ptr) {
+    if (!bootstrapping()) real_free(ptr);
+}
+
+static int boot_posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (!bootstrapping()) return real_posix_memalign(memptr, alignment, size);
+    *memptr = bootstrap_alloc(size, alignment);
+    return *memptr ? 0 : ENOMEM;
+}
+
+static void *boot_aligned_alloc(size_t alignment, size_t size) {
+    return bootstrapping() ? bootstrap_alloc(size, alignment) : real_aligned_alloc(alignment, size);
+}
+
+static void *boot_memalign(size_t alignment, size_t size) {
+    return bootstrapping() ? bootstrap_alloc(size, alignment) : real_memalign(alignment, size);
+}
+
+static void *boot_valloc(size_t size) {
+    return bootstrapping() ? bootstrap_alloc(size, 4096) : real_valloc(size);
+}
+
+static void *boot_pvalloc(size_t size) {
+    return bootstrapping() ? bootstrap_alloc((size + 4095) & ~(size_t)4095, 4096) : real_pvalloc(size);
+}
 
 /* Atomic allocation counter (absolute, includes init) */
 static _Atomic uint64_t alloc_count = 0;
 /* base_count stores how many allocations happened during init (so we offset them) */
 static _Atomic uint64_t base_count = 0;
+/* Visible index of the first injected failure, 0 until one happens */
+static _Atomic uint64_t first_failure = 0;
+
+/* Failure policy, compiled from the environment by init_malloc_fail or
+ * from the control file (MALLOC_FAIL_CONTROL) */
+struct fail_config;
+typedef int (*decide_fn)(const struct fail_config *cfg, struct thread_state *ts,
+                         enum alloc_fn fn, uint64_t visible_index, size_t size);
+
+struct fail_config {
+    decide_fn decide;        /* NULL means never fail */
+    struct failspec points;  /* MALLOC_FAIL_AT intervals */
+    uint64_t every;          /* 0 means disabled */
+    int64_t offset;          /* signed offset applied to visible index */
+    uint64_t size_min;       /* 0 = no minimum */
+    uint64_t size_max;       /* 0 = no maximum */
+    uint64_t rate;           /* MALLOC_FAIL_RATE scaled to 2^64, 0 = disabled */
+    uint64_t seed;           /* MALLOC_FAIL_SEED */
+    struct rule_set rules;   /* MALLOC_FAIL_RULE */
+    int needs_index;         /* decide reads the visible index */
+    struct thread_sel thread; /* "name:spec": index one thread's own calls */
+    struct tree_sel proc;    /* "@proc:spec": one process's calls, or the tree's */
+};
+
+/* The policy in effect. A new one is installed with a single pointer
+ * store and old ones are never freed, so the hot path reads it without a
+ * lock and a call still holding an old pointer stays safe (RCU without
+ * reclamation; each swap costs a few hundred bytes of arena). */
+static const struct fail_config no_failures;
+static _Atomic(const struct fail_config *) active_config = &no_failures;
+
+static _Atomic int stats_mode = 0; /* if set, print statistics at exit */
+static const char *stats_file = NULL; /* MALLOC_FAIL_STATS_FILE, default stderr */
+static _Atomic uint64_t base_total = 0; /* counted calls before init (or the last rebase) */
+
+/* MALLOC_FAIL_SITE restricts failures to matching sites;
+ * MALLOC_FAIL_SITE_FIRST fails the first N hits of each (matching) site */
+static int site_filter = 0;
+static uint64_t site_first_n = 0;
+
+/* MALLOC_FAIL_PLAN_OUT: write the sites seen by this run as a plan */
+static const char *plan_out = NULL;
+static unsigned plan_out_depth = 1;
+
+/* MALLOC_FAIL_FORKSRV: visible index to stop at (0 = only the explicit hook) */
+static uint64_t forksrv_at = 0;
+static int forksrv_fd = FORKSRV_FD_DEFAULT;
+
+/* Work the wrappers do beyond calling the real function. Zero means pure
+ * passthrough; init_malloc_fail picks the bits once for the configuration.
+ */
+#define HOOK_BOOTSTRAP (1u << 0) /* init has not run yet */
+#define HOOK_INDEX     (1u << 1) /* assign a global index (and decide) */
+#define HOOK_STATS     (1u << 2) /* per-thread counters */
+#define HOOK_DEBUG     (1u << 3) /* per-call decision log */
+#define HOOK_TRACE     (1u << 4) /* binary decision trace */
+#define HOOK_FORKSRV   (1u << 5) /* fork server armed at forksrv_at */
+#define HOOK_SITE      (1u << 6) /* call-site lookup */
+#define HOOK_TRACK     (1u << 7) /* live pointer table */
+#define HOOK_LIMIT     (1u << 8) /* live-bytes budget */
+#define HOOK_DECIDE    (1u << 9) /* run a policy that needs no index */
+#define HOOK_THREAD    (1u << 10) /* per-thread indices */
+#define HOOK_LATENCY   (1u << 11) /* time the real functions */
+#define HOOK_RECORD    (1u << 12) /* event log for malloc_replay */
+#define HOOK_HEAP      (1u << 13) /* sampling heap profile */
+#define HOOK_TREE      (1u << 14) /* tree-wide indices */
+
+/* Until init runs, count everything so base_count sees pre-init calls */
+static _Atomic unsigned hook_flags = HOOK_BOOTSTRAP | HOOK_INDEX | HOOK_STATS;
+/* What init enabled for everything but the failure policy */
+static unsigned feature_hooks = 0;
+/* Whether those, or a possible reload, need thread ordinals */
+static int feature_ordinals = 1;
+
+/* Index-based policy: MALLOC_FAIL_AT / MALLOC_FAIL_EVERY, no size window */
+static int decide_index(const struct fail_config *cfg, struct thread_state *ts,
+                        enum alloc_fn fn, uint64_t visible_index, size_t size) {
+    (void)fn;
+    (void)size;
+    int64_t adjusted = (int64_t)visible_index + cfg->offset;
+    if (adjusted <= 0) return 0; /* adjusted indices <= 0 are never considered */
+    uint64_t adj = (uint64_t) adjusted;
 
-/* Configuration parsed from env */
-#define MAX_FAIL_ENTRIES 512
-static uint64_t fail_points[MAX_FAIL_ENTRIES];
-static size_t fail_points_count = 0;
-static _Atomic uint64_t fail_every = 0; /* 0 means disabled */
-
-/* Extra config */
-static _Atomic int64_t fail_offset = 0; /* signed offset applied to visible index */
-static _Atomic int debug_mode = 0;      /* if set, write diagnostics when making fail decision */
-static _Atomic int stats_mode = 0;      /* if set, print statistics at exit */
-static _Atomic uint64_t fail_size_min = 0; /* 0 = no minimum */
-static _Atomic uint64_t fail_size_max = 0; /* 0 = no maximum */
-
-/* Statistics counters */
-static _Atomic uint64_t stats_malloc_total = 0;
-static _Atomic uint64_t stats_malloc_failed = 0;
-static _Atomic uint64_t stats_calloc_total = 0;
-static _Atomic uint64_t stats_calloc_failed = 0;
-static _Atomic uint64_t stats_realloc_total = 0;
-static _Atomic uint64_t stats_realloc_failed = 0;
-static _Atomic uint64_t stats_posix_memalign_total = 0;
-static _Atomic uint64_t stats_posix_memalign_failed = 0;
-static _Atomic uint64_t stats_aligned_alloc_total = 0;
-static _Atomic uint64_t stats_aligned_alloc_failed = 0;
-static _Atomic uint64_t stats_memalign_total = 0;
-static _Atomic uint64_t stats_memalign_failed = 0;
-static _Atomic uint64_t stats_valloc_total = 0;
-static _Atomic uint64_t stats_valloc_failed = 0;
-static _Atomic uint64_t stats_pvalloc_total = 0;
-static _Atomic uint64_t stats_pvalloc_failed = 0;
-
-/* Helper: parse comma-separated numbers/ranges, e.g. "5,10-12,20" */
-static void parse_fail_at(const char *s) {
-    if (!s) return;
-    char *copy = strdup(s);
-    if (!copy) return;
-    char *tok = strtok(copy, ",");
-    while (tok && fail_points_count < MAX_FAIL_ENTRIES) {
-        while (*tok == ' ') tok++;
-        char *dash = strchr(tok, '-');
-        if (dash) {
-            *dash = '\0';
-            uint64_t a = strtoull(tok, NULL, 10);
-            uint64_t b = strtoull(dash + 1, NULL, 10);
-            if (a == 0 || b == 0) {
-                /* ignore zero or invalid ranges */
-            } else {
-                if (a > b) { uint64_t t = a; a = b; b = t; }
-                for (uint64_t v = a; v <= b && fail_points_count < MAX_FAIL_ENTRIES; ++v) {
-                    fail_points[fail_points_count++] = v;
-                    if (v == UINT64_MAX) break; /* avoid overflow */
-                }
-            }
-        } else {
-            uint64_t v = strtoull(tok, NULL, 10);
-            if (v > 0 && fail_points_count < MAX_FAIL_ENTRIES)
-                fail_points[fail_points_count++] = v;
-        }
-        tok = strtok(NULL, ",");
+    if (cfg->every > 0 && (adj % cfg->every) == 0) return 1;
+    return failspec_contains(&cfg->points, adj, &ts->fail_cursor);
+}
+
+/* Same as decide_index, behind MALLOC_FAIL_SIZE_MIN/MAX */
+static int decide_index_sized(const struct fail_config *cfg, struct thread_state *ts,
+                              enum alloc_fn fn, uint64_t visible_index, size_t size) {
+    if (cfg->size_min > 0 && (uint64_t)size < cfg->size_min) return 0;
+    if (cfg->size_max > 0 && (uint64_t)size > cfg->size_max) return 0;
+    return decide_index(cfg, ts, fn, visible_index, size);
+}
+
+/* Threads started through pthread_create draw the stream of their
+ * creation ordinal; any other thread gets one in the order it first draws */
+static _Atomic uint32_t next_stream = 0;
+
+/* MALLOC_FAIL_RATE: one draw from the thread's own stream */
+static inline int draw_fails(const struct fail_config *cfg, struct thread_state *ts) {
+    if (__builtin_expect(ts->rng == 0, 0)) {
+        ts->rng_stream = ts->ordinal != THREAD_ORDINAL_NONE
+                       ? ts->ordinal
+                       : (1u << 31) + atomic_fetch_add_explicit(&next_stream, 1, memory_order_relaxed);
+        ts->rng = rng_stream_state(cfg->seed, ts->rng_stream);
     }
-    free(copy);
+    return rng_next(&ts->rng) < cfg->rate;
+}
+
+/* Probabilistic policy, size window included: no index needed */
+static int decide_rate(const struct fail_config *cfg, struct thread_state *ts,
+                       enum alloc_fn fn, uint64_t visible_index, size_t size) {
+    (void)fn;
+    (void)visible_index;
+    if (cfg->size_min > 0 && (uint64_t)size < cfg->size_min) return 0;
+    if (cfg->size_max > 0 && (uint64_t)size > cfg->size_max) return 0;
+    return draw_fails(cfg, ts);
 }
 
-/* Check whether current visible index (after applying offset) should fail. */
-static int should_fail(uint64_t visible_index, size_t size) {
-    if (visible_index == 0) return 0;
+/* Index and rate together; the stream is drawn only for visible calls */
+static int decide_index_rate(const struct fail_config *cfg, struct thread_state *ts,
+                             enum alloc_fn fn, uint64_t visible_index, size_t size) {
+    if (decide_index_sized(cfg, ts, fn, visible_index, size)) return 1;
+    return decide_rate(cfg, ts, fn, visible_index, size);
+}
 
-    /* Check size constraints */
-    uint64_t min_size = atomic_load(&fail_size_min);
-    uint64_t max_size = atomic_load(&fail_size_max);
-    if (min_size > 0 && (uint64_t)size < min_size) return 0;
-    if (max_size > 0 && (uint64_t)size > max_size) return 0;
+/* MALLOC_FAIL_RULE, evaluated with only the terms it uses. idx is offset
+ * like MALLOC_FAIL_AT's indices. */
+static inline int match_rules(const struct fail_config *cfg, unsigned uses, enum alloc_fn fn,
+                              uint64_t visible_index, size_t size) {
+    uint64_t idx = 0;
+    if (uses & RULE_USES_IDX) {
+        int64_t adjusted = (int64_t)visible_index + cfg->offset;
+        if (adjusted <= 0) return 0;
+        idx = (uint64_t)adjusted;
+    }
+    return rule_match(&cfg->rules, uses, fn, size, idx);
+}
 
-    int64_t offset = atomic_load(&fail_offset);
-    int64_t adjusted = (int64_t)visible_index + offset;
-    if (adjusted <= 0) return 0; /* adjusted indices <= 0 are never considered */
-    uint64_t adj = (uint64_t) adjusted;
+static int decide_rule(const struct fail_config *cfg, struct thread_state *ts,
+                       enum alloc_fn fn, uint64_t visible_index, size_t size) {
+    (void)ts;
+    return match_rules(cfg, RULE_USES_FN | RULE_USES_IDX, fn, visible_index, size);
+}
+
+static int decide_rule_fn(const struct fail_config *cfg, struct thread_state *ts,
+                          enum alloc_fn fn, uint64_t visible_index, size_t size) {
+    (void)ts;
+    return match_rules(cfg, RULE_USES_FN, fn, visible_index, size);
+}
 
-    uint64_t e = atomic_load(&fail_every);
-    if (e > 0 && (adj % e) == 0) return 1;
-    for (size_t i = 0; i < fail_points_count; ++i) {
-        if (fail_points[i] == adj) return 1;
+static int decide_rule_idx(const struct fail_config *cfg, struct thread_state *ts,
+                           enum alloc_fn fn, uint64_t visible_index, size_t size) {
+    (void)ts;
+    return match_rules(cfg, RULE_USES_IDX, fn, visible_index, size);
+}
+
+static int decide_rule_size(const struct fail_config *cfg, struct thread_state *ts,
+                            enum alloc_fn fn, uint64_t visible_index, size_t size) {
+    (void)ts;
+    return match_rules(cfg, 0, fn, visible_index, size);
+}
+
+/* Rules next to MALLOC_FAIL_AT/EVERY/RATE: any of them fails the call */
+static int decide_rule_any(const struct fail_config *cfg, struct thread_state *ts,
+                           enum alloc_fn fn, uint64_t visible_index, size_t size) {
+    if (match_rules(cfg, cfg->rules.uses, fn, visible_index, size)) return 1;
+    if (cfg->points.count > 0 || cfg->every > 0) {
+        if (decide_index_sized(cfg, ts, fn, visible_index, size)) return 1;
     }
-    return 0;
+    return cfg->rate && decide_rate(cfg, ts, fn, visible_index, size);
 }
 
-/* Print statistics at program exit */
-__attribute__((destructor))
-static void print_malloc_stats(void) {
-    if (!atomic_load(&stats_mode)) return;
+/* Install the decision function matching the config */
+static void select_decide(struct fail_config *cfg) {
+    int index = cfg->points.count > 0 || cfg->every > 0;
+    if (cfg->rules.count && (index || cfg->rate))
+        cfg->decide = decide_rule_any;
+    else if (cfg->rules.count) {
+        static const decide_fn by_uses[] = {
+            [0] = decide_rule_size,
+            [RULE_USES_FN] = decide_rule_fn,
+            [RULE_USES_IDX] = decide_rule_idx,
+            [RULE_USES_FN | RULE_USES_IDX] = decide_rule,
+        };
+        cfg->decide = by_uses[cfg->rules.uses];
+    }
+    else if (index && cfg->rate)
+        cfg->decide = decide_index_rate;
+    else if (index)
+        cfg->decide = (cfg->size_min || cfg->size_max) ? decide_index_sized : decide_index;
+    else if (cfg->rate)
+        cfg->decide = decide_rate;
+    else
+        cfg->decide = NULL;
+    cfg->needs_index = index || (cfg->rules.uses & RULE_USES_IDX);
+}
+
+/* Hook bits a policy needs */
+static unsigned config_hooks(const struct fail_config *cfg) {
+    if (!cfg->decide) return 0;
+    if (!cfg->needs_index) return HOOK_DECIDE;
+    if (cfg->proc.kind == TREE_SEL_ALL) return HOOK_TREE;
+    return cfg->thread.kind != THREAD_SEL_NONE ? HOOK_THREAD : HOOK_INDEX;
+}
+
+typedef const char *(*config_get_fn)(const char *name, const void *ctx);
+
+static const char *env_get(const char *name, const void *ctx) {
+    (void)ctx;
+    return getenv(name);
+}
 
+static const char *control_file_get(const char *name, const void *ctx) {
+    return control_get(ctx, name);
+}
+
+/* Compile MALLOC_FAIL_AT/EVERY/OFFSET/SIZE_MIN/SIZE_MAX/RATE/RULE into cfg */
+static void config_parse(struct fail_config *cfg, config_get_fn get, const void *ctx) {
+    const char *at = get("MALLOC_FAIL_AT", ctx);
+    const char *every = get("MALLOC_FAIL_EVERY", ctx);
+    const char *offset = get("MALLOC_FAIL_OFFSET", ctx);
+    const char *size_min = get("MALLOC_FAIL_SIZE_MIN", ctx);
+    const char *size_max = get("MALLOC_FAIL_SIZE_MAX", ctx);
+    const char *rate = get("MALLOC_FAIL_RATE", ctx);
+    const char *seed = get("MALLOC_FAIL_SEED", ctx);
+    const char *rule = get("MALLOC_FAIL_RULE", ctx);
+
+    if (at && !(at = tree_sel_parse(&cfg->proc, at))) {
+        const char *msg = "interceptor: warning: malformed process selector in MALLOC_FAIL_AT, ignored\n";
+        diag_write(2, msg, strlen(msg));
+    }
+    if (at && cfg->proc.kind == TREE_SEL_NONE) at = thread_sel_parse(&cfg->thread, at);
+    if (at && failspec_parse(&cfg->points, at) != 0) {
+        const char *msg = "interceptor: warning: could not map memory for MALLOC_FAIL_AT\n";
+        diag_write(2, msg, strlen(msg));
+    }
+    if (every) {
+        uint64_t v = strtoull(every, NULL, 10);
+        if (v > 0) cfg->every = v;
+    }
+    if (offset) {
+        long long o = strtoll(offset, NULL, 10);
+        cfg->offset = (int64_t)o;
+    }
+    if (size_min) {
+        uint64_t v = strtoull(size_min, NULL, 10);
+        if (v > 0) cfg->size_min = v;
+    }
+    if (size_max) {
+        uint64_t v = strtoull(size_max, NULL, 10);
+        if (v > 0) cfg->size_max = v;
+    }
+    if (rate) {
+        double r = strtod(rate, NULL);
+        if (r >= 1.0) cfg->rate = UINT64_MAX;
+        else if (r > 0.0) cfg->rate = (uint64_t)(r * 18446744073709551616.0);
+    }
+    if (rule) {
+        const char *error, *where;
+        if (rule_parse(&cfg->rules, rule, &error, &where) != 0) {
+            char msg[160];
+            int len = snprintf(msg, sizeof(msg), "interceptor: warning: invalid MALLOC_FAIL_RULE: %s at \"%.24s\"\n",
+                               error, where);
+            if (len > 0) diag_write(2, msg, (size_t)len);
+        }
+    }
+    if (seed) {
+        cfg->seed = strtoull(seed, NULL, 0);
+    } else if (cfg->rate) {
+        /* Unseeded runs still get logged, so any of them can be replayed */
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        cfg->seed = rng_splitmix((uint64_t)now.tv_nsec ^ ((uint64_t)now.tv_sec << 20) ^
+                                 (uint64_t)getpid());
+    }
+    if (cfg->rate) {
+        char msg[160];
+        int len = snprintf(msg, sizeof(msg), "interceptor: MALLOC_FAIL_RATE=%s MALLOC_FAIL_SEED=%" PRIu64
+                           " (pid %d)\n", rate, cfg->seed, (int)getpid());
+        if (len > 0) diag_write(2, msg, (size_t)len);
+    }
+    select_decide(cfg);
+}
+
+/* Make cfg the policy in effect. Indices are assigned from here on if
+ * it needs them. */
+static void config_install(const struct fail_config *cfg) {
+    /* Recomputed, not OR-ed: a policy that needs nothing returns the hot
+     * path to what the other features need (passthrough if none) */
+    unsigned flags = atomic_load(&hook_flags), want;
+    do {
+        want = feature_hooks | config_hooks(cfg) | (flags & HOOK_FORKSRV);
+    } while (!atomic_compare_exchange_weak(&hook_flags, &flags, want));
+    /* Selectors, per-thread rate streams and the report use ordinals */
+    thread_numbering(feature_ordinals || (want & HOOK_THREAD) || cfg->rate);
+    atomic_store_explicit(&active_config, cfg, memory_order_release);
+    thread_sel_invalidate();
+}
+
+/* Snapshot of the visible-call total for the statistics report */
+static uint64_t stats_grand_total(void) {
+    struct stats_totals totals;
+    thread_state_snapshot(&totals);
+    uint64_t all = 0;
+    for (int fn = 0; fn < FN_COUNT; ++fn) all += totals.total[fn];
+    return all;
+}
+
+/* MALLOC_FAIL_CONTROL: compile the file into a fresh policy and swap it
+ * in. MALLOC_FAIL_REBASE=1 restarts visible numbering at the swap. */
+static void apply_control(const struct control_file *file) {
+    struct fail_config *cfg = arena_alloc(sizeof(*cfg));
+    if (!cfg) return;
+    config_parse(cfg, control_file_get, file);
+
+    const char *rebase = control_get(file, "MALLOC_FAIL_REBASE");
+    if (rebase && strtoul(rebase, NULL, 10) != 0) {
+        atomic_store(&base_count, atomic_load(&alloc_count));
+        atomic_store(&first_failure, 0);
+        base_total = stats_grand_total();
+    }
+    config_install(cfg);
+}
+
+/* Report layouts for MALLOC_FAIL_STATS_FORMAT */
+enum stats_format { STATS_TEXT, STATS_JSON, STATS_CSV };
+static int stats_format = STATS_TEXT;
+
+/* Formatted write to a descriptor; the report must not allocate */
+__attribute__((format(printf, 2, 3)))
+static void outf(int fd, const char *fmt, ...) {
     char buf[1024];
-    int len;
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (len > 0) diag_write(fd, buf, (size_t)len < sizeof(buf) ? (size_t)len : sizeof(buf) - 1);
+}
 
-    len = snprintf(buf, sizeof(buf), "\n=== Malloc Interceptor Statistics ===\n");
-    if (len > 0) write(2, buf, len);
+/* Inclusive size range of a histogram bucket */
+static uint64_t bucket_lo(unsigned b) { return b ? UINT64_C(1) << (b - 1) : 0; }
+static uint64_t bucket_hi(unsigned b) { return b == 0 ? 0 : b == 64 ? UINT64_MAX : (UINT64_C(1) << b) - 1; }
+
+static void print_size_hist(int fd, unsigned fn, const uint64_t *count) {
+    uint64_t max = 0;
+    for (unsigned b = 0; b < SIZE_BUCKETS; ++b)
+        if (count[b] > max) max = count[b];
+    if (max == 0) return;
+    outf(fd, "%s sizes:\n", alloc_fn_name(fn));
+    for (unsigned b = 0; b < SIZE_BUCKETS; ++b) {
+        if (!count[b]) continue;
+        char bar[41];
+        unsigned width = (unsigned)((count[b] * 40 + max - 1) / max);
+        memset(bar, '#', width);
+        bar[width] = '\0';
+        outf(fd, "  %12" PRIu64 " - %-12" PRIu64 " %10" PRIu64 " %s\n",
+             bucket_lo(b), bucket_hi(b), count[b], bar);
+    }
+}
 
-    len = snprintf(buf, sizeof(buf), "malloc:          %10" PRIu64 " total, %10" PRIu64 " failed\n",
-                   atomic_load(&stats_malloc_total),
-                   atomic_load(&stats_malloc_failed));
-    if (len > 0) write(2, buf, len);
+/* Size range of a latency class */
+static uint64_t latency_lo(unsigned c) { return c == 0 ? 0 : (UINT64_C(64) << (2 * (c - 1))) + 1; }
+static uint64_t latency_hi(unsigned c) {
+    return c == LATENCY_CLASSES - 1 ? UINT64_MAX : UINT64_C(64) << (2 * c);
+}
 
-    len = snprintf(buf, sizeof(buf), "calloc:          %10" PRIu64 " total, %10" PRIu64 " failed\n",
-                   atomic_load(&stats_calloc_total),
-                   atomic_load(&stats_calloc_failed));
-    if (len > 0) write(2, buf, len);
+static void print_latency(int fd, struct latency_row rows[LATENCY_FNS][LATENCY_CLASSES]) {
+    outf(fd, "--- latency of the real allocator (ns) ---\n");
+    outf(fd, "%-16s %-7s %10s %8s %8s %8s %8s\n", "function", "size", "calls", "p50", "p99", "p99.9", "max");
+    for (unsigned fn = 0; fn < LATENCY_FNS; ++fn)
+        for (unsigned c = 0; c < LATENCY_CLASSES; ++c) {
+            const struct latency_row *r = &rows[fn][c];
+            if (!r->count) continue;
+            outf(fd, "%-16s %-7s %10" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 "\n",
+                 latency_fn_name(fn), latency_class_name(c), r->count, r->p50, r->p99, r->p999, r->max);
+        }
+}
 
-    len = snprintf(buf, sizeof(buf), "realloc:         %10" PRIu64 " total, %10" PRIu64 " failed\n",
-                   atomic_load(&stats_realloc_total),
-                   atomic_load(&stats_realloc_failed));
-    if (len > 0) write(2, buf, len);
+struct thread_row_ctx {
+    int fd;
+    unsigned rows;
+};
+
+/* One row per counter block. Blocks are recycled, so a row covers every
+ * thread that owned the block; tid is the latest owner. */
+static void print_thread_row(const struct thread_state *ts, void *arg) {
+    struct thread_row_ctx *ctx = arg;
+    uint64_t total = 0, failed = 0;
+    for (int fn = 0; fn < FN_COUNT; ++fn) {
+        total += atomic_load_explicit(&ts->total[fn], memory_order_relaxed);
+        failed += atomic_load_explicit(&ts->failed[fn], memory_order_relaxed);
+    }
+    if (total == 0) return;
+    switch (stats_format) {
+    case STATS_JSON:
+        outf(ctx->fd, "%s\n    {\"tid\": %" PRIu32 ", \"owners\": %" PRIu32 ", \"total\": %" PRIu64
+             ", \"failed\": %" PRIu64, ctx->rows ? "," : "", ts->tid, ts->owners, total, failed);
+        if (ts->ordinal != THREAD_ORDINAL_NONE) outf(ctx->fd, ", \"ordinal\": %" PRIu32, ts->ordinal);
+        if (ts->rng) outf(ctx->fd, ", \"stream\": %" PRIu32, ts->rng_stream);
+        outf(ctx->fd, "}");
+        break;
+    case STATS_CSV:
+        outf(ctx->fd, "thread,,%" PRIu32 ",,,%" PRIu64 ",%" PRIu64 "\n", ts->tid, total, failed);
+        break;
+    default:
+        outf(ctx->fd, "  tid %-8" PRIu32 " %4" PRIu32 " thread%s %10" PRIu64 " total, %10" PRIu64 " failed",
+             ts->tid, ts->owners, ts->owners == 1 ? " " : "s", total, failed);
+        if (ts->ordinal != THREAD_ORDINAL_NONE) outf(ctx->fd, ", #%" PRIu32, ts->ordinal);
+        if (ts->rng) outf(ctx->fd, ", stream %" PRIu32, ts->rng_stream);
+        outf(ctx->fd, "\n");
+    }
+    ctx->rows++;
+}
 
-    len = snprintf(buf, sizeof(buf), "posix_memalign:  %10" PRIu64 " total, %10" PRIu64 " failed\n",
-                   atomic_load(&stats_posix_memalign_total),
-                   atomic_load(&stats_posix_memalign_failed));
-    if (len > 0) write(2, buf, len);
+/* One row per process of the tree (MALLOC_FAIL_TREE), in the root's
+ * report. A process that is still running, or ended without exit
+ * handlers, has no counters yet. */
+struct tree_row_ctx {
+    int fd;
+    unsigned rows;
+    uint64_t total;
+    uint64_t failed;
+};
+
+static void print_tree_row(uint32_t ordinal, const struct tree_proc *proc, void *arg) {
+    struct tree_row_ctx *ctx = arg;
+    uint64_t total = 0, failed = 0;
+    for (int fn = 0; fn < FN_COUNT; ++fn) {
+        total += proc->total[fn];
+        failed += proc->failed[fn];
+    }
+    ctx->total += total;
+    ctx->failed += failed;
+    int exited = atomic_load_explicit(&proc->state, memory_order_acquire) == TREE_EXITED;
+    char parent[16] = "-";
+    if (proc->parent != TREE_NONE) snprintf(parent, sizeof(parent), "#%" PRIu32, proc->parent);
+    switch (stats_format) {
+    case STATS_JSON:
+        outf(ctx->fd, "%s\n    {\"ordinal\": %" PRIu32 ", \"pid\": %" PRId32 ", \"parent\": %s, "
+             "\"exited\": %s, \"total\": %" PRIu64 ", \"failed\": %" PRIu64 "}",
+             ctx->rows ? "," : "", ordinal, proc->pid, proc->parent != TREE_NONE ? parent + 1 : "null",
+             exited ? "true" : "false", total, failed);
+        break;
+    case STATS_CSV:
+        outf(ctx->fd, "process,,%" PRId32 ",,,%" PRIu64 ",%" PRIu64 "\n", proc->pid, total, failed);
+        break;
+    default:
+        outf(ctx->fd, "  #%-4" PRIu32 " pid %-8" PRId32 " parent %-5s %10" PRIu64 " total, %10" PRIu64 " failed%s\n",
+             ordinal, proc->pid, parent, total, failed, exited ? "" : " (running)");
+    }
+    ctx->rows++;
+}
 
-    len = snprintf(buf, sizeof(buf), "aligned_alloc:   %10" PRIu64 " total, %10" PRIu64 " failed\n",
-                   atomic_load(&stats_aligned_alloc_total),
-                   atomic_load(&stats_aligned_alloc_failed));
-    if (len > 0) write(2, buf, len);
+/* "latency": [[size_lo, size_hi, calls, p50, p99, p99.9, max], ...] per
+ * size class, in ns */
+static void print_latency_json(int fd, const struct latency_row *rows) {
+    outf(fd, "\"latency\": [");
+    const char *sep = "";
+    for (unsigned c = 0; c < LATENCY_CLASSES; ++c) {
+        const struct latency_row *r = &rows[c];
+        if (!r->count) continue;
+        outf(fd, "%s[%" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64
+             ", %" PRIu64 "]", sep, latency_lo(c), latency_hi(c), r->count, r->p50, r->p99,
+             r->p999, r->max);
+        sep = ", ";
+    }
+    outf(fd, "]");
+}
 
-    len = snprintf(buf, sizeof(buf), "memalign:        %10" PRIu64 " total, %10" PRIu64 " failed\n",
-                   atomic_load(&stats_memalign_total),
-                   atomic_load(&stats_memalign_failed));
-    if (len > 0) write(2, buf, len);
+static void print_stats_json(int fd, const struct stats_totals *totals, uint64_t visible,
+                             struct latency_row (*latency)[LATENCY_CLASSES]) {
+    outf(fd, "{\n  \"functions\": {");
+    const char *comma = "";
+    for (int fn = 0; fn < FN_COUNT; ++fn) {
+        if (!alloc_fn_reported((unsigned)fn, totals->total[fn])) continue;
+        outf(fd, "%s\n    \"%s\": {\"total\": %" PRIu64 ", \"failed\": %" PRIu64 ", \"sizes\": [",
+             comma, alloc_fn_name(fn), totals->total[fn], totals->failed[fn]);
+        comma = ",";
+        const char *sep = "";
+        for (unsigned b = 0; b < SIZE_BUCKETS; ++b) {
+            if (!totals->sizes[fn][b]) continue;
+            outf(fd, "%s[%" PRIu64 ", %" PRIu64 ", %" PRIu64 "]", sep,
+                 bucket_lo(b), bucket_hi(b), totals->sizes[fn][b]);
+            sep = ", ";
+        }
+        outf(fd, "]");
+        if (latency) {
+            outf(fd, ", ");
+            print_latency_json(fd, latency[fn]);
+        }
+        outf(fd, "}");
+    }
+    if (latency) {
+        /* free has latency only: it is not counted as a call */
+        outf(fd, "%s\n    \"free\": {", comma);
+        print_latency_json(fd, latency[LATENCY_FREE]);
+        outf(fd, "}");
+    }
+    outf(fd, "\n  },\n  \"visible\": %" PRIu64 ",\n  \"threads\": [", visible);
+    struct thread_row_ctx ctx = { fd, 0 };
+    thread_state_foreach(print_thread_row, &ctx);
+    outf(fd, "\n  ]");
+    if (tree_is_root()) {
+        struct tree_row_ctx tree = { fd, 0, 0, 0 };
+        outf(fd, ",\n  \"processes\": [");
+        tree_foreach(print_tree_row, &tree);
+        outf(fd, "\n  ]");
+    }
+    outf(fd, "\n}\n");
+}
 
-    len = snprintf(buf, sizeof(buf), "valloc:          %10" PRIu64 " total, %10" PRIu64 " failed\n",
-                   atomic_load(&stats_valloc_total),
-                   atomic_load(&stats_valloc_failed));
-    if (len > 0) write(2, buf, len);
+static void print_stats_csv(int fd, const struct stats_totals *totals, uint64_t visible,
+                            struct latency_row (*latency)[LATENCY_CLASSES]) {
+    /* Latency columns only exist when latency rows follow */
+    outf(fd, "record,function,tid,size_lo,size_hi,count,failed%s\n",
+         latency ? ",p50_ns,p99_ns,p999_ns,max_ns" : "");
+    for (int fn = 0; fn < FN_COUNT; ++fn) {
+        if (!alloc_fn_reported((unsigned)fn, totals->total[fn])) continue;
+        outf(fd, "total,%s,,,,%" PRIu64 ",%" PRIu64 "\n",
+             alloc_fn_name(fn), totals->total[fn], totals->failed[fn]);
+        for (unsigned b = 0; b < SIZE_BUCKETS; ++b)
+            if (totals->sizes[fn][b])
+                outf(fd, "size,%s,,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",\n",
+                     alloc_fn_name(fn), bucket_lo(b), bucket_hi(b), totals->sizes[fn][b]);
+    }
+    for (unsigned fn = 0; latency && fn < LATENCY_FNS; ++fn)
+        for (unsigned c = 0; c < LATENCY_CLASSES; ++c) {
+            const struct latency_row *r = &latency[fn][c];
+            if (r->count)
+                outf(fd, "latency,%s,,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",,%" PRIu64 ",%" PRIu64 ",%" PRIu64
+                     ",%" PRIu64 "\n", latency_fn_name(fn), latency_lo(c), latency_hi(c), r->count,
+                     r->p50, r->p99, r->p999, r->max);
+        }
+    outf(fd, "visible,,,,,%" PRIu64 ",\n", visible);
+    struct thread_row_ctx ctx = { fd, 0 };
+    thread_state_foreach(print_thread_row, &ctx);
+    struct tree_row_ctx tree = { fd, 0, 0, 0 };
+    if (tree_is_root()) tree_foreach(print_tree_row, &tree);
+}
 
-    len = snprintf(buf, sizeof(buf), "pvalloc:         %10" PRIu64 " total, %10" PRIu64 " failed\n",
-                   atomic_load(&stats_pvalloc_total),
-                   atomic_load(&stats_pvalloc_failed));
-    if (len > 0) write(2, buf, len);
+/* Print statistics at program exit */
+static void print_malloc_stats(void) {
+    if (!atomic_load(&stats_mode)) return;
+
+    int fd = 2;
+    if (stats_file) {
+        fd = open(stats_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) fd = 2;
+    }
+
+    struct stats_totals totals;
+    thread_state_snapshot(&totals);
+    uint64_t all = 0;
+    for (int fn = 0; fn < FN_COUNT; ++fn) all += totals.total[fn];
+    uint64_t visible = all > base_total ? all - base_total : 0;
+    struct latency_row latency[LATENCY_FNS][LATENCY_CLASSES];
+    int timed = (atomic_load(&hook_flags) & HOOK_LATENCY) != 0;
+    if (timed) latency_summarize(latency);
+
+    if (stats_format == STATS_JSON) {
+        print_stats_json(fd, &totals, visible, timed ? latency : NULL);
+    } else if (stats_format == STATS_CSV) {
+        print_stats_csv(fd, &totals, visible, timed ? latency : NULL);
+    } else {
+        outf(fd, "\n=== Malloc Interceptor Statistics ===\n");
+        int width = 16; /* widened by the operator new names */
+        for (int fn = 0; fn < FN_COUNT; ++fn)
+            if (alloc_fn_reported((unsigned)fn, totals.total[fn]) && (int)strlen(alloc_fn_name(fn)) >= width)
+                width = (int)strlen(alloc_fn_name(fn)) + 1;
+        for (int fn = 0; fn < FN_COUNT; ++fn)
+            if (alloc_fn_reported((unsigned)fn, totals.total[fn]))
+                outf(fd, "%s:%*s%10" PRIu64 " total, %10" PRIu64 " failed\n",
+                     alloc_fn_name(fn), width - (int)strlen(alloc_fn_name(fn)), "",
+                     totals.total[fn], totals.failed[fn]);
+
+        /* Highest index MALLOC_FAIL_AT can address in this run */
+        outf(fd, "visible:         %10" PRIu64 " allocations after init\n", visible);
+
+        if (atomic_load(&hook_flags) & HOOK_LIMIT) budget_report(fd, &totals);
+        for (int fn = 0; fn < FN_COUNT; ++fn) print_size_hist(fd, (unsigned)fn, totals.sizes[fn]);
+        if (timed) print_latency(fd, latency);
+        outf(fd, "--- threads ---\n");
+        struct thread_row_ctx ctx = { fd, 0 };
+        thread_state_foreach(print_thread_row, &ctx);
+        if (atomic_load(&hook_flags) & HOOK_SITE) sites_report(fd, 20);
+        if (atomic_load(&hook_flags) & HOOK_TRACK) track_report(fd, atomic_load(&first_failure), 20);
+        if (tree_is_root()) {
+            struct tree_row_ctx tree = { fd, 0, 0, 0 };
+            outf(fd, "--- process tree ---\n");
+            tree_foreach(print_tree_row, &tree);
+            outf(fd, "  tree: %u processes %10" PRIu64 " total, %10" PRIu64 " failed\n",
+                 tree.rows, tree.total, tree.failed);
+        }
+
+        outf(fd, "=====================================\n");
+    }
+    if (fd != 2) close(fd);
+}
 
-    len = snprintf(buf, sizeof(buf), "=====================================\n");
-    if (len > 0) write(2, buf, len);
+/* Snapshot for the MALLOC_FAIL_SHM publisher thread */
+static void fill_shm_stats(struct shm_stats_data *d) {
+    struct stats_totals totals;
+    thread_state_snapshot(&totals);
+    uint64_t all = 0;
+    for (int fn = 0; fn < FN_COUNT; ++fn) all += totals.total[fn];
+    unsigned flags = atomic_load_explicit(&hook_flags, memory_order_relaxed);
+    d->hook_flags = flags;
+    d->visible = all > base_total ? all - base_total : 0;
+    d->first_failure = atomic_load_explicit(&first_failure, memory_order_relaxed);
+    d->live_bytes = (flags & HOOK_LIMIT) ? budget_live_bytes(&totals) : 0;
+    memcpy(d->total, totals.total, sizeof(d->total));
+    memcpy(d->failed, totals.failed, sizeof(d->failed));
+    memcpy(d->sizes, totals.sizes, sizeof(d->sizes));
+}
+
+/* A forked child joins the tree as a process of its own and numbers its
+ * allocations from 1, except under the fork server, whose children
+ * continue the parent's numbering by design */
+static void tree_atfork_child(void) {
+    struct stats_totals totals;
+    thread_state_snapshot(&totals);
+    tree_fork_child(&totals);
+    if (!(atomic_load(&hook_flags) & HOOK_FORKSRV)) {
+        atomic_store(&base_count, atomic_load(&alloc_count));
+        atomic_store(&first_failure, 0); /* the parent's, not this process's */
+    }
+}
+
+/* Flush the trace before reporting so the two never interleave */
+__attribute__((destructor))
+static void fini_malloc_fail(void) {
+    trace_finish();
+    record_finish();
+    heapprof_finish();
+    shm_stats_finish();
+    if (tree_pid) {
+        struct stats_totals totals;
+        thread_state_snapshot(&totals);
+        tree_finish(&totals); /* before the report, which reads every slot */
+    }
+    if (plan_out && plan_write(plan_out, plan_out_depth) != 0) {
+        const char *msg = "interceptor: warning: cannot write MALLOC_FAIL_PLAN_OUT file\n";
+        diag_write(2, msg, strlen(msg));
+    }
+    print_malloc_stats();
 }
 
 /* Initialize orig functions and parse env (constructor) */
 __attribute__((constructor))
 static void init_malloc_fail(void) {
     /* parse env first so behavior starts immediately */
-    const char *env_at = getenv("MALLOC_FAIL_AT");
-    const char *env_every = getenv("MALLOC_FAIL_EVERY");
-    const char *env_offset = getenv("MALLOC_FAIL_OFFSET");
     const char *env_debug = getenv("MALLOC_FAIL_DEBUG");
     const char *env_stats = getenv("MALLOC_FAIL_STATS");
-    const char *env_size_min = getenv("MALLOC_FAIL_SIZE_MIN");
-    const char *env_size_max = getenv("MALLOC_FAIL_SIZE_MAX");
-
-    if (env_at) parse_fail_at(env_at);
-    if (env_every) {
-        uint64_t v = strtoull(env_every, NULL, 10);
-        if (v > 0) atomic_store(&fail_every, v);
-    }
-    if (env_offset) {
-        long long o = strtoll(env_offset, NULL, 10);
-        atomic_store(&fail_offset, (int64_t)o);
-    }
-    if (env_debug) atomic_store(&debug_mode, 1);
-    if (env_stats) atomic_store(&stats_mode, 1);
-    if (env_size_min) {
-        uint64_t v = strtoull(env_size_min, NULL, 10);
-        if (v > 0) atomic_store(&fail_size_min, v);
-    }
-    if (env_size_max) {
-        uint64_t v = strtoull(env_size_max, NULL, 10);
-        if (v > 0) atomic_store(&fail_size_max, v);
-    }
-
-    /* load the real functions */
-    /* Use RTLD_NEXT to find the next occurrence of these symbols */
-    real_malloc = dlsym(RTLD_NEXT, "malloc");
-    real_calloc = dlsym(RTLD_NEXT, "calloc");
-    real_realloc = dlsym(RTLD_NEXT, "realloc");
-    real_free = dlsym(RTLD_NEXT, "free");
-    real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
-    real_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
-    real_memalign = dlsym(RTLD_NEXT, "memalign");
-    real_valloc = dlsym(RTLD_NEXT, "valloc");
-    real_pvalloc = dlsym(RTLD_NEXT, "pvalloc");
+    const char *env_stats_file = getenv("MALLOC_FAIL_STATS_FILE");
+    const char *env_stats_format = getenv("MALLOC_FAIL_STATS_FORMAT");
+    const char *env_trace = getenv("MALLOC_FAIL_TRACE");
+    const char *env_forksrv = getenv("MALLOC_FAIL_FORKSRV");
+    const char *env_forksrv_fd = getenv("MALLOC_FAIL_FORKSRV_FD");
+    const char *env_site = getenv("MALLOC_FAIL_SITE");
+    const char *env_site_first = getenv("MALLOC_FAIL_SITE_FIRST");
+    const char *env_site_depth = getenv("MALLOC_FAIL_SITE_DEPTH");
+    const char *env_plan = getenv("MALLOC_FAIL_PLAN");
+    const char *env_plan_entry = getenv("MALLOC_FAIL_PLAN_ENTRY");
+    const char *env_plan_out = getenv("MALLOC_FAIL_PLAN_OUT");
+    const char *env_track = getenv("MALLOC_FAIL_TRACK");
+    const char *env_latency = getenv("MALLOC_FAIL_LATENCY");
+    const char *env_record = getenv("MALLOC_FAIL_RECORD");
+    const char *env_heap = getenv("MALLOC_FAIL_HEAP_PROFILE");
+    const char *env_heap_sample = getenv("MALLOC_FAIL_HEAP_SAMPLE");
+    const char *env_heap_signal = getenv("MALLOC_FAIL_HEAP_SIGNAL");
+    const char *env_limit = getenv("MALLOC_FAIL_LIMIT");
+    const char *env_shm = getenv("MALLOC_FAIL_SHM");
+    const char *env_tree = getenv("MALLOC_FAIL_TREE");
+    const char *env_control = getenv("MALLOC_FAIL_CONTROL");
+    const char *env_control_signal = getenv("MALLOC_FAIL_CONTROL_SIGNAL");
+
+    /* Compiled now, installed once init is done */
+    static struct fail_config env_config;
+    config_parse(&env_config, env_get, NULL);
+    /* The leak and latency reports are part of the statistics */
+    if (env_stats || env_track || env_latency) atomic_store(&stats_mode, 1);
+    if (env_latency) latency_init();
+    if (env_stats_file && *env_stats_file) stats_file = env_stats_file;
+    if (env_stats_format) {
+        if (strcmp(env_stats_format, "json") == 0) stats_format = STATS_JSON;
+        else if (strcmp(env_stats_format, "csv") == 0) stats_format = STATS_CSV;
+    }
+    int limit_ok = 0;
+    if (env_limit) {
+        limit_ok = budget_init(budget_parse(env_limit)) == 0;
+        if (!limit_ok) {
+            const char *msg = "interceptor: warning: invalid MALLOC_FAIL_LIMIT (expected <bytes>[K|M|G])\n";
+            diag_write(2, msg, strlen(msg));
+        }
+    }
+    /* Usually done already by the first allocation of the process */
+    resolve_real();
+
+    int plan_ok = 0;
+    if (env_plan) {
+        uint32_t entry = env_plan_entry ? (uint32_t)strtoul(env_plan_entry, NULL, 10) : 0;
+        plan_ok = plan_load(env_plan, entry) == 0;
+        if (!plan_ok) {
+            const char *msg = "interceptor: warning: cannot load MALLOC_FAIL_PLAN (or entry out of range)\n";
+            diag_write(2, msg, strlen(msg));
+        }
+    }
+
+    int sites_ok = 0;
+    if (env_site || env_site_first || env_plan_out || plan_ok) {
+        /* A plan only matches stacks of the depth it was recorded with */
+        unsigned depth = plan_ok ? plan_depth()
+                       : env_site_depth ? (unsigned)strtoul(env_site_depth, NULL, 10) : 1;
+        sites_ok = sites_init(env_site, depth) == 0;
+        site_filter = env_site != NULL || plan_ok; /* unresolved targets match nothing */
+        if (env_site_first) site_first_n = strtoull(env_site_first, NULL, 10);
+        else if (plan_ok) site_first_n = 1;
+        if (sites_ok && env_plan_out && *env_plan_out) {
+            plan_out = env_plan_out;
+            plan_out_depth = depth < 1 ? 1 : depth > SITE_MAX_DEPTH ? SITE_MAX_DEPTH : depth;
+        }
+    }
+
+    /* Background services allocate too; start them before taking the base */
+    int trace_ok = 0;
+    if (env_trace) {
+        trace_ok = trace_open(env_trace, env_config.offset) == 0;
+        if (!trace_ok) {
+            const char *msg = "interceptor: warning: cannot open MALLOC_FAIL_TRACE file\n";
+            diag_write(2, msg, strlen(msg));
+        }
+    }
+
+    int record_ok = 0;
+    if (env_record) {
+        record_ok = record_open(env_record) == 0;
+        if (!record_ok) {
+            const char *msg = "interceptor: warning: cannot open MALLOC_FAIL_RECORD file\n";
+            diag_write(2, msg, strlen(msg));
+        }
+    }
+
+    int heap_ok = 0;
+    if (env_heap && *env_heap) {
+        uint64_t sample = env_heap_sample ? budget_parse(env_heap_sample) : 0;
+        if (env_heap_sample && sample == 0) {
+            const char *msg = "interceptor: warning: invalid MALLOC_FAIL_HEAP_SAMPLE (expected <bytes>[K|M|G]), using 512K\n";
+            diag_write(2, msg, strlen(msg));
+        }
+        int signo = env_heap_signal ? (int)strtol(env_heap_signal, NULL, 10) : 0;
+        heap_ok = heapprof_init(env_heap, sample, signo) == 0;
+        if (!heap_ok) {
+            const char *msg = "interceptor: warning: cannot set up MALLOC_FAIL_HEAP_PROFILE\n";
+            diag_write(2, msg, strlen(msg));
+        }
+    }
+
+    int shm_ok = 0;
+    if (env_shm) {
+        shm_ok = shm_stats_open(fill_shm_stats) == 0;
+        if (!shm_ok) {
+            const char *msg = "interceptor: warning: cannot create MALLOC_FAIL_SHM segment in /dev/shm\n";
+            diag_write(2, msg, strlen(msg));
+        }
+    }
+
+    int tree_ok = 0;
+    if (env_tree || env_config.proc.kind != TREE_SEL_NONE) {
+        tree_ok = tree_open() == 0;
+        if (!tree_ok) {
+            const char *msg = "interceptor: warning: cannot create MALLOC_FAIL_TREE segment in /dev/shm\n";
+            diag_write(2, msg, strlen(msg));
+        }
+    }
+
+    int control_ok = 0;
+    int control_signo = env_control_signal ? (int)strtol(env_control_signal, NULL, 10) : SIGUSR2;
+    if (env_control) {
+        control_ok = control_start(env_control, apply_control) == 0;
+        if (!control_ok) {
+            const char *msg = "interceptor: warning: cannot set up MALLOC_FAIL_CONTROL\n";
+            diag_write(2, msg, strlen(msg));
+        }
+    }
 
     /* record how many allocations have already been observed during init/setup */
     uint64_t seen = atomic_load(&alloc_count);
     atomic_store(&base_count, seen);
 
-    /* If dlsym failed, print a warning (but keep going). Use write() to avoid malloc recursion. */
-    if (!real_malloc || !real_calloc || !real_realloc || !real_free) {
-        const char *msg = "interceptor: warning: dlsym failed to load real allocators\n";
-        write(2, msg, strlen(msg));
+    struct stats_totals init_totals;
+    thread_state_snapshot(&init_totals);
+    for (int fn = 0; fn < FN_COUNT; ++fn) base_total += init_totals.total[fn];
+
+    thread_state_init();
+    thread_state_get()->ordinal = 0; /* the initializing thread is "#0" */
+    pthread_atfork(arena_fork_prepare, arena_fork_release, arena_fork_release);
+    if (env_track) pthread_atfork(track_fork_prepare, track_fork_release, track_fork_release);
+    if (heap_ok) pthread_atfork(heapprof_fork_prepare, heapprof_fork_release, heapprof_fork_release);
+    if (tree_ok) pthread_atfork(NULL, NULL, tree_atfork_child);
+
+    /* Select the hot path: only what this configuration needs */
+    unsigned flags = 0;
+    if (env_debug) flags |= HOOK_INDEX | HOOK_DEBUG;
+    if (env_stats) flags |= HOOK_STATS;
+    if (trace_ok) flags |= HOOK_INDEX | HOOK_TRACE;
+    if (sites_ok) flags |= HOOK_SITE;
+    if (plan_out) flags |= HOOK_INDEX; /* entries record their first index */
+    if (env_track) flags |= HOOK_INDEX | HOOK_STATS | HOOK_TRACK;
+    if (env_latency) flags |= HOOK_STATS | HOOK_LATENCY;
+    if (record_ok) flags |= HOOK_RECORD;
+    if (heap_ok) flags |= HOOK_HEAP;
+    if (limit_ok) flags |= HOOK_LIMIT;
+    if (shm_ok) flags |= HOOK_STATS; /* the publisher reads the counters */
+    if (tree_ok) flags |= HOOK_STATS; /* written to the process's slot at exit */
+    if (env_forksrv) {
+        if (env_forksrv_fd) forksrv_fd = (int)strtol(env_forksrv_fd, NULL, 10);
+        forksrv_at = strtoull(env_forksrv, NULL, 10); /* "hook" parses as 0 */
+        flags |= HOOK_INDEX | HOOK_FORKSRV;
     }
+    /* A reload may ask for an index at any time: keep numbering */
+    if (control_ok) flags |= HOOK_INDEX;
+    feature_hooks = flags & ~HOOK_FORKSRV;
+    flags |= config_hooks(&env_config);
+    feature_ordinals = control_ok || (flags & HOOK_STATS);
+    thread_numbering(feature_ordinals || (flags & HOOK_THREAD) || env_config.rate);
+    atomic_store_explicit(&active_config, &env_config, memory_order_release);
+    atomic_store_explicit(&hook_flags, flags, memory_order_release);
+
+    /* Reloads may only start once the environment's policy is in place */
+    if (control_ok) control_listen(control_signo);
 }
 
 /* Interposed malloc/calloc/realloc/free */
@@ -234,175 +1019,489 @@ static inline uint64_t compute_visible_index(uint64_t absolute_count) {
 
 /* Helper to emit debug info when a fail decision is made */
 static void emit_decision_debug(const char *fn, uint64_t absolute_count, uint64_t visible, int decision, size_t size) {
-    if (!atomic_load(&debug_mode)) return;
     char buf[256];
     int len = snprintf(buf, sizeof(buf),
                        "interceptor: %s abs=%" PRIu64 " vis=%" PRIu64 " size=%zu offset=%lld decision=%d\n",
-                       fn, absolute_count, visible, size, (long long)atomic_load(&fail_offset), decision);
-    if (len > 0) write(2, buf, (size_t)len);
+                       fn, absolute_count, visible, size, (long long)atomic_load(&active_config)->offset, decision);
+    if (len > 0) diag_write(2, buf, (size_t)len);
 }
 
-void *malloc(size_t size) {
-    uint64_t c = atomic_fetch_add(&alloc_count, 1) + 1; /* absolute count (includes init) */
-    uint64_t visible = compute_visible_index(c);
+/* Become a fork server at the current point. Returns in a forked child
+ * (running only this thread) with MALLOC_FAIL_AT replaced by the index
+ * the controller asked for, or right away if there is no controller.
+ */
+static void enter_forkserver(uint64_t first_failable) {
+    if (!(atomic_load(&hook_flags) & HOOK_FORKSRV)) return;
+
+    uint64_t fail_index;
+    if (forksrv_serve(forksrv_fd, first_failable, &fail_index) != 0) {
+        const char *msg = "interceptor: warning: no fork server controller, continuing\n";
+        diag_write(2, msg, strlen(msg));
+        atomic_fetch_and(&hook_flags, ~HOOK_FORKSRV);
+        return;
+    }
 
+    /* Child: counters, index and the rest of the config carry over */
+    struct fail_config *cfg = arena_alloc(sizeof(*cfg));
+    if (cfg) {
+        *cfg = *atomic_load(&active_config);
+        char spec[24];
+        snprintf(spec, sizeof(spec), "%" PRIu64, fail_index);
+        failspec_parse(&cfg->points, spec);
+        select_decide(cfg);
+        config_install(cfg);
+    }
+    atomic_fetch_and(&hook_flags, ~HOOK_FORKSRV);
+}
+
+/* Explicit stop point for MALLOC_FAIL_FORKSRV=hook: programs declare
+ *   void malloc_fail_forkserver(void) __attribute__((weak));
+ * and call it (if non-NULL) once startup is done. */
+void malloc_fail_forkserver(void) {
+    /* Called between allocations: the next one is the first children see */
+    enter_forkserver(compute_visible_index(atomic_load(&alloc_count)) + 1);
+}
+
+/* MALLOC_FAIL_CONTROL reloads applied so far. Programs that trigger
+ * their own reload declare
+ *   unsigned long malloc_fail_control_generation(void) __attribute__((weak));
+ * and wait for it to advance before relying on the new policy. */
+unsigned long malloc_fail_control_generation(void) {
+    return control_generation();
+}
+
+/* Fast-path test shared by all wrappers: nothing is configured */
+static inline int passthrough(void) {
+    return __builtin_expect(atomic_load_explicit(&hook_flags, memory_order_acquire) == 0, 1);
+}
+
+/* Shared slow path of every wrapper: assign the index, decide, count.
+ * old is the block realloc would release (NULL for the other functions).
+ * Returns non-zero if the allocation must fail; *index receives the
+ * visible index (0 if none was assigned).
+ */
+__attribute__((noinline))
+static int intercept(enum alloc_fn fn, size_t size, const void *old, const void *caller,
+                     uint64_t *index) {
+    unsigned flags = atomic_load_explicit(&hook_flags, memory_order_relaxed);
+    struct thread_state *ts = thread_state_get();
+    *index = 0;
+    if (ts->internal) return 0; /* our own bookkeeping: never counted or failed */
+
+    uint64_t c = 0, visible = 0, tree_index = 0;
     int will_fail = 0;
-    if (visible > 0) will_fail = should_fail(visible, size);
+    int may_fail = 1;
+
+    if (flags & HOOK_THREAD) ts->thread_index++; /* single writer: no atomic */
+    if (flags & HOOK_TREE) tree_index = tree_next_index();
+    if (flags & HOOK_INDEX) {
+        c = atomic_fetch_add(&alloc_count, 1) + 1; /* absolute count (includes init) */
+        visible = compute_visible_index(c);
+        if ((flags & HOOK_FORKSRV) && forksrv_at && visible == forksrv_at)
+            enter_forkserver(visible);
+    }
 
-    emit_decision_debug("malloc", c, visible, will_fail, size);
+    const struct fail_config *cfg = atomic_load_explicit(&active_config, memory_order_acquire);
+    struct site *site = NULL;
+    if (flags & HOOK_SITE) {
+        site = sites_get(ts, (uintptr_t)caller, __builtin_frame_address(0), visible);
+        if (site) {
+            uint64_t hits = atomic_fetch_add_explicit(&site->hits, 1, memory_order_relaxed) + 1;
+            if (site_filter && !site->match) may_fail = 0;
+            else if (site_first_n) will_fail = hits <= site_first_n;
+            else if (site_filter && !cfg->decide) will_fail = 1;
+        } else if (site_filter) {
+            may_fail = 0; /* table full: cannot tell, so leave it alone */
+        }
+    }
 
-    atomic_fetch_add(&stats_malloc_total, 1);
-    if (will_fail) {
-        atomic_fetch_add(&stats_malloc_failed, 1);
-        errno = ENOMEM;
-        return NULL;
+    if (!will_fail && may_fail && cfg->decide) {
+        uint64_t decide_at = visible;
+        if (cfg->thread.kind != THREAD_SEL_NONE)
+            decide_at = thread_sel_match(&cfg->thread, ts) ? ts->thread_index : 0;
+        else if (cfg->proc.kind == TREE_SEL_ALL)
+            decide_at = tree_index;
+        else if (cfg->proc.kind != TREE_SEL_NONE)
+            decide_at = tree_sel_match(&cfg->proc) ? visible : 0;
+        if (decide_at > 0 || !cfg->needs_index) will_fail = cfg->decide(cfg, ts, fn, decide_at, size);
+    }
+    if (!will_fail && may_fail && (flags & HOOK_LIMIT))
+        will_fail = budget_refuse(ts, (int64_t)size - (int64_t)budget_usable((void *)old));
+    if (site && will_fail) atomic_fetch_add_explicit(&site->failed, 1, memory_order_relaxed);
+    if (will_fail && visible) {
+        uint64_t first = atomic_load_explicit(&first_failure, memory_order_relaxed);
+        while ((first == 0 || visible < first) &&
+               !atomic_compare_exchange_weak(&first_failure, &first, visible))
+            ;
     }
 
-    if (!real_malloc) real_malloc = dlsym(RTLD_NEXT, "malloc");
-    return real_malloc ? real_malloc(size) : NULL;
+    if (flags & HOOK_DEBUG) emit_decision_debug(alloc_fn_name(fn), c, visible, will_fail, size);
+    if (flags & HOOK_TRACE) trace_emit(ts, fn, c, visible, size, will_fail);
+
+    if (flags & HOOK_STATS) {
+        counter_inc(&ts->total[fn]);
+        if (will_fail) counter_inc(&ts->failed[fn]);
+        size_hist_inc(ts, fn, size);
+    }
+    *index = visible;
+    return will_fail;
 }
 
-void *calloc(size_t nmemb, size_t size) {
-    uint64_t c = atomic_fetch_add(&alloc_count, 1) + 1;
-    uint64_t visible = compute_visible_index(c);
-    size_t total_size = nmemb * size;
+/* Clock reading before a real call, 0 unless MALLOC_FAIL_LATENCY is on */
+static inline uint64_t latency_begin(void) {
+    if (!(atomic_load_explicit(&hook_flags, memory_order_relaxed) & HOOK_LATENCY)) return 0;
+    return latency_now();
+}
 
-    int will_fail = 0;
-    if (visible > 0) will_fail = should_fail(visible, total_size);
+static inline void latency_end(unsigned fn, size_t size, uint64_t t0) {
+    if (t0) latency_record(thread_state_get(), fn, size, latency_now() - t0);
+}
 
-    emit_decision_debug("calloc", c, visible, will_fail, total_size);
+/* Call a real function, timed under MALLOC_FAIL_LATENCY */
+#define TIMED(fn, size, call) ({ \
+    uint64_t t0_ = latency_begin(); \
+    __typeof__(call) r_ = (call); \
+    latency_end(fn, size, t0_); \
+    r_; \
+})
+
+/* Bookkeeping for a block the real allocator returned */
+static inline void *allocated(enum alloc_fn fn, void *p, size_t size, size_t align,
+                              const void *caller, uint64_t index) {
+    unsigned flags = atomic_load_explicit(&hook_flags, memory_order_relaxed);
+    if (p && (flags & HOOK_RECORD)) record_alloc(thread_state_get(), fn, (uintptr_t)p, 0, size, align);
+    if (p && (flags & HOOK_TRACK)) track_insert((uintptr_t)p, size, (uintptr_t)caller, index);
+    if (p && (flags & HOOK_LIMIT)) budget_charge(thread_state_get(), (int64_t)budget_usable(p));
+    if (p && (flags & HOOK_HEAP)) heapprof_alloc(thread_state_get(), p, size, caller);
+    return p;
+}
 
-    atomic_fetch_add(&stats_calloc_total, 1);
-    if (will_fail) {
-        atomic_fetch_add(&stats_calloc_failed, 1);
+/* realloc under MALLOC_FAIL_TRACK / LIMIT / HEAP_PROFILE. The old block
+ * is dropped from the tables before the call: once realloc returns,
+ * another thread may be handed its address. */
+static void *realloc_accounted(void *ptr, size_t size, const void *caller, uint64_t index,
+                               unsigned flags) {
+    struct track_entry old;
+    int had = (flags & HOOK_TRACK) && ptr && track_remove((uintptr_t)ptr, &old) == 0;
+    int64_t old_bytes = (flags & HOOK_LIMIT) ? (int64_t)budget_usable(ptr) : 0;
+    struct heap_object sampled;
+    int was_sampled = (flags & HOOK_HEAP) && ptr && heapprof_free(ptr, &sampled) == 0;
+
+    void *p = TIMED(FN_REALLOC, size, real_realloc(ptr, size));
+    if ((flags & HOOK_LIMIT) && (p || (ptr && size == 0))) /* moved, resized or freed */
+        budget_charge(thread_state_get(), (int64_t)budget_usable(p) - old_bytes);
+    if (p && (flags & HOOK_TRACK)) track_insert((uintptr_t)p, size, (uintptr_t)caller, index);
+    else if (had && size) track_insert(old.ptr, old.size, old.caller, old.index); /* still the caller's */
+    if (p && (flags & HOOK_HEAP)) heapprof_alloc(thread_state_get(), p, size, caller);
+    else if (was_sampled && size) heapprof_restore(&sampled);
+    return p;
+}
+
+void *malloc(size_t size) {
+    if (passthrough()) return real_malloc(size);
+    const void *caller = __builtin_return_address(0);
+    uint64_t index;
+    if (intercept(FN_MALLOC, size, NULL, caller, &index)) {
         errno = ENOMEM;
         return NULL;
     }
 
-    if (!real_calloc) real_calloc = dlsym(RTLD_NEXT, "calloc");
-    return real_calloc ? real_calloc(nmemb, size) : NULL;
+    return allocated(FN_MALLOC, TIMED(FN_MALLOC, size, real_malloc(size)), size, 0, caller, index);
 }
 
-void *realloc(void *ptr, size_t size) {
-    uint64_t c = atomic_fetch_add(&alloc_count, 1) + 1;
-    uint64_t visible = compute_visible_index(c);
+void *calloc(size_t nmemb, size_t size) {
+    if (passthrough()) return real_calloc(nmemb, size);
+    const void *caller = __builtin_return_address(0);
+    uint64_t index;
+    if (intercept(FN_CALLOC, nmemb * size, NULL, caller, &index)) {
+        errno = ENOMEM;
+        return NULL;
+    }
 
-    int will_fail = 0;
-    if (visible > 0) will_fail = should_fail(visible, size);
+    return allocated(FN_CALLOC, TIMED(FN_CALLOC, nmemb * size, real_calloc(nmemb, size)), nmemb * size, 0,
+                     caller, index);
+}
 
-    emit_decision_debug("realloc", c, visible, will_fail, size);
+/* A bootstrap block handed to realloc moves to the real heap */
+static void *realloc_from_bootstrap(void *ptr, size_t size) {
+    if (size == 0) return NULL;
+    void *p = malloc(size);
+    if (p) {
+        size_t old = bootstrap_size(ptr);
+        memcpy(p, ptr, old < size ? old : size);
+    }
+    return p;
+}
 
-    atomic_fetch_add(&stats_realloc_total, 1);
-    if (will_fail) {
-        atomic_fetch_add(&stats_realloc_failed, 1);
+void *realloc(void *ptr, size_t size) {
+    if (bootstrap_owns(ptr)) return realloc_from_bootstrap(ptr, size);
+    if (passthrough()) return real_realloc(ptr, size);
+    const void *caller = __builtin_return_address(0);
+    uint64_t index;
+    if (intercept(FN_REALLOC, size, ptr, caller, &index)) {
         errno = ENOMEM;
         return NULL;
     }
 
-    if (!real_realloc) real_realloc = dlsym(RTLD_NEXT, "realloc");
-    return real_realloc ? real_realloc(ptr, size) : NULL;
+    unsigned flags = atomic_load_explicit(&hook_flags, memory_order_relaxed);
+    void *p;
+    if (flags & (HOOK_TRACK | HOOK_LIMIT | HOOK_HEAP)) p = realloc_accounted(ptr, size, caller, index, flags);
+    else p = TIMED(FN_REALLOC, size, real_realloc(ptr, size));
+    if ((flags & HOOK_RECORD) && (p || (ptr && size == 0))) /* moved, resized or freed */
+        record_alloc(thread_state_get(), FN_REALLOC, (uintptr_t)p, (uintptr_t)ptr, size, 0);
+    return p;
+}
+
+/* free() and every operator delete */
+static inline void release(void *ptr) {
+    if (bootstrap_owns(ptr)) return; /* arena blocks are never reused */
+    if (passthrough()) {
+        real_free(ptr);
+        return;
+    }
+    unsigned flags = atomic_load_explicit(&hook_flags, memory_order_relaxed);
+    if (ptr && (flags & HOOK_RECORD)) record_free(thread_state_get(), (uintptr_t)ptr);
+    if (ptr && (flags & HOOK_TRACK)) track_remove((uintptr_t)ptr, NULL);
+    if (ptr && (flags & HOOK_LIMIT)) budget_charge(thread_state_get(), -(int64_t)budget_usable(ptr));
+    if (ptr && (flags & HOOK_HEAP)) heapprof_free(ptr, NULL);
+    if (ptr && (flags & HOOK_LATENCY)) {
+        size_t size = latency_usable(ptr);
+        uint64_t t0 = latency_now();
+        real_free(ptr);
+        latency_end(LATENCY_FREE, size, t0);
+        return;
+    }
+    real_free(ptr);
 }
 
 void free(void *ptr) {
-    if (!real_free) real_free = dlsym(RTLD_NEXT, "free");
-    if (real_free) real_free(ptr);
+    release(ptr);
 }
 
 int posix_memalign(void **memptr, size_t alignment, size_t size) {
-    uint64_t c = atomic_fetch_add(&alloc_count, 1) + 1;
-    uint64_t visible = compute_visible_index(c);
+    if (passthrough()) return real_posix_memalign(memptr, alignment, size);
+    const void *caller = __builtin_return_address(0);
+    uint64_t index;
+    if (intercept(FN_POSIX_MEMALIGN, size, NULL, caller, &index)) return ENOMEM;
+
+    int rc = TIMED(FN_POSIX_MEMALIGN, size, real_posix_memalign(memptr, alignment, size));
+    if (rc == 0) allocated(FN_POSIX_MEMALIGN, *memptr, size, alignment, caller, index);
+    return rc;
+}
 
-    int will_fail = 0;
-    if (visible > 0) will_fail = should_fail(visible, size);
+void *aligned_alloc(size_t alignment, size_t size) {
+    if (passthrough()) return real_aligned_alloc(alignment, size);
+    const void *caller = __builtin_return_address(0);
+    uint64_t index;
+    if (intercept(FN_ALIGNED_ALLOC, size, NULL, caller, &index)) {
+        errno = ENOMEM;
+        return NULL;
+    }
 
-    emit_decision_debug("posix_memalign", c, visible, will_fail, size);
+    return allocated(FN_ALIGNED_ALLOC, TIMED(FN_ALIGNED_ALLOC, size, real_aligned_alloc(alignment, size)),
+                     size, alignment, caller, index);
+}
 
-    atomic_fetch_add(&stats_posix_memalign_total, 1);
-    if (will_fail) {
-        atomic_fetch_add(&stats_posix_memalign_failed, 1);
-        return ENOMEM;
+void *memalign(size_t alignment, size_t size) {
+    if (passthrough()) return real_memalign(alignment, size);
+    const void *caller = __builtin_return_address(0);
+    uint64_t index;
+    if (intercept(FN_MEMALIGN, size, NULL, caller, &index)) {
+        errno = ENOMEM;
+        return NULL;
     }
 
-    if (!real_posix_memalign) real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
-    return real_posix_memalign ? real_posix_memalign(memptr, alignment, size) : ENOMEM;
+    return allocated(FN_MEMALIGN, TIMED(FN_MEMALIGN, size, real_memalign(alignment, size)), size, alignment,
+                     caller, index);
 }
 
-void *aligned_alloc(size_t alignment, size_t size) {
-    uint64_t c = atomic_fetch_add(&alloc_count, 1) + 1;
-    uint64_t visible = compute_visible_index(c);
-
-    int will_fail = 0;
-    if (visible > 0) will_fail = should_fail(visible, size);
+void *valloc(size_t size) {
+    if (passthrough()) return real_valloc(size);
+    const void *caller = __builtin_return_address(0);
+    uint64_t index;
+    if (intercept(FN_VALLOC, size, NULL, caller, &index)) {
+        errno = ENOMEM;
+        return NULL;
+    }
 
-    emit_decision_debug("aligned_alloc", c, visible, will_fail, size);
+    return allocated(FN_VALLOC, TIMED(FN_VALLOC, size, real_valloc(size)), size, 0, caller, index);
+}
 
-    atomic_fetch_add(&stats_aligned_alloc_total, 1);
-    if (will_fail) {
-        atomic_fetch_add(&stats_aligned_alloc_failed, 1);
+void *pvalloc(size_t size) {
+    if (passthrough()) return real_pvalloc(size);
+    const void *caller = __builtin_return_address(0);
+    uint64_t index;
+    if (intercept(FN_PVALLOC, size, NULL, caller, &index)) {
         errno = ENOMEM;
         return NULL;
     }
 
-    if (!real_aligned_alloc) real_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
-    return real_aligned_alloc ? real_aligned_alloc(alignment, size) : NULL;
+    return allocated(FN_PVALLOC, TIMED(FN_PVALLOC, size, real_pvalloc(size)), size, 0, caller, index);
 }
 
-void *memalign(size_t alignment, size_t size) {
-    uint64_t c = atomic_fetch_add(&alloc_count, 1) + 1;
-    uint64_t visible = compute_visible_index(c);
+/* C++ operator new and delete, by their Itanium ABI names. Like
+ * libstdc++'s, they are built on malloc and aligned_alloc, but call the
+ * real ones directly: the block is counted once, as operator new, and not
+ * again as the malloc underneath. A failed allocation, injected or real,
+ * runs the standard loop: call the new_handler and retry, throw
+ * std::bad_alloc when there is none. The nothrow variants return NULL
+ * on an injected failure, without calling the handler, since C cannot
+ * catch what it throws. A real failure is handed to the runtime's own
+ * nothrow operator new, which runs the loop inside its try block.
+ */
 
-    int will_fail = 0;
-    if (visible > 0) will_fail = should_fail(visible, size);
+/* A C++ runtime symbol, looked up on first use: the interceptor does not
+ * link against one. */
+static void *cxx_symbol(void *_Atomic *cache, void *handle, const char *const *names) {
+    void *sym = atomic_load_explicit(cache, memory_order_relaxed);
+    if (sym) return sym;
+    struct thread_state *ts = thread_state_get();
+    ts->internal++; /* dlsym may allocate */
+    for (; *names && !sym; ++names) sym = dlsym(handle, *names);
+    ts->internal--;
+    atomic_store_explicit(cache, sym, memory_order_relaxed);
+    return sym;
+}
 
-    emit_decision_debug("memalign", c, visible, will_fail, size);
+typedef void (*new_handler_fn)(void);
 
-    atomic_fetch_add(&stats_memalign_total, 1);
-    if (will_fail) {
-        atomic_fetch_add(&stats_memalign_failed, 1);
-        errno = ENOMEM;
-        return NULL;
-    }
+static new_handler_fn cxx_get_new_handler(void) {
+    static void *_Atomic cache;
+    static const char *const names[] = { "_ZSt15get_new_handlerv", NULL };
+    new_handler_fn (*get)(void) = (new_handler_fn (*)(void))cxx_symbol(&cache, RTLD_DEFAULT, names);
+    return get ? get() : NULL;
+}
 
-    if (!real_memalign) real_memalign = dlsym(RTLD_NEXT, "memalign");
-    return real_memalign ? real_memalign(alignment, size) : NULL;
+__attribute__((noreturn))
+static void cxx_throw_bad_alloc(void) {
+    static void *_Atomic cache;
+    static const char *const names[] = {
+        "_ZSt17__throw_bad_allocv",           /* libstdc++ */
+        "_ZNSt3__117__throw_bad_allocEv",     /* libc++ */
+        NULL,
+    };
+    void (*throw_fn)(void) = (void (*)(void))cxx_symbol(&cache, RTLD_DEFAULT, names);
+    if (throw_fn) throw_fn();
+    const char *msg = "interceptor: operator new failed and no C++ runtime to throw std::bad_alloc\n";
+    diag_write(2, msg, strlen(msg));
+    abort();
 }
 
-void *valloc(size_t size) {
-    uint64_t c = atomic_fetch_add(&alloc_count, 1) + 1;
-    uint64_t visible = compute_visible_index(c);
+/* The runtime's nothrow operator new for variant, on a real failure.
+ * Its own allocations are internal: not counted again, never failed. */
+static void *cxx_next_nothrow(unsigned variant, size_t size, size_t align) {
+    static void *_Atomic cache[4];
+    static const char *const names[4][2] = {
+        { "_ZnwmRKSt9nothrow_t", NULL },
+        { "_ZnamRKSt9nothrow_t", NULL },
+        { "_ZnwmSt11align_val_tRKSt9nothrow_t", NULL },
+        { "_ZnamSt11align_val_tRKSt9nothrow_t", NULL },
+    };
+    static const char tag; /* std::nothrow_t is empty: any address will do */
+    unsigned i = variant & (NEW_ARRAY | NEW_ALIGNED);
+    void *sym = cxx_symbol(&cache[i], RTLD_NEXT, names[i]);
+    if (!sym) return NULL;
+    struct thread_state *ts = thread_state_get();
+    void *p;
+    ts->internal++;
+    if (align) p = ((void *(*)(size_t, size_t, const void *))sym)(size, align, &tag);
+    else p = ((void *(*)(size_t, const void *))sym)(size, &tag);
+    ts->internal--;
+    return p;
+}
 
-    int will_fail = 0;
-    if (visible > 0) will_fail = should_fail(visible, size);
+static inline void *new_real(size_t size, size_t align) {
+    return align ? real_aligned_alloc(align, size) : real_malloc(size);
+}
 
-    emit_decision_debug("valloc", c, visible, will_fail, size);
+/* Everything past a successful passthrough allocation */
+__attribute__((noinline))
+static void *new_slow(unsigned variant, size_t size, size_t align, const void *caller) {
+    enum alloc_fn fn = FN_NEW + variant;
+    for (;;) {
+        void *p = NULL;
+        uint64_t index;
+        int injected = 0;
+        if (passthrough()) p = new_real(size, align);
+        else if (!(injected = intercept(fn, size, NULL, caller, &index)))
+            p = allocated(fn, TIMED(fn, size, new_real(size, align)), size, align, caller, index);
+        if (p) return p;
+        if (variant & NEW_NOTHROW) return injected ? NULL : cxx_next_nothrow(variant, size, align);
+        new_handler_fn handler = cxx_get_new_handler();
+        if (!handler) cxx_throw_bad_alloc();
+        handler();
+    }
+}
 
-    atomic_fetch_add(&stats_valloc_total, 1);
-    if (will_fail) {
-        atomic_fetch_add(&stats_valloc_failed, 1);
-        errno = ENOMEM;
-        return NULL;
+static inline void *new_common(unsigned variant, size_t size, size_t align, const void *caller) {
+    if (size == 0) size = 1; /* distinct non-null pointers, as the standard requires */
+    if (align) {
+        size_t rounded = (size + align - 1) & ~(align - 1); /* aligned_alloc wants a multiple */
+        size = rounded >= size ? rounded : SIZE_MAX;
     }
+    if (passthrough()) {
+        void *p = new_real(size, align);
+        if (__builtin_expect(p != NULL, 1)) return p;
+    }
+    return new_slow(variant, size, align, caller);
+}
 
-    if (!real_valloc) real_valloc = dlsym(RTLD_NEXT, "valloc");
-    return real_valloc ? real_valloc(size) : NULL;
+#define NEW_CALLER __builtin_return_address(0)
+
+void *_Znwm(size_t size) {
+    return new_common(0, size, 0, NEW_CALLER);
 }
 
-void *pvalloc(size_t size) {
-    uint64_t c = atomic_fetch_add(&alloc_count, 1) + 1;
-    uint64_t visible = compute_visible_index(c);
+void *_Znam(size_t size) {
+    return new_common(NEW_ARRAY, size, 0, NEW_CALLER);
+}
 
-    int will_fail = 0;
-    if (visible > 0) will_fail = should_fail(visible, size);
+void *_ZnwmSt11align_val_t(size_t size, size_t align) {
+    return new_common(NEW_ALIGNED, size, align, NEW_CALLER);
+}
 
-    emit_decision_debug("pvalloc", c, visible, will_fail, size);
+void *_ZnamSt11align_val_t(size_t size, size_t align) {
+    return new_common(NEW_ARRAY | NEW_ALIGNED, size, align, NEW_CALLER);
+}
 
-    atomic_fetch_add(&stats_pvalloc_total, 1);
-    if (will_fail) {
-        atomic_fetch_add(&stats_pvalloc_failed, 1);
-        errno = ENOMEM;
-        return NULL;
-    }
+void *_ZnwmRKSt9nothrow_t(size_t size, const void *tag) {
+    (void)tag;
+    return new_common(NEW_NOTHROW, size, 0, NEW_CALLER);
+}
 
-    if (!real_pvalloc) real_pvalloc = dlsym(RTLD_NEXT, "pvalloc");
-    return real_pvalloc ? real_pvalloc(size) : NULL;
+void *_ZnamRKSt9nothrow_t(size_t size, const void *tag) {
+    (void)tag;
+    return new_common(NEW_ARRAY | NEW_NOTHROW, size, 0, NEW_CALLER);
+}
+
+void *_ZnwmSt11align_val_tRKSt9nothrow_t(size_t size, size_t align, const void *tag) {
+    (void)tag;
+    return new_common(NEW_ALIGNED | NEW_NOTHROW, size, align, NEW_CALLER);
+}
+
+void *_ZnamSt11align_val_tRKSt9nothrow_t(size_t size, size_t align, const void *tag) {
+    (void)tag;
+    return new_common(NEW_ARRAY | NEW_ALIGNED | NEW_NOTHROW, size, align, NEW_CALLER);
+}
+
+/* Every operator delete is free(); sizes, alignments and tags are unused */
+void _ZdlPv(void *ptr) { release(ptr); }
+void _ZdaPv(void *ptr) { release(ptr); }
+void _ZdlPvm(void *ptr, size_t size) { (void)size; release(ptr); }
+void _ZdaPvm(void *ptr, size_t size) { (void)size; release(ptr); }
+void _ZdlPvRKSt9nothrow_t(void *ptr, const void *tag) { (void)tag; release(ptr); }
+void _ZdaPvRKSt9nothrow_t(void *ptr, const void *tag) { (void)tag; release(ptr); }
+void _ZdlPvSt11align_val_t(void *ptr, size_t align) { (void)align; release(ptr); }
+void _ZdaPvSt11align_val_t(void *ptr, size_t align) { (void)align; release(ptr); }
+void _ZdlPvmSt11align_val_t(void *ptr, size_t size, size_t align) { (void)size; (void)align; release(ptr); }
+void _ZdaPvmSt11align_val_t(void *ptr, size_t size, size_t align) { (void)size; (void)align; release(ptr); }
+void _ZdlPvSt11align_val_tRKSt9nothrow_t(void *ptr, size_t align, const void *tag) {
+    (void)align;
+    (void)tag;
+    release(ptr);
+}
+void _ZdaPvSt11align_val_tRKSt9nothrow_t(void *ptr, size_t align, const void *tag) {
+    (void)align;
+    (void)tag;
+    release(ptr);
 }
@@ -0,0 +1,109 @@
+#define _GNU_SOURCE
+#include "latency.h"
+#include "arena.h"
+
+#include <dlfcn.h>
+#include <string.h>
+#include <time.h>
+
+static uint64_t start_ticks, start_ns;
+static size_t (*real_usable_size)(void *) = NULL;
+
+static uint64_t mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void latency_init(void) {
+    real_usable_size = dlsym(RTLD_NEXT, "malloc_usable_size");
+    start_ns = mono_ns();
+    start_ticks = latency_now();
+}
+
+size_t latency_usable(void *ptr) {
+    return real_usable_size ? real_usable_size(ptr) : 0;
+}
+
+/* Ticks per nanosecond over the whole run, measured for at least 10 ms */
+static double ticks_per_ns(void) {
+    uint64_t ns;
+    while ((ns = mono_ns()) - start_ns < 10000000ULL)
+        ;
+    return (double)(latency_now() - start_ticks) / (double)(ns - start_ns);
+}
+
+struct latency_hist *latency_hist_get(struct thread_state *ts) {
+    /* Dedicated mapping: only the pages of buckets actually hit get backed */
+    if (!ts->latency) ts->latency = arena_map(sizeof(struct latency_hist));
+    return ts->latency;
+}
+
+/* Lowest tick count that lands in bucket b */
+static uint64_t bucket_floor(unsigned b) {
+    if (b < (1u << LATENCY_SUB_BITS)) return b;
+    unsigned e = (b >> LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1;
+    uint64_t sub = b & ((1u << LATENCY_SUB_BITS) - 1);
+    return ((1ULL << LATENCY_SUB_BITS) | sub) << (e - LATENCY_SUB_BITS);
+}
+
+/* Middle of bucket b, in ticks */
+static double bucket_mid(unsigned b) {
+    if (b < (1u << LATENCY_SUB_BITS)) return b;
+    unsigned e = (b >> LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1;
+    return (double)bucket_floor(b) + (double)(1ULL << (e - LATENCY_SUB_BITS)) / 2;
+}
+
+struct merge {
+    unsigned fn, cls;
+    uint64_t *sum;
+};
+
+static void merge_thread(const struct thread_state *ts, void *arg) {
+    struct merge *m = arg;
+    if (!ts->latency) return;
+    for (unsigned b = 0; b < LATENCY_BUCKETS; ++b)
+        m->sum[b] += atomic_load_explicit(&ts->latency->count[m->fn][m->cls][b], memory_order_relaxed);
+}
+
+static uint64_t quantile(const uint64_t *sum, uint64_t count, double q, double scale) {
+    uint64_t rank = (uint64_t)(q * (double)count);
+    if (rank >= count) rank = count - 1;
+    uint64_t seen = 0;
+    for (unsigned b = 0; b < LATENCY_BUCKETS; ++b) {
+        seen += sum[b];
+        if (seen > rank) return (uint64_t)(bucket_mid(b) / scale + 0.5);
+    }
+    return 0;
+}
+
+void latency_summarize(struct latency_row rows[LATENCY_FNS][LATENCY_CLASSES]) {
+    double scale = ticks_per_ns();
+    if (scale <= 0) scale = 1;
+    uint64_t sum[LATENCY_BUCKETS];
+    for (unsigned fn = 0; fn < LATENCY_FNS; ++fn) {
+        for (unsigned c = 0; c < LATENCY_CLASSES; ++c) {
+            memset(sum, 0, sizeof(sum));
+            struct merge m = { fn, c, sum };
+            thread_state_foreach(merge_thread, &m);
+
+            struct latency_row *r = &rows[fn][c];
+            memset(r, 0, sizeof(*r));
+            for (unsigned b = 0; b < LATENCY_BUCKETS; ++b) {
+                r->count += sum[b];
+                if (sum[b]) r->max = (uint64_t)(bucket_mid(b) / scale + 0.5);
+            }
+            if (!r->count) continue;
+            r->p50 = quantile(sum, r->count, 0.50, scale);
+            r->p99 = quantile(sum, r->count, 0.99, scale);
+            r->p999 = quantile(sum, r->count, 0.999, scale);
+        }
+    }
+}
+
+const char *latency_class_name(unsigned c) {
+    static const char *const names[LATENCY_CLASSES] = {
+        "<=64", "<=256", "<=1K", "<=4K", "<=16K", "<=64K", "<=256K", ">256K",
+    };
+    return c < LATENCY_CLASSES ? names[c] : "?";
+}
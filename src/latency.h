@@ -0,0 +1,98 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+#include "alloc_fn.h"
+#include "thread_state.h"
+
+/* Latency of the real allocator (MALLOC_FAIL_LATENCY).
+ *
+ * Each call into the real function is timed with the TSC (or
+ * CLOCK_MONOTONIC where there is none) and counted in a per-thread
+ * histogram for its function and size class. Buckets are log-linear:
+ * 16 sub-buckets per power of two, so any value is within 1/16 of its
+ * bucket. Histograms are merged and converted to nanoseconds at exit.
+ */
+
+#define LATENCY_CLASSES 8      /* <=64, <=256, ... <=256K, larger */
+#define LATENCY_SUB_BITS 4
+#define LATENCY_MAX_EXP 40     /* larger tick counts share the last bucket */
+#define LATENCY_BUCKETS ((LATENCY_MAX_EXP - LATENCY_SUB_BITS + 2) << LATENCY_SUB_BITS)
+/* Rows: every enum alloc_fn, then free() and operator delete, which are
+ * not counted as calls and so have no alloc_fn of their own. A freed
+ * block is classed by its usable size. */
+#define LATENCY_FREE FN_COUNT
+#define LATENCY_FNS (FN_COUNT + 1)
+
+struct latency_hist {
+    _Atomic uint64_t count[LATENCY_FNS][LATENCY_CLASSES][LATENCY_BUCKETS];
+};
+
+/* Merged figures for one function and size class, in nanoseconds */
+struct latency_row {
+    uint64_t count;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+};
+
+static inline uint64_t latency_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static inline unsigned latency_class(size_t size) {
+    if (size <= 64) return 0;
+    unsigned c = (64 - (unsigned)__builtin_clzll((unsigned long long)size - 1) - 5) / 2;
+    return c < LATENCY_CLASSES ? c : LATENCY_CLASSES - 1;
+}
+
+static inline unsigned latency_bucket(uint64_t ticks) {
+    if (ticks < (1u << LATENCY_SUB_BITS)) return (unsigned)ticks;
+    unsigned e = 63 - (unsigned)__builtin_clzll(ticks);
+    if (e > LATENCY_MAX_EXP) return LATENCY_BUCKETS - 1;
+    unsigned sub = (unsigned)(ticks >> (e - LATENCY_SUB_BITS)) & ((1u << LATENCY_SUB_BITS) - 1);
+    return ((e - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) + sub;
+}
+
+/* Start the clock calibration and resolve malloc_usable_size */
+void latency_init(void);
+
+/* Usable size of a block about to be freed, 0 if unknown */
+size_t latency_usable(void *ptr);
+
+/* "free" for LATENCY_FREE, the alloc_fn name otherwise */
+static inline const char *latency_fn_name(unsigned fn) {
+    return fn == LATENCY_FREE ? "free" : alloc_fn_name(fn);
+}
+
+/* The thread's histograms, mapped on first use (NULL if out of memory) */
+struct latency_hist *latency_hist_get(struct thread_state *ts);
+
+static inline void latency_record(struct thread_state *ts, unsigned fn, size_t size,
+                                  uint64_t ticks) {
+    struct latency_hist *h = ts->latency;
+    if (__builtin_expect(h == NULL, 0) && (h = latency_hist_get(ts)) == NULL) return;
+    counter_inc(&h->count[fn][latency_class(size)][latency_bucket(ticks)]);
+}
+
+/* Merge every thread's histograms into rows[fn][class] */
+void latency_summarize(struct latency_row rows[LATENCY_FNS][LATENCY_CLASSES]);
+
+/* "<=64", "<=256", ..., ">256K" */
+const char *latency_class_name(unsigned c);
+
+#endif
@@ -0,0 +1,143 @@
+#define _GNU_SOURCE
+#include "plan.h"
+#include "arena.h"
+#include "sites.h"
+#include "sort.h"
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const struct plan_header *loaded = NULL;
+static uint64_t *selected = NULL; /* sorted keys of the selected entries */
+static size_t selected_count = 0;
+
+static uint64_t mix(uint64_t h, uint64_t v) {
+    h ^= v;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64_t plan_key(const uintptr_t *pcs, unsigned n) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL;
+    for (unsigned i = 0; i < n; ++i) {
+        Dl_info info;
+        if (dladdr((void *)pcs[i], &info) && info.dli_fname) {
+            const char *module = strrchr(info.dli_fname, '/');
+            module = module ? module + 1 : info.dli_fname;
+            uint64_t m = 0xcbf29ce484222325ULL; /* FNV-1a of the file name */
+            for (const char *p = module; *p; ++p) m = (m ^ (uint8_t)*p) * 0x100000001b3ULL;
+            h = mix(mix(h, m), (uint64_t)(pcs[i] - (uintptr_t)info.dli_fbase));
+        } else {
+            h = mix(h, (uint64_t)pcs[i]);
+        }
+    }
+    return h ? h : 1;
+}
+
+/* Writer: collect sites, then order them by first hit */
+struct collect {
+    struct plan_entry *entries;
+    size_t count;
+    size_t cap;
+};
+
+static void collect_site(const struct site *s, void *arg) {
+    struct collect *c = arg;
+    if (c->count == c->cap || s->first_index == 0) return; /* pre-init sites cannot be failed */
+    struct plan_entry *e = &c->entries[c->count++];
+    e->key = plan_key(s->pcs, s->depth);
+    e->first_index = s->first_index;
+    e->hits = atomic_load_explicit(&s->hits, memory_order_relaxed);
+    sites_describe(e->where, sizeof(e->where), s->pcs[0]);
+}
+
+static int entry_cmp(const void *a, const void *b) {
+    uint64_t x = ((const struct plan_entry *)a)->first_index;
+    uint64_t y = ((const struct plan_entry *)b)->first_index;
+    return (x > y) - (x < y);
+}
+
+static int key_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+int plan_write(const char *path, unsigned depth) {
+    struct collect c = { NULL, 0, sites_count() };
+    size_t bytes = (c.cap ? c.cap : 1) * sizeof(struct plan_entry);
+    c.entries = arena_map(bytes);
+    if (!c.entries) return -1;
+    sites_foreach(collect_site, &c);
+    sort_heap(c.entries, c.count, sizeof(*c.entries), entry_cmp);
+
+    struct plan_header hdr = { PLAN_MAGIC, PLAN_VERSION, sizeof(struct plan_entry),
+                               depth, (uint32_t)c.count };
+    int rc = -1;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        size_t len = c.count * sizeof(struct plan_entry);
+        if (write(fd, &hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr) &&
+            write(fd, c.entries, len) == (ssize_t)len)
+            rc = 0;
+        close(fd);
+    }
+    arena_unmap(c.entries, bytes);
+    return rc;
+}
+
+int plan_load(const char *path, uint32_t entry) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct plan_header))
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    const struct plan_header *hdr = map;
+    if (memcmp(hdr->magic, PLAN_MAGIC, sizeof(PLAN_MAGIC)) != 0 || hdr->version != PLAN_VERSION ||
+        hdr->entry_size != sizeof(struct plan_entry) ||
+        (size_t)st.st_size < sizeof(*hdr) + (size_t)hdr->count * sizeof(struct plan_entry) ||
+        entry > hdr->count) {
+        munmap(map, (size_t)st.st_size);
+        return -1;
+    }
+    const struct plan_entry *entries = (const void *)(hdr + 1);
+
+    selected_count = entry ? 1 : hdr->count;
+    selected = arena_alloc((selected_count ? selected_count : 1) * sizeof(uint64_t));
+    if (!selected) {
+        munmap(map, (size_t)st.st_size);
+        return -1;
+    }
+    if (entry) {
+        selected[0] = entries[entry - 1].key;
+    } else {
+        for (size_t i = 0; i < selected_count; ++i) selected[i] = entries[i].key;
+        sort_heap(selected, selected_count, sizeof(*selected), key_cmp);
+    }
+    loaded = hdr;
+    return 0;
+}
+
+unsigned plan_depth(void) {
+    return loaded ? loaded->depth : 0;
+}
+
+int plan_match(const uintptr_t *pcs, unsigned n) {
+    if (!loaded || selected_count == 0) return 0;
+    uint64_t key = plan_key(pcs, n);
+    size_t lo = 0, hi = selected_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (selected[mid] < key) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < selected_count && selected[lo] == key;
+}
@@ -0,0 +1,52 @@
+#ifndef PLAN_H
+#define PLAN_H
+
+#include <stdint.h>
+
+/* Failure plans (MALLOC_FAIL_PLAN_OUT, MALLOC_FAIL_PLAN).
+ *
+ * A recording run writes one entry per distinct allocation call site, in
+ * the order the sites were first reached. A later run loads the file with
+ * mmap and fails the first hit of the selected entries' sites, so a sweep
+ * needs one run per site instead of one per allocation.
+ *
+ * Entries are keyed by module name and module-relative return addresses,
+ * which survive ASLR and unrelated changes to the allocation order.
+ */
+
+#define PLAN_MAGIC "MFPLAN"
+#define PLAN_VERSION 1
+
+/* File layout: one header followed by count entries */
+struct plan_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint32_t depth;       /* frames per site (MALLOC_FAIL_SITE_DEPTH) */
+    uint32_t count;
+};
+
+struct plan_entry {
+    uint64_t key;         /* hash of (module, offset) per frame */
+    uint64_t first_index; /* visible index of the first hit when recorded */
+    uint64_t hits;
+    char where[40];       /* innermost frame, "func+0x1a (module)" */
+};
+
+/* Stable key of a call stack, as stored in plan entries */
+uint64_t plan_key(const uintptr_t *pcs, unsigned n);
+
+/* Write every site in the site table as a plan. Returns 0 on success. */
+int plan_write(const char *path, unsigned depth);
+
+/* Map a plan and select entry (1-based), or all entries if entry is 0.
+ * Returns 0 on success. */
+int plan_load(const char *path, uint32_t entry);
+
+/* Site depth the loaded plan was recorded with, 0 if none is loaded */
+unsigned plan_depth(void);
+
+/* Whether a call stack belongs to a selected entry of the loaded plan */
+int plan_match(const uintptr_t *pcs, unsigned n);
+
+#endif
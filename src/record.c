@@ -0,0 +1,194 @@
+#define _GNU_SOURCE
+#include "record.h"
+#include "arena.h"
+#include "diag.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define RECORD_BUF_BYTES (256 * 1024)
+#define RECORD_EVENT_MAX 64 /* op + five varints, rounded up */
+
+/* One thread's pending chunk. The lock is only ever contended by
+ * record_finish, which writes out buffers of threads still running. */
+struct record_buf {
+    atomic_flag lock;
+    uint32_t tid;          /* owner when the chunk was started */
+    uint32_t len;
+    uint64_t base_seq;
+    uint64_t last_seq;
+    uintptr_t last_ptr;
+    uint64_t events;
+    struct record_buf *next;
+    uint8_t data[RECORD_BUF_BYTES];
+};
+
+static int record_fd = -1;
+static _Atomic int record_live = 0;
+static _Atomic uint64_t record_seq = 0;
+static _Atomic uint64_t chunks_written = 0;
+static _Atomic(struct record_buf *) bufs = NULL;
+
+static void write_chunk(struct record_buf *b) {
+    if (b->len == 0) return;
+    struct record_chunk c = { b->tid, b->len, b->base_seq };
+    struct iovec iov[2] = { { &c, sizeof(c) }, { b->data, b->len } };
+    size_t left = sizeof(c) + b->len;
+    /* O_APPEND: each chunk lands in one piece even with other writers */
+    while (left > 0) {
+        ssize_t n = writev(record_fd, iov, 2);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || (size_t)n == left) break;
+        /* Short write: finish the rest piece by piece */
+        left -= (size_t)n;
+        for (int i = 0; i < 2; ++i) {
+            size_t skip = (size_t)n < iov[i].iov_len ? (size_t)n : iov[i].iov_len;
+            iov[i].iov_base = (char *)iov[i].iov_base + skip;
+            iov[i].iov_len -= skip;
+            n -= (ssize_t)skip;
+        }
+    }
+    atomic_fetch_add_explicit(&chunks_written, 1, memory_order_relaxed);
+    b->len = 0;
+}
+
+static void record_atfork_child(void) {
+    /* The child would interleave its events with the parent's */
+    atomic_store_explicit(&record_live, 0, memory_order_relaxed);
+    if (record_fd >= 0) close(record_fd);
+    record_fd = -1;
+}
+
+int record_open(const char *path) {
+    record_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (record_fd < 0) return -1;
+    struct record_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, RECORD_MAGIC, sizeof(RECORD_MAGIC));
+    hdr.version = RECORD_VERSION;
+    if (write(record_fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr)) {
+        close(record_fd);
+        record_fd = -1;
+        return -1;
+    }
+    pthread_atfork(NULL, NULL, record_atfork_child);
+    atomic_store(&record_live, 1);
+    return 0;
+}
+
+static struct record_buf *buf_attach(struct thread_state *ts) {
+    struct record_buf *b = arena_map(sizeof(*b));
+    if (!b) return NULL;
+    atomic_flag_clear(&b->lock);
+    struct record_buf *head = atomic_load_explicit(&bufs, memory_order_relaxed);
+    do {
+        b->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&bufs, &head, b, memory_order_release,
+                                                    memory_order_relaxed));
+    ts->record = b;
+    return b;
+}
+
+static inline uint8_t *put_varint(uint8_t *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+/* Lock the thread's buffer with room for one more event */
+static struct record_buf *begin(struct thread_state *ts, uint64_t seq) {
+    struct record_buf *b = ts->record;
+    if (!b && !(b = buf_attach(ts))) return NULL;
+    while (atomic_flag_test_and_set_explicit(&b->lock, memory_order_acquire))
+        ;
+    /* A recycled block starts a new chunk for its new owner */
+    if (b->len + RECORD_EVENT_MAX > RECORD_BUF_BYTES || (b->len && b->tid != ts->tid))
+        write_chunk(b);
+    if (b->len == 0) {
+        b->tid = ts->tid;
+        b->base_seq = b->last_seq = seq;
+        b->last_ptr = 0;
+    }
+    return b;
+}
+
+static void end(struct record_buf *b, uint8_t *p) {
+    b->len = (uint32_t)(p - b->data);
+    b->events++;
+    atomic_flag_clear_explicit(&b->lock, memory_order_release);
+}
+
+void record_alloc(struct thread_state *ts, enum alloc_fn fn, uintptr_t ptr, uintptr_t old,
+                  uint64_t size, uint64_t align) {
+    if (!atomic_load_explicit(&record_live, memory_order_relaxed)) return;
+    /* Taken after the real call: a block freed by another thread and
+     * handed out here has a smaller sequence number for its free */
+    uint64_t seq = atomic_fetch_add_explicit(&record_seq, 1, memory_order_relaxed) + 1;
+    struct record_buf *b = begin(ts, seq);
+    if (!b) return;
+    uint8_t *p = b->data + b->len;
+    *p++ = (uint8_t)fn;
+    p = put_varint(p, seq - b->last_seq);
+    if (fn == FN_REALLOC) {
+        p = put_varint(p, record_zigzag((int64_t)(old - b->last_ptr)));
+        p = put_varint(p, size);
+        p = put_varint(p, record_zigzag((int64_t)(ptr - old)));
+    } else {
+        p = put_varint(p, size);
+        if (record_has_align(fn)) p = put_varint(p, align);
+        p = put_varint(p, record_zigzag((int64_t)(ptr - b->last_ptr)));
+    }
+    b->last_seq = seq;
+    if (ptr) b->last_ptr = ptr;
+    end(b, p);
+}
+
+void record_free(struct thread_state *ts, uintptr_t ptr) {
+    if (!atomic_load_explicit(&record_live, memory_order_relaxed)) return;
+    /* Taken before the real call, so it precedes any reuse of the block */
+    uint64_t seq = atomic_fetch_add_explicit(&record_seq, 1, memory_order_relaxed) + 1;
+    struct record_buf *b = begin(ts, seq);
+    if (!b) return;
+    uint8_t *p = b->data + b->len;
+    *p++ = RECORD_FREE;
+    p = put_varint(p, seq - b->last_seq);
+    p = put_varint(p, record_zigzag((int64_t)(ptr - b->last_ptr)));
+    b->last_seq = seq;
+    b->last_ptr = ptr;
+    end(b, p);
+}
+
+void record_finish(void) {
+    if (record_fd < 0) return;
+    atomic_store(&record_live, 0);
+    uint64_t events = 0;
+    for (struct record_buf *b = atomic_load(&bufs); b; b = b->next) {
+        while (atomic_flag_test_and_set_explicit(&b->lock, memory_order_acquire))
+            ;
+        write_chunk(b);
+        events += b->events;
+        atomic_flag_clear_explicit(&b->lock, memory_order_release);
+    }
+    struct record_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, RECORD_MAGIC, sizeof(RECORD_MAGIC));
+    hdr.version = RECORD_VERSION;
+    hdr.events = events;
+    hdr.chunks = atomic_load(&chunks_written);
+    fcntl(record_fd, F_SETFL, 0); /* pwrite would append under O_APPEND */
+    if (pwrite(record_fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr)) {
+        const char *msg = "interceptor: warning: record: could not write the file header\n";
+        diag_write(2, msg, strlen(msg));
+    }
+    close(record_fd);
+    record_fd = -1;
+}
@@ -0,0 +1,78 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdint.h>
+
+#include "alloc_fn.h"
+#include "thread_state.h"
+
+/* Allocation recording for replay (MALLOC_FAIL_RECORD=<file>).
+ *
+ * Every allocation, reallocation and free after init is appended to a
+ * per-thread buffer as a compact event; a full buffer is written by its
+ * own thread as one chunk, so nothing is ever dropped and no thread
+ * waits for another. tools/malloc_replay.c replays the file against
+ * whichever allocator it runs with.
+ *
+ * Events carry a global sequence number, so the replayer can tell which
+ * block a pointer refers to when addresses are reused across threads.
+ * All integers are LEB128 varints; sequence numbers and pointers are
+ * deltas against the previous event of the same chunk, pointers
+ * zigzag-encoded:
+ *
+ *   op (1 byte), seq delta, then per op:
+ *     allocating fn:  size, [align for posix_memalign/aligned_alloc/memalign], ptr
+ *     RECORD_FREE:    ptr
+ *     FN_REALLOC:     old ptr, size, new ptr (delta against old)
+ *
+ * A NULL result is recorded as ptr 0 and replayed as a no-op.
+ */
+
+#define RECORD_MAGIC "MFREC"
+#define RECORD_VERSION 1
+
+#define RECORD_FREE 0x7f /* op byte of free(); allocating ops use enum alloc_fn */
+
+/* File layout: one header followed by chunks in write order */
+struct record_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t events;      /* filled in at exit */
+    uint64_t chunks;      /* filled in at exit */
+};
+
+/* Chunk: header followed by bytes of encoded events of one thread */
+struct record_chunk {
+    uint32_t tid;
+    uint32_t bytes;
+    uint64_t base_seq;    /* the first event's seq delta is against this */
+};
+
+/* Open the file. Returns 0 on success. */
+int record_open(const char *path);
+
+/* Append one event for the calling thread. old is the block realloc
+ * resized, align is only stored for the aligned functions. */
+void record_alloc(struct thread_state *ts, enum alloc_fn fn, uintptr_t ptr, uintptr_t old,
+                  uint64_t size, uint64_t align);
+void record_free(struct thread_state *ts, uintptr_t ptr);
+
+/* Write out every buffer and finalize the header */
+void record_finish(void);
+
+/* Helpers shared with the replayer */
+static inline uint64_t record_zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t record_unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static inline int record_has_align(unsigned op) {
+    return op == FN_POSIX_MEMALIGN || op == FN_ALIGNED_ALLOC || op == FN_MEMALIGN ||
+           (op >= FN_NEW && op < FN_COUNT && ((op - FN_NEW) & NEW_ALIGNED));
+}
+
+#endif
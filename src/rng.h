@@ -0,0 +1,35 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+/* Per-thread pseudo-random streams for MALLOC_FAIL_RATE.
+ *
+ * Stream k of seed s starts from splitmix64(s + k * golden), so every
+ * thread draws from its own sequence without sharing state, and a run is
+ * reproduced by reusing the seed. xorshift64* costs a few cycles per draw.
+ */
+
+static inline uint64_t rng_splitmix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/* Initial state of a stream; never 0, which xorshift cannot leave */
+static inline uint64_t rng_stream_state(uint64_t seed, uint64_t stream) {
+    uint64_t s = rng_splitmix(seed + stream * 0x9e3779b97f4a7c15ULL);
+    return s ? s : 1;
+}
+
+static inline uint64_t rng_next(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+#endif
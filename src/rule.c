@@ -0,0 +1,328 @@
+#include "rule.h"
+#include "alloc_fn.h"
+#include "arena.h"
+
+#include <string.h>
+
+#define ALL_FNS ((uint32_t)((1u << FN_COUNT) - 1))
+#define MAX_DEPTH 16
+
+/* A formula in disjunctive normal form while it is built. Every level of
+ * the parse holds one, so they live in arena mappings, not on the stack. */
+struct dnf {
+    size_t count;
+    struct rule_clause clause[RULE_MAX_CLAUSES];
+};
+
+struct parser {
+    const char *p;
+    const char *error;
+    const char *where;
+    unsigned depth;
+};
+
+static int fail(struct parser *ps, const char *msg) {
+    if (!ps->error) {
+        ps->error = msg;
+        ps->where = ps->p;
+    }
+    return -1;
+}
+
+/* Report at the start of the token that turned out wrong */
+static int fail_at(struct parser *ps, const char *at, const char *msg) {
+    ps->p = at;
+    return fail(ps, msg);
+}
+
+static void skip_ws(struct parser *ps) {
+    while (*ps->p == ' ' || *ps->p == '\t') ps->p++;
+}
+
+static int accept(struct parser *ps, const char *tok) {
+    size_t n = strlen(tok);
+    skip_ws(ps);
+    if (strncmp(ps->p, tok, n) != 0) return 0;
+    ps->p += n;
+    return 1;
+}
+
+static struct dnf *dnf_new(struct parser *ps) {
+    struct dnf *d = arena_map(sizeof(*d));
+    if (!d) fail(ps, "out of memory");
+    return d;
+}
+
+static void dnf_free(struct dnf *d) {
+    arena_unmap(d, sizeof(*d));
+}
+
+static void clause_true(struct rule_clause *c) {
+    memset(c, 0, sizeof(*c));
+    c->fns = ALL_FNS;
+    for (int v = 0; v < RULE_VARS; ++v) c->span[v] = UINT64_MAX;
+}
+
+static int dnf_add(struct parser *ps, struct dnf *d, const struct rule_clause *c) {
+    if (d->count == RULE_MAX_CLAUSES) return fail(ps, "too many alternatives");
+    d->clause[d->count++] = *c;
+    return 0;
+}
+
+/* a && b into out. Returns 1, 0 if it can never match, -1 on error. */
+static int clause_and(struct parser *ps, struct rule_clause *out, const struct rule_clause *a,
+                      const struct rule_clause *b) {
+    out->fns = a->fns & b->fns;
+    if (!out->fns) return 0;
+    for (int v = 0; v < RULE_VARS; ++v) {
+        uint64_t lo = a->lo[v] > b->lo[v] ? a->lo[v] : b->lo[v];
+        uint64_t a_hi = a->lo[v] + a->span[v], b_hi = b->lo[v] + b->span[v];
+        uint64_t hi = a_hi < b_hi ? a_hi : b_hi;
+        if (lo > hi) return 0;
+        out->lo[v] = lo;
+        out->span[v] = hi - lo;
+    }
+    if (a->mods + b->mods > RULE_MAX_MODS) return fail(ps, "too many % terms in one alternative");
+    out->mods = a->mods + b->mods;
+    memcpy(out->mod, a->mod, a->mods * sizeof(*a->mod));
+    memcpy(out->mod + a->mods, b->mod, b->mods * sizeof(*b->mod));
+    return 1;
+}
+
+/* d = d && e: every pair of alternatives */
+static int dnf_and(struct parser *ps, struct dnf *d, const struct dnf *e) {
+    struct dnf *out = dnf_new(ps);
+    if (!out) return -1;
+    int ret = 0;
+    for (size_t i = 0; i < d->count && ret == 0; ++i) {
+        for (size_t j = 0; j < e->count && ret == 0; ++j) {
+            struct rule_clause c;
+            int r = clause_and(ps, &c, &d->clause[i], &e->clause[j]);
+            if (r < 0) ret = -1;
+            else if (r > 0) ret = dnf_add(ps, out, &c);
+        }
+    }
+    if (ret == 0) memcpy(d, out, sizeof(*d));
+    dnf_free(out);
+    return ret;
+}
+
+/* d = d || e */
+static int dnf_or(struct parser *ps, struct dnf *d, const struct dnf *e) {
+    for (size_t i = 0; i < e->count; ++i)
+        if (dnf_add(ps, d, &e->clause[i]) != 0) return -1;
+    return 0;
+}
+
+static size_t ident_len(const char *s) {
+    size_t n = 0;
+    while ((s[n] >= 'a' && s[n] <= 'z') || (s[n] >= '0' && s[n] <= '9') || s[n] == '_') n++;
+    return n;
+}
+
+/* Decimal number with an optional K/M/G multiplier */
+static int parse_number(struct parser *ps, uint64_t *out) {
+    skip_ws(ps);
+    if (*ps->p < '0' || *ps->p > '9') return fail(ps, "expected a number");
+    const char *start = ps->p;
+    uint64_t v = 0;
+    for (; *ps->p >= '0' && *ps->p <= '9'; ps->p++) {
+        uint64_t d = (uint64_t)(*ps->p - '0');
+        if (v > (UINT64_MAX - d) / 10) return fail_at(ps, start, "number too large");
+        v = v * 10 + d;
+    }
+    unsigned shift = 0;
+    switch (*ps->p) {
+    case 'k': case 'K': shift = 10; break;
+    case 'm': case 'M': shift = 20; break;
+    case 'g': case 'G': shift = 30; break;
+    }
+    if (shift) {
+        if (v > UINT64_MAX >> shift) return fail_at(ps, start, "number too large");
+        v <<= shift;
+        ps->p++;
+    }
+    *out = v;
+    return 0;
+}
+
+enum cmp { CMP_EQ, CMP_NE, CMP_LT, CMP_LE, CMP_GT, CMP_GE };
+
+static int parse_cmp(struct parser *ps, enum cmp *op) {
+    if (accept(ps, "==")) *op = CMP_EQ;
+    else if (accept(ps, "!=")) *op = CMP_NE;
+    else if (accept(ps, "<=")) *op = CMP_LE;
+    else if (accept(ps, ">=")) *op = CMP_GE;
+    else if (accept(ps, "<")) *op = CMP_LT;
+    else if (accept(ps, ">")) *op = CMP_GT;
+    else return fail(ps, "expected a comparison");
+    return 0;
+}
+
+/* The comparison that holds exactly when op does not */
+static enum cmp cmp_negate(enum cmp op) {
+    static const enum cmp inverse[] = {
+        [CMP_EQ] = CMP_NE, [CMP_NE] = CMP_EQ, [CMP_LT] = CMP_GE,
+        [CMP_LE] = CMP_GT, [CMP_GT] = CMP_LE, [CMP_GE] = CMP_LT,
+    };
+    return inverse[op];
+}
+
+/* Append var in [lo, hi] as one alternative */
+static int add_range(struct parser *ps, struct dnf *out, int var, uint64_t lo, uint64_t hi) {
+    struct rule_clause c;
+    clause_true(&c);
+    c.lo[var] = lo;
+    c.span[var] = hi - lo;
+    return dnf_add(ps, out, &c);
+}
+
+/* fn==name, var OP number or var%N==R; negated when neg is set */
+static int parse_atom(struct parser *ps, int neg, struct dnf *out) {
+    skip_ws(ps);
+    size_t n = ident_len(ps->p);
+    struct rule_clause c;
+    enum cmp op;
+    clause_true(&c);
+
+    if (n == 2 && strncmp(ps->p, "fn", 2) == 0) {
+        ps->p += n;
+        skip_ws(ps);
+        const char *at = ps->p;
+        if (parse_cmp(ps, &op) != 0) return -1;
+        if (op != CMP_EQ && op != CMP_NE) return fail_at(ps, at, "fn only takes == and !=");
+        skip_ws(ps);
+        n = ident_len(ps->p);
+        unsigned fn = 0;
+        while (fn < FN_COUNT && !(strlen(alloc_fn_name(fn)) == n && strncmp(ps->p, alloc_fn_name(fn), n) == 0))
+            fn++;
+        if (fn == FN_COUNT) return fail(ps, "unknown function");
+        ps->p += n;
+        c.fns = 1u << fn;
+        if ((op == CMP_NE) != (neg != 0)) c.fns = ALL_FNS & ~c.fns;
+        return dnf_add(ps, out, &c);
+    }
+
+    int var;
+    if (n == 4 && strncmp(ps->p, "size", 4) == 0) var = RULE_SIZE;
+    else if (n == 3 && strncmp(ps->p, "idx", 3) == 0) var = RULE_IDX;
+    else return fail(ps, "expected fn, size or idx");
+    ps->p += n;
+
+    uint64_t v;
+    if (accept(ps, "%")) {
+        uint64_t div;
+        skip_ws(ps);
+        const char *at = ps->p;
+        if (parse_number(ps, &div) != 0) return -1;
+        if (div == 0) return fail_at(ps, at, "modulo by zero");
+        skip_ws(ps);
+        at = ps->p;
+        if (parse_cmp(ps, &op) != 0) return -1;
+        if (op != CMP_EQ && op != CMP_NE) return fail_at(ps, at, "% only takes == and !=");
+        if (parse_number(ps, &v) != 0) return -1;
+        c.mods = 1;
+        c.mod[0] = (struct rule_mod){ div, v, (uint8_t)var, (uint8_t)((op == CMP_NE) != (neg != 0)) };
+        return dnf_add(ps, out, &c);
+    }
+
+    if (parse_cmp(ps, &op) != 0 || parse_number(ps, &v) != 0) return -1;
+    if (neg) op = cmp_negate(op);
+    switch (op) {
+    case CMP_EQ: return add_range(ps, out, var, v, v);
+    case CMP_LE: return add_range(ps, out, var, 0, v);
+    case CMP_GE: return add_range(ps, out, var, v, UINT64_MAX);
+    case CMP_LT: return v ? add_range(ps, out, var, 0, v - 1) : 0; /* false: no alternative */
+    case CMP_GT: return v < UINT64_MAX ? add_range(ps, out, var, v + 1, UINT64_MAX) : 0;
+    case CMP_NE:
+        if (v && add_range(ps, out, var, 0, v - 1) != 0) return -1;
+        return v < UINT64_MAX ? add_range(ps, out, var, v + 1, UINT64_MAX) : 0;
+    }
+    return 0;
+}
+
+static int parse_or(struct parser *ps, int neg, struct dnf *out);
+
+/* Negation is pushed down to the atoms (De Morgan), so it never needs
+ * a complement of a whole formula */
+static int parse_unary(struct parser *ps, int neg, struct dnf *out) {
+    skip_ws(ps);
+    if (ps->p[0] == '!' && ps->p[1] != '=') {
+        ps->p++;
+        return parse_unary(ps, !neg, out);
+    }
+    if (!accept(ps, "(")) return parse_atom(ps, neg, out);
+    if (++ps->depth > MAX_DEPTH) return fail(ps, "nested too deeply");
+    if (parse_or(ps, neg, out) != 0) return -1;
+    if (!accept(ps, ")")) return fail(ps, "expected ')'");
+    ps->depth--;
+    return 0;
+}
+
+/* a && b && ..., which is an || of the negated terms under neg */
+static int parse_and(struct parser *ps, int neg, struct dnf *out) {
+    if (parse_unary(ps, neg, out) != 0) return -1;
+    while (accept(ps, "&&")) {
+        struct dnf *term = dnf_new(ps);
+        if (!term) return -1;
+        int ret = parse_unary(ps, neg, term);
+        if (ret == 0) ret = neg ? dnf_or(ps, out, term) : dnf_and(ps, out, term);
+        dnf_free(term);
+        if (ret != 0) return -1;
+    }
+    return 0;
+}
+
+static int parse_or(struct parser *ps, int neg, struct dnf *out) {
+    if (parse_and(ps, neg, out) != 0) return -1;
+    while (accept(ps, "||")) {
+        struct dnf *term = dnf_new(ps);
+        if (!term) return -1;
+        int ret = parse_and(ps, neg, term);
+        if (ret == 0) ret = neg ? dnf_and(ps, out, term) : dnf_or(ps, out, term);
+        dnf_free(term);
+        if (ret != 0) return -1;
+    }
+    return 0;
+}
+
+int rule_parse(struct rule_set *rules, const char *s, const char **error, const char **where) {
+    struct parser ps = { .p = s };
+    struct dnf *all = dnf_new(&ps);
+    int ret = all ? parse_or(&ps, 0, all) : -1;
+    /* Rules separated by ';' (a trailing one is fine) */
+    while (ret == 0 && accept(&ps, ";")) {
+        skip_ws(&ps);
+        if (!*ps.p) break;
+        struct dnf *rule = dnf_new(&ps);
+        ret = rule ? parse_or(&ps, 0, rule) : -1;
+        if (ret == 0) ret = dnf_or(&ps, all, rule);
+        if (rule) dnf_free(rule);
+    }
+    skip_ws(&ps);
+    if (ret == 0 && *ps.p) ret = fail(&ps, "unexpected text");
+
+    struct rule_clause *clauses = NULL;
+    if (ret == 0 && all->count) {
+        clauses = arena_alloc(all->count * sizeof(*clauses));
+        if (!clauses) ret = fail(&ps, "out of memory");
+    }
+    if (ret == 0) {
+        if (clauses) memcpy(clauses, all->clause, all->count * sizeof(*clauses));
+        rules->clauses = clauses;
+        rules->count = all->count;
+        rules->uses = 0;
+        for (size_t i = 0; i < all->count; ++i) {
+            const struct rule_clause *c = &clauses[i];
+            if (c->fns != ALL_FNS) rules->uses |= RULE_USES_FN;
+            if (c->lo[RULE_IDX] != 0 || c->span[RULE_IDX] != UINT64_MAX) rules->uses |= RULE_USES_IDX;
+            for (uint32_t m = 0; m < c->mods; ++m)
+                if (c->mod[m].var == RULE_IDX) rules->uses |= RULE_USES_IDX;
+        }
+    } else {
+        *error = ps.error;
+        *where = ps.where;
+    }
+    if (all) dnf_free(all);
+    return ret;
+}
@@ -0,0 +1,86 @@
+#ifndef RULE_H
+#define RULE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Failure rules (MALLOC_FAIL_RULE).
+ *
+ *   MALLOC_FAIL_RULE="fn==calloc && size>=4K && idx%7==0; fn==realloc"
+ *
+ * A rule is a condition on the call: fn (function name), size (requested
+ * bytes, K/M/G suffixes allowed) and idx (the index MALLOC_FAIL_AT would
+ * see). Comparisons are == != < <= > >=, and size and idx also take
+ * "%N==R" and "%N!=R". They combine with && || ! and parentheses. A call
+ * fails if any of the ';'-separated rules matches.
+ *
+ * The expression is parsed once into disjunctive normal form. Each
+ * conjunction becomes a clause holding a function mask, a range per
+ * variable and a few modulo terms, so a call costs a short loop of
+ * compares and nothing is allocated. Terms no clause uses are left out
+ * of the evaluation altogether (rule_match's uses argument), which keeps
+ * a rule as cheap as the fixed MALLOC_FAIL_SIZE_MIN/EVERY checks.
+ */
+
+enum rule_var { RULE_SIZE, RULE_IDX, RULE_VARS };
+
+/* Terms some clause restricts */
+#define RULE_USES_FN  (1u << 0)
+#define RULE_USES_IDX (1u << 1)
+
+#define RULE_MAX_CLAUSES 64
+#define RULE_MAX_MODS 4
+
+/* var % div == rem, or != when negate is set */
+struct rule_mod {
+    uint64_t div;
+    uint64_t rem;
+    uint8_t var;
+    uint8_t negate;
+};
+
+/* One conjunction: every term must hold */
+struct rule_clause {
+    uint32_t fns;             /* bit per enum alloc_fn */
+    uint32_t mods;            /* terms used in mod[] */
+    uint64_t lo[RULE_VARS];   /* var - lo <= span: one compare per range */
+    uint64_t span[RULE_VARS];
+    struct rule_mod mod[RULE_MAX_MODS];
+};
+
+struct rule_set {
+    const struct rule_clause *clauses;
+    size_t count;
+    unsigned uses;            /* RULE_USES_* */
+};
+
+/* Compile s into rules. Returns 0 on success; on error returns -1 with
+ * *error describing the problem and *where pointing into s. */
+int rule_parse(struct rule_set *rules, const char *s, const char **error, const char **where);
+
+/* uses is a constant in every caller, so the unused tests compile away */
+static inline int rule_clause_match(const struct rule_clause *c, unsigned uses, unsigned fn,
+                                    uint64_t size, uint64_t idx) {
+    if ((uses & RULE_USES_FN) && !(c->fns >> fn & 1)) return 0;
+    if (size - c->lo[RULE_SIZE] > c->span[RULE_SIZE]) return 0;
+    if ((uses & RULE_USES_IDX) && idx - c->lo[RULE_IDX] > c->span[RULE_IDX]) return 0;
+    /* Combined without branches: a pattern like idx%7 defeats prediction */
+    int ok = 1;
+    for (uint32_t i = 0; i < c->mods; ++i) {
+        const struct rule_mod *m = &c->mod[i];
+        uint64_t v = m->var == RULE_IDX ? idx : size; /* a cmov, not a load */
+        ok &= (v % m->div == m->rem) != m->negate;
+    }
+    return ok;
+}
+
+/* Does any rule match the call? uses must cover rules->uses. */
+static inline int rule_match(const struct rule_set *rules, unsigned uses, unsigned fn,
+                             uint64_t size, uint64_t idx) {
+    if (rules->count == 1) return rule_clause_match(rules->clauses, uses, fn, size, idx);
+    for (size_t i = 0; i < rules->count; ++i)
+        if (rule_clause_match(&rules->clauses[i], uses, fn, size, idx)) return 1;
+    return 0;
+}
+
+#endif
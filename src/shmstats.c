@@ -0,0 +1,107 @@
+#define _GNU_SOURCE
+#include "shmstats.h"
+#include "threads.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+static struct shm_stats *segment = NULL;
+static char segment_path[64];
+static shm_fill_fn fill_data = NULL;
+static pthread_t publisher;
+static int publisher_started = 0;
+static _Atomic int publisher_run = 0;
+
+static void publish(uint32_t state) {
+    struct shm_stats_data data;
+    memset(&data, 0, sizeof(data));
+    fill_data(&data);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    data.updated_ns = (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+    data.state = state;
+
+    /* Seqlock write side: odd, data, even */
+    uint64_t seq = atomic_load_explicit(&segment->seq, memory_order_relaxed);
+    atomic_store_explicit(&segment->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(&segment->data, &data, sizeof(data));
+    atomic_store_explicit(&segment->seq, seq + 2, memory_order_release);
+}
+
+static void *publisher_main(void *arg) {
+    (void)arg;
+    /* Leave every signal to the application's own threads */
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    /* Sleep in short slices so shutdown does not wait out an interval */
+    struct timespec slice = { 0, 10 * 1000000L };
+    unsigned slices = 0;
+    while (atomic_load_explicit(&publisher_run, memory_order_relaxed)) {
+        if (slices++ % (SHM_STATS_INTERVAL_MS / 10) == 0) publish(SHM_RUNNING);
+        nanosleep(&slice, NULL);
+    }
+    return NULL;
+}
+
+/* The publisher does not survive fork(), and the segment is the
+ * parent's: children leave it alone. */
+static void shm_stats_atfork_child(void) {
+    atomic_store_explicit(&publisher_run, 0, memory_order_relaxed);
+    publisher_started = 0;
+    segment = NULL;
+}
+
+int shm_stats_open(shm_fill_fn fill) {
+    snprintf(segment_path, sizeof(segment_path), SHM_STATS_PATH_FMT, (int)getpid());
+    int fd = open(segment_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    if (ftruncate(fd, sizeof(struct shm_stats)) != 0) {
+        close(fd);
+        unlink(segment_path);
+        return -1;
+    }
+    void *map = mmap(NULL, sizeof(struct shm_stats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        unlink(segment_path);
+        return -1;
+    }
+
+    segment = map;
+    fill_data = fill;
+    memcpy(segment->magic, SHM_STATS_MAGIC, sizeof(SHM_STATS_MAGIC));
+    segment->size = sizeof(struct shm_stats);
+    segment->pid = (int32_t)getpid();
+    segment->interval_ms = SHM_STATS_INTERVAL_MS;
+    /* Readers check the version last, so it goes in last */
+    atomic_thread_fence(memory_order_release);
+    segment->version = SHM_STATS_VERSION;
+
+    pthread_atfork(NULL, NULL, shm_stats_atfork_child);
+    atomic_store(&publisher_run, 1);
+    if (thread_create_internal(&publisher, publisher_main, "malloc-shm") == 0)
+        publisher_started = 1;
+    return 0;
+}
+
+void shm_stats_finish(void) {
+    if (!segment) return;
+    if (publisher_started) {
+        atomic_store(&publisher_run, 0);
+        pthread_join(publisher, NULL);
+        publisher_started = 0;
+    }
+    publish(SHM_EXITED);
+    unlink(segment_path);
+    munmap(segment, sizeof(struct shm_stats));
+    segment = NULL;
+}
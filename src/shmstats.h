@@ -0,0 +1,62 @@
+#ifndef SHMSTATS_H
+#define SHMSTATS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "thread_state.h"
+
+/* Live statistics in shared memory (MALLOC_FAIL_SHM=1).
+ *
+ * A background thread copies the merged counters into
+ * /dev/shm/malloc_fail.<pid> every SHM_STATS_INTERVAL_MS. Readers (see
+ * tools/malloc_stat.c) map the file read-only and use the sequence
+ * counter as a seqlock: it is odd while an update is in progress, and a
+ * copy is consistent if it read the same even value before and after.
+ * The allocation path is untouched; it only bumps its per-thread
+ * counters as usual. The file is removed at a clean exit and left behind
+ * after a crash, holding the last published state.
+ */
+
+#define SHM_STATS_MAGIC "MFSHM"
+#define SHM_STATS_VERSION 2
+#define SHM_STATS_INTERVAL_MS 100
+#define SHM_STATS_PATH_FMT "/dev/shm/malloc_fail.%d"
+
+enum shm_state {
+    SHM_RUNNING = 1,
+    SHM_EXITED = 2,          /* final update from the destructor */
+};
+
+/* What the publisher copies; filled in by the interceptor */
+struct shm_stats_data {
+    uint64_t updated_ns;     /* CLOCK_MONOTONIC of this update */
+    uint32_t state;          /* enum shm_state */
+    uint32_t hook_flags;     /* active features */
+    uint64_t visible;        /* allocations after init */
+    uint64_t first_failure;  /* visible index of the first injected failure */
+    int64_t live_bytes;      /* MALLOC_FAIL_LIMIT accounting, 0 otherwise */
+    uint64_t total[FN_COUNT];
+    uint64_t failed[FN_COUNT];
+    uint64_t sizes[FN_COUNT][SIZE_BUCKETS];
+};
+
+struct shm_stats {
+    char magic[8];
+    uint32_t version;
+    uint32_t size;           /* sizeof(struct shm_stats) */
+    int32_t pid;
+    uint32_t interval_ms;
+    _Atomic uint64_t seq;
+    struct shm_stats_data data;
+};
+
+typedef void (*shm_fill_fn)(struct shm_stats_data *data);
+
+/* Create the segment and start the publisher. Returns 0 on success. */
+int shm_stats_open(shm_fill_fn fill);
+
+/* Stop the publisher, publish the final state and remove the file */
+void shm_stats_finish(void);
+
+#endif
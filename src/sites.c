@@ -0,0 +1,274 @@
+#define _GNU_SOURCE
+#include "sites.h"
+#include "arena.h"
+#include "diag.h"
+#include "plan.h"
+
+#include <dlfcn.h>
+#include <inttypes.h>
+#include <link.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SITE_TABLE_SIZE 65536 /* power of two */
+#define SITE_MAX_PROBE 32     /* a longer run counts as full */
+#define SITE_MAX_TARGETS 16
+
+/* Code range a site has to pass through, and how many frames to look at */
+struct site_target {
+    uintptr_t lo;
+    uintptr_t hi;
+    unsigned depth;
+};
+
+static struct site *table = NULL;
+static unsigned site_depth = 1;
+static struct site_target targets[SITE_MAX_TARGETS];
+static unsigned target_count = 0;
+static _Atomic uint64_t overflow = 0;
+
+static uint64_t hash_pcs(const uintptr_t *pcs, unsigned n) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL;
+    for (unsigned i = 0; i < n; ++i) {
+        h ^= (uint64_t)pcs[i];
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+    }
+    return h ? h : 1;
+}
+
+/* Resolve "sym" or "0xaddr" to a code range. A function gives its whole
+ * body; an address that is not a function start matches exactly. */
+static int resolve_target(const char *name, struct site_target *t) {
+    void *addr;
+    if (name[0] == '0' && (name[1] == 'x' || name[1] == 'X'))
+        addr = (void *)(uintptr_t)strtoull(name, NULL, 16);
+    else
+        addr = dlsym(RTLD_DEFAULT, name);
+    if (!addr) return -1;
+
+    Dl_info info;
+    const ElfW(Sym) *sym = NULL;
+    if (dladdr1(addr, &info, (void **)&sym, RTLD_DL_SYMENT) && sym &&
+        info.dli_saddr == addr && sym->st_size > 0) {
+        t->lo = (uintptr_t)addr;
+        t->hi = (uintptr_t)addr + sym->st_size;
+    } else {
+        t->lo = (uintptr_t)addr;
+        t->hi = (uintptr_t)addr + 1;
+    }
+    return 0;
+}
+
+static void parse_targets(const char *s) {
+    char name[256];
+    while (*s && target_count < SITE_MAX_TARGETS) {
+        size_t len = strcspn(s, ",");
+        if (len > 0 && len < sizeof(name)) {
+            memcpy(name, s, len);
+            name[len] = '\0';
+            unsigned depth = 1;
+            char *plus = strrchr(name, '+');
+            if (plus && plus[1] >= '0' && plus[1] <= '9') {
+                depth = (unsigned)strtoul(plus + 1, NULL, 10);
+                *plus = '\0';
+            }
+            if (depth < 1) depth = 1;
+            if (depth > SITE_MAX_DEPTH) depth = SITE_MAX_DEPTH;
+
+            struct site_target *t = &targets[target_count];
+            if (resolve_target(name, t) == 0) {
+                t->depth = depth;
+                if (depth > site_depth) site_depth = depth;
+                target_count++;
+            } else {
+                char msg[320];
+                int n = snprintf(msg, sizeof(msg),
+                                 "interceptor: warning: MALLOC_FAIL_SITE: cannot resolve '%s'\n", name);
+                if (n > 0) diag_write(2, msg, (size_t)n);
+            }
+        }
+        s += len;
+        if (*s == ',') s++;
+    }
+}
+
+int sites_init(const char *spec, unsigned depth) {
+    site_depth = depth < 1 ? 1 : depth > SITE_MAX_DEPTH ? SITE_MAX_DEPTH : depth;
+    if (spec) parse_targets(spec);
+    table = arena_map(sizeof(struct site) * SITE_TABLE_SIZE);
+    return table ? 0 : -1;
+}
+
+unsigned sites_target_count(void) {
+    return target_count;
+}
+
+/* Bounds of the current thread's stack, so the frame walk never reads
+ * outside it even when the program was built without frame pointers. */
+static void stack_bounds(struct thread_state *ts) {
+    if (ts->stack_hi) return;
+    ts->internal++; /* pthread_getattr_np allocates */
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+        void *base;
+        size_t size;
+        if (pthread_attr_getstack(&attr, &base, &size) == 0) {
+            ts->stack_lo = (uintptr_t)base;
+            ts->stack_hi = (uintptr_t)base + size;
+        }
+        pthread_attr_destroy(&attr);
+    }
+    ts->internal--;
+}
+
+unsigned sites_capture(struct thread_state *ts, uintptr_t *pcs, unsigned max, uintptr_t ret,
+                       void *frame) {
+    unsigned n = 0;
+    pcs[n++] = ret;
+    if (max <= 1) return n;
+
+    stack_bounds(ts);
+    uintptr_t lo = ts->stack_lo, hi = ts->stack_hi;
+    if (!hi) return n;
+
+    /* frame -> wrapper's saved rbp (the program's frame) -> ... */
+    uintptr_t fp = (uintptr_t)frame;
+    if (fp < lo || fp + 2 * sizeof(uintptr_t) > hi) return n;
+    fp = ((uintptr_t *)fp)[0];
+    while (n < max) {
+        if (fp < lo || fp + 2 * sizeof(uintptr_t) > hi || (fp & (sizeof(uintptr_t) - 1)))
+            break;
+        uintptr_t pc = ((uintptr_t *)fp)[1];
+        uintptr_t next = ((uintptr_t *)fp)[0];
+        if (!pc) break;
+        pcs[n++] = pc;
+        if (next <= fp) break;
+        fp = next;
+    }
+    return n;
+}
+
+static uint8_t site_matches(const uintptr_t *pcs, unsigned n) {
+    for (unsigned t = 0; t < target_count; ++t)
+        for (unsigned i = 0; i < n && i < targets[t].depth; ++i)
+            if (pcs[i] >= targets[t].lo && pcs[i] < targets[t].hi) return 1;
+    return 0;
+}
+
+struct site *sites_get(struct thread_state *ts, uintptr_t ret, void *frame,
+                       uint64_t visible_index) {
+    uintptr_t pcs[SITE_MAX_DEPTH];
+    unsigned n = sites_capture(ts, pcs, site_depth, ret, frame);
+    uint64_t key = hash_pcs(pcs, n);
+
+    for (size_t probe = 0; probe < SITE_MAX_PROBE; ++probe) {
+        struct site *s = &table[(key + probe) & (SITE_TABLE_SIZE - 1)];
+        uint64_t k = atomic_load_explicit(&s->key, memory_order_acquire);
+        if (k == 0) {
+            if (!atomic_compare_exchange_strong_explicit(&s->key, &k, key,
+                                                         memory_order_acq_rel,
+                                                         memory_order_acquire)) {
+                if (k != key) continue; /* lost the slot to another site */
+            } else {
+                memcpy(s->pcs, pcs, n * sizeof(pcs[0]));
+                s->depth = (uint8_t)n;
+                s->first_index = visible_index;
+                s->match = site_matches(pcs, n);
+                if (!s->match && plan_depth()) {
+                    ts->internal++; /* dladdr may allocate */
+                    s->match = (uint8_t)plan_match(pcs, n);
+                    ts->internal--;
+                }
+                atomic_store_explicit(&s->ready, 1, memory_order_release);
+                return s;
+            }
+        }
+        if (k == key) {
+            /* The inserter is a few stores away from publishing */
+            while (!atomic_load_explicit(&s->ready, memory_order_acquire))
+                ;
+            return s;
+        }
+    }
+    atomic_fetch_add_explicit(&overflow, 1, memory_order_relaxed);
+    return NULL;
+}
+
+void sites_describe(char *buf, size_t len, uintptr_t pc) {
+    Dl_info info;
+    if (dladdr((void *)pc, &info) && info.dli_fname) {
+        const char *module = strrchr(info.dli_fname, '/');
+        module = module ? module + 1 : info.dli_fname;
+        if (info.dli_sname)
+            snprintf(buf, len, "%s+0x%zx (%s)", info.dli_sname,
+                     (size_t)(pc - (uintptr_t)info.dli_saddr), module);
+        else
+            snprintf(buf, len, "%s+0x%zx", module, (size_t)(pc - (uintptr_t)info.dli_fbase));
+    } else {
+        snprintf(buf, len, "0x%zx", (size_t)pc);
+    }
+}
+
+size_t sites_count(void) {
+    size_t n = 0;
+    for (size_t i = 0; table && i < SITE_TABLE_SIZE; ++i)
+        if (atomic_load_explicit(&table[i].ready, memory_order_acquire)) n++;
+    return n;
+}
+
+void sites_foreach(void (*fn)(const struct site *s, void *arg), void *arg) {
+    for (size_t i = 0; table && i < SITE_TABLE_SIZE; ++i)
+        if (atomic_load_explicit(&table[i].ready, memory_order_acquire)) fn(&table[i], arg);
+}
+
+void sites_report(int fd, unsigned top) {
+    if (!table) return;
+
+    /* Selection of the busiest sites; the table itself stays untouched */
+    struct site *best[64];
+    if (top > 64) top = 64;
+    unsigned found = 0;
+    size_t distinct = 0;
+    for (size_t i = 0; i < SITE_TABLE_SIZE; ++i) {
+        struct site *s = &table[i];
+        if (!atomic_load_explicit(&s->ready, memory_order_acquire)) continue;
+        distinct++;
+        uint64_t hits = atomic_load_explicit(&s->hits, memory_order_relaxed);
+        unsigned pos = found < top ? found++ : top;
+        while (pos > 0 && atomic_load_explicit(&best[pos - 1]->hits, memory_order_relaxed) < hits) {
+            if (pos < top) best[pos] = best[pos - 1];
+            pos--;
+        }
+        if (pos < top) best[pos] = s;
+    }
+
+    char buf[512];
+    int len = snprintf(buf, sizeof(buf), "--- call sites: %zu distinct, top %u by hits ---\n",
+                       distinct, found);
+    if (len > 0) diag_write(fd, buf, (size_t)len);
+    for (unsigned i = 0; i < found; ++i) {
+        struct site *s = best[i];
+        char where[256];
+        sites_describe(where, sizeof(where), s->pcs[0]);
+        char first[24] = "-";
+        if (s->first_index) snprintf(first, sizeof(first), "#%" PRIu64, s->first_index);
+        len = snprintf(buf, sizeof(buf), "%10" PRIu64 " hits %10" PRIu64 " failed  first %-9s %s%s\n",
+                       atomic_load(&s->hits), atomic_load(&s->failed), first, where,
+                       s->match ? "  [target]" : "");
+        if (len > 0) diag_write(fd, buf, (size_t)len);
+        for (unsigned d = 1; d < s->depth; ++d) {
+            sites_describe(where, sizeof(where), s->pcs[d]);
+            len = snprintf(buf, sizeof(buf), "%55s<- %s\n", "", where);
+            if (len > 0) diag_write(fd, buf, (size_t)len);
+        }
+    }
+    uint64_t lost = atomic_load(&overflow);
+    if (lost) {
+        len = snprintf(buf, sizeof(buf), "(call site table full or crowded: %" PRIu64 " calls not attributed)\n", lost);
+        if (len > 0) diag_write(fd, buf, (size_t)len);
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef SITES_H
+#define SITES_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "thread_state.h"
+
+/* Allocation call sites (MALLOC_FAIL_SITE, MALLOC_FAIL_SITE_FIRST).
+ *
+ * A site is the caller's return address plus, optionally, a few more
+ * frames from a frame-pointer walk. Sites live in a fixed open-addressed
+ * table mapped with mmap; inserting is a CAS on the key, so lookups never
+ * lock and never call malloc. Whether a site matches MALLOC_FAIL_SITE is
+ * decided once, when it is inserted. Symbols are only looked up when the
+ * report is printed.
+ */
+
+#define SITE_MAX_DEPTH 8
+
+struct site {
+    _Atomic uint64_t key;        /* stack hash, 0 = empty slot */
+    _Atomic uint64_t hits;
+    _Atomic uint64_t failed;
+    uint64_t first_index;        /* visible index of the first hit, 0 if unknown */
+    uintptr_t pcs[SITE_MAX_DEPTH];
+    uint8_t depth;
+    uint8_t match;               /* matches a MALLOC_FAIL_SITE target or plan entry */
+    _Atomic uint8_t ready;       /* pcs/match are published */
+};
+
+/* Parse MALLOC_FAIL_SITE ("sym[+depth],0xaddr[+depth],...", may be NULL)
+ * and map the table. depth is MALLOC_FAIL_SITE_DEPTH, the number of frames
+ * that make up a site's identity. Returns 0 on success. */
+int sites_init(const char *targets, unsigned depth);
+
+/* Number of targets parsed from MALLOC_FAIL_SITE */
+unsigned sites_target_count(void);
+
+/* Site for the current call. ret is the wrapper's return address and
+ * frame the frame address of the function calling sites_get. Returns NULL
+ * if the table is full. */
+struct site *sites_get(struct thread_state *ts, uintptr_t ret, void *frame,
+                       uint64_t visible_index);
+
+/* Up to max return addresses of the current stack: pcs[0] is ret (the
+ * wrapper's), the rest come from the saved frame-pointer chain above
+ * frame, the frame address of the function calling this. Works without
+ * sites_init. Returns the number captured. */
+unsigned sites_capture(struct thread_state *ts, uintptr_t *pcs, unsigned max, uintptr_t ret,
+                       void *frame);
+
+/* Number of distinct sites, and a walk over them (for plans) */
+size_t sites_count(void);
+void sites_foreach(void (*fn)(const struct site *s, void *arg), void *arg);
+
+/* "func+0x1a (module)" for a return address */
+void sites_describe(char *buf, size_t len, uintptr_t pc);
+
+/* Append the top sites by hits to the statistics report */
+void sites_report(int fd, unsigned top);
+
+#endif
@@ -0,0 +1,31 @@
+#include "sort.h"
+
+static void swap(unsigned char *a, unsigned char *b, size_t size) {
+    while (size--) {
+        unsigned char t = *a;
+        *a++ = *b;
+        *b++ = t;
+    }
+}
+
+static void sift_down(unsigned char *a, size_t root, size_t n, size_t size,
+                      int (*cmp)(const void *, const void *)) {
+    for (;;) {
+        size_t child = 2 * root + 1;
+        if (child >= n) return;
+        if (child + 1 < n && cmp(a + (child + 1) * size, a + child * size) > 0) child++;
+        if (cmp(a + root * size, a + child * size) >= 0) return;
+        swap(a + root * size, a + child * size, size);
+        root = child;
+    }
+}
+
+void sort_heap(void *base, size_t n, size_t size, int (*cmp)(const void *, const void *)) {
+    unsigned char *a = base;
+    for (size_t i = n / 2; i-- > 0;)
+        sift_down(a, i, n, size, cmp);
+    for (size_t end = n; end-- > 1;) {
+        swap(a, a + end * size, size);
+        sift_down(a, 0, end, size, cmp);
+    }
+}
@@ -0,0 +1,16 @@
+#ifndef SORT_H
+#define SORT_H
+
+#include <stddef.h>
+
+/* In-place sort for code that must not allocate: qsort() may call malloc
+ * (glibc's merges through a temporary buffer), which would re-enter the
+ * interceptor.
+ *
+ * Heapsort of n elements of size bytes into ascending cmp order (cmp
+ * returns <0, 0 or >0 as for qsort). No allocation, no recursion, not
+ * stable.
+ */
+void sort_heap(void *base, size_t n, size_t size, int (*cmp)(const void *, const void *));
+
+#endif
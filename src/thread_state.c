@@ -0,0 +1,126 @@
+#define _GNU_SOURCE
+#include "thread_state.h"
+#include "arena.h"
+#include "threads.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define THREAD_STATE_BATCH 64
+
+__thread struct thread_state *tls_state
+    __attribute__((tls_model("initial-exec"))) = NULL;
+
+/* Every block ever handed out, newest first */
+static _Atomic(struct thread_state *) registry = NULL;
+
+/* Used only for its destructor, which returns the block on thread exit */
+static pthread_key_t release_key;
+static _Atomic int release_key_ready = 0;
+
+/* Fallback when the arena is exhausted: counts still land somewhere,
+ * at the cost of sharing a line between such threads. */
+static struct thread_state overflow_state;
+
+static void thread_state_release(void *arg) {
+    struct thread_state *ts = arg;
+    tls_state = NULL;
+    if (ts && ts != &overflow_state)
+        atomic_store_explicit(&ts->in_use, 0, memory_order_release);
+}
+
+static struct thread_state *claim_free_block(void) {
+    for (struct thread_state *ts = atomic_load_explicit(&registry, memory_order_acquire);
+         ts; ts = ts->next) {
+        int expected = 0;
+        if (atomic_load_explicit(&ts->in_use, memory_order_relaxed) == 0 &&
+            atomic_compare_exchange_strong_explicit(&ts->in_use, &expected, 1,
+                                                    memory_order_acquire,
+                                                    memory_order_relaxed))
+            return ts;
+    }
+    return NULL;
+}
+
+static struct thread_state *claim_new_block(void) {
+    struct thread_state *batch = arena_alloc(sizeof(*batch) * THREAD_STATE_BATCH);
+    if (!batch) return NULL;
+
+    /* Claim the first block, chain the rest and publish them in one CAS */
+    atomic_store_explicit(&batch[0].in_use, 1, memory_order_relaxed);
+    for (size_t i = 0; i + 1 < THREAD_STATE_BATCH; ++i)
+        batch[i].next = &batch[i + 1];
+
+    struct thread_state *last = &batch[THREAD_STATE_BATCH - 1];
+    struct thread_state *head = atomic_load_explicit(&registry, memory_order_relaxed);
+    do {
+        last->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&registry, &head, batch,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+    return batch;
+}
+
+struct thread_state *thread_state_attach(void) {
+    struct thread_state *ts = claim_free_block();
+    if (!ts) ts = claim_new_block();
+    if (!ts) ts = &overflow_state;
+
+    ts->tid = (uint32_t)syscall(SYS_gettid);
+    ts->owners++;
+    ts->rng = 0; /* a new owner gets a new stream */
+    ts->ordinal = THREAD_ORDINAL_NONE; /* set by the pthread_create trampoline */
+    ts->thread_index = 0;
+    ts->sel_generation = 0;
+    ts->stack_lo = ts->stack_hi = 0;
+
+    /* Publish before pthread_setspecific, which may allocate for high keys */
+    tls_state = ts;
+    if (ts != &overflow_state && atomic_load_explicit(&release_key_ready, memory_order_acquire))
+        pthread_setspecific(release_key, ts);
+    return ts;
+}
+
+void thread_state_init(void) {
+    if (pthread_key_create(&release_key, thread_state_release) == 0) {
+        atomic_store_explicit(&release_key_ready, 1, memory_order_release);
+        /* The initializing thread attached before the key existed */
+        if (tls_state && tls_state != &overflow_state)
+            pthread_setspecific(release_key, tls_state);
+    }
+}
+
+static void add_block(struct stats_totals *out, struct thread_state *ts) {
+    for (int fn = 0; fn < FN_COUNT; ++fn) {
+        out->total[fn] += atomic_load_explicit(&ts->total[fn], memory_order_relaxed);
+        out->failed[fn] += atomic_load_explicit(&ts->failed[fn], memory_order_relaxed);
+    }
+    out->live_delta += atomic_load_explicit(&ts->live_delta, memory_order_relaxed);
+    if (!ts->sizes) return;
+    for (int fn = 0; fn < FN_COUNT; ++fn)
+        for (int b = 0; b < SIZE_BUCKETS; ++b)
+            out->sizes[fn][b] += atomic_load_explicit(&ts->sizes->count[fn][b], memory_order_relaxed);
+}
+
+void thread_state_snapshot(struct stats_totals *out) {
+    memset(out, 0, sizeof(*out));
+    for (struct thread_state *ts = atomic_load_explicit(&registry, memory_order_acquire);
+         ts; ts = ts->next)
+        add_block(out, ts);
+    add_block(out, &overflow_state);
+}
+
+struct size_hist *thread_state_sizes(struct thread_state *ts) {
+    if (!ts->sizes) ts->sizes = arena_alloc(sizeof(struct size_hist));
+    return ts->sizes;
+}
+
+void thread_state_foreach(void (*fn)(const struct thread_state *ts, void *arg), void *arg) {
+    for (struct thread_state *ts = atomic_load_explicit(&registry, memory_order_acquire);
+         ts; ts = ts->next)
+        if (ts->owners) fn(ts, arg);
+    if (overflow_state.owners) fn(&overflow_state, arg);
+}
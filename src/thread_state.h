@@ -0,0 +1,99 @@
+#ifndef THREAD_STATE_H
+#define THREAD_STATE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "alloc_fn.h"
+
+#define CACHE_LINE_SIZE 64
+
+/* Per-thread counter block.
+ * Only the owning thread writes to it, so increments are plain
+ * load/add/store without a lock prefix. Readers sum every block in the
+ * registry. Blocks are cache-line aligned so two threads never share a
+ * line, and are recycled (not freed) when their thread exits, which keeps
+ * the merged totals correct.
+ */
+struct trace_ring;
+struct latency_hist;
+struct record_buf;
+
+/* Size classes: bucket 0 holds size 0, bucket b holds [2^(b-1), 2^b) */
+#define SIZE_BUCKETS 65
+
+struct size_hist {
+    _Atomic uint64_t count[FN_COUNT][SIZE_BUCKETS];
+};
+
+struct thread_state {
+    _Atomic uint64_t total[FN_COUNT];
+    _Atomic uint64_t failed[FN_COUNT];
+    size_t fail_cursor;        /* failspec lookup hint */
+    uint32_t tid;              /* kernel thread id of the current owner */
+    uint32_t owners;           /* threads that have used this block */
+    struct trace_ring *trace;  /* MALLOC_FAIL_TRACE ring, kept across owners */
+    struct size_hist *sizes;   /* size histogram, mapped on first use */
+    struct latency_hist *latency; /* MALLOC_FAIL_LATENCY histograms, likewise */
+    struct record_buf *record; /* MALLOC_FAIL_RECORD buffer, kept across owners */
+    uintptr_t stack_lo;        /* owner's stack, for frame walks (0: unknown) */
+    uintptr_t stack_hi;
+    int internal;              /* >0 while the interceptor itself allocates */
+    _Atomic int64_t live_delta; /* MALLOC_FAIL_LIMIT bytes not yet published */
+    uint64_t rng;              /* MALLOC_FAIL_RATE stream state, 0 = unseeded */
+    uint32_t rng_stream;       /* which stream of the seed this owner draws */
+    uint32_t ordinal;          /* creation order, THREAD_ORDINAL_NONE if unknown */
+    uint64_t thread_index;     /* owner's own allocations (per-thread indexing) */
+    uint32_t sel_generation;   /* thread_sel_generation sel_match was computed at */
+    int sel_match;             /* owner is the thread MALLOC_FAIL_AT selects */
+    int64_t heap_countdown;    /* MALLOC_FAIL_HEAP_PROFILE bytes until the next sample */
+    uint64_t heap_rng;         /* its interval stream, 0 until the first allocation */
+    struct thread_state *next; /* registry link, never unlinked */
+    _Atomic int in_use;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* Merged view of all counter blocks */
+struct stats_totals {
+    uint64_t total[FN_COUNT];
+    uint64_t failed[FN_COUNT];
+    int64_t live_delta;
+    uint64_t sizes[FN_COUNT][SIZE_BUCKETS];
+};
+
+extern __thread struct thread_state *tls_state
+    __attribute__((tls_model("initial-exec")));
+
+struct thread_state *thread_state_attach(void);
+void thread_state_init(void);
+void thread_state_snapshot(struct stats_totals *out);
+struct size_hist *thread_state_sizes(struct thread_state *ts);
+
+/* Visit every block that has been used, for per-thread reports */
+void thread_state_foreach(void (*fn)(const struct thread_state *ts, void *arg), void *arg);
+
+/* Current thread's block, claimed on first use */
+static inline struct thread_state *thread_state_get(void) {
+    struct thread_state *ts = tls_state;
+    if (__builtin_expect(ts != NULL, 1)) return ts;
+    return thread_state_attach();
+}
+
+/* Single-writer increment: no read-modify-write atomic needed */
+static inline void counter_inc(_Atomic uint64_t *c) {
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+}
+
+static inline unsigned size_bucket(uint64_t size) {
+    return size ? 64 - (unsigned)__builtin_clzll(size) : 0;
+}
+
+/* Count one call of fn in the thread's size histogram */
+static inline void size_hist_inc(struct thread_state *ts, enum alloc_fn fn, uint64_t size) {
+    struct size_hist *h = ts->sizes;
+    if (__builtin_expect(h == NULL, 0) && (h = thread_state_sizes(ts)) == NULL) return;
+    counter_inc(&h->count[fn][size_bucket(size)]);
+}
+
+#endif
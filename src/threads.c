@@ -0,0 +1,128 @@
+#define _GNU_SOURCE
+#include "threads.h"
+#include "arena.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+
+_Atomic uint32_t thread_sel_generation = 1;
+
+static _Atomic uint32_t next_ordinal = 0;
+static _Atomic int numbering = 1; /* until init knows what is needed */
+
+static int (*real_pthread_create)(pthread_t *, const pthread_attr_t *,
+                                  void *(*)(void *), void *) = NULL;
+static int (*real_pthread_setname_np)(pthread_t, const char *) = NULL;
+
+const char *thread_sel_parse(struct thread_sel *sel, const char *s) {
+    memset(sel, 0, sizeof(*sel));
+    const char *colon = strrchr(s, ':');
+    if (!colon) return s;
+    size_t n = (size_t)(colon - s);
+    if (s[0] == '#') {
+        sel->kind = THREAD_SEL_ORDINAL;
+        sel->ordinal = (uint32_t)strtoul(s + 1, NULL, 10);
+    } else {
+        sel->kind = THREAD_SEL_NAME;
+        if (n >= THREAD_NAME_MAX) n = THREAD_NAME_MAX - 1; /* the kernel truncates too */
+        memcpy(sel->name, s, n);
+    }
+    return colon + 1;
+}
+
+int thread_sel_refresh(const struct thread_sel *sel, struct thread_state *ts) {
+    uint32_t gen = atomic_load_explicit(&thread_sel_generation, memory_order_relaxed);
+    int match = 0;
+    if (sel->kind == THREAD_SEL_ORDINAL) {
+        match = ts->ordinal == sel->ordinal;
+    } else if (sel->kind == THREAD_SEL_NAME) {
+        char name[THREAD_NAME_MAX] = "";
+        prctl(PR_GET_NAME, name, 0, 0, 0);
+        match = strcmp(name, sel->name) == 0;
+    }
+    ts->sel_match = match;
+    ts->sel_generation = gen;
+    return match;
+}
+
+/* pthread_create passes the ordinal to the new thread through one of
+ * these; records are recycled, never freed */
+struct start_record {
+    void *(*start)(void *);
+    void *arg;
+    uint32_t ordinal;
+    struct start_record *next;
+};
+
+static atomic_flag records_lock = ATOMIC_FLAG_INIT;
+static struct start_record *free_records = NULL;
+
+static struct start_record *record_get(void) {
+    while (atomic_flag_test_and_set_explicit(&records_lock, memory_order_acquire))
+        ;
+    struct start_record *r = free_records;
+    if (r) free_records = r->next;
+    atomic_flag_clear_explicit(&records_lock, memory_order_release);
+    return r ? r : arena_alloc(sizeof(*r));
+}
+
+static void record_put(struct start_record *r) {
+    while (atomic_flag_test_and_set_explicit(&records_lock, memory_order_acquire))
+        ;
+    r->next = free_records;
+    free_records = r;
+    atomic_flag_clear_explicit(&records_lock, memory_order_release);
+}
+
+static void *thread_start(void *p) {
+    struct start_record *r = p;
+    void *(*start)(void *) = r->start;
+    void *arg = r->arg;
+    struct thread_state *ts = thread_state_get();
+    ts->ordinal = r->ordinal;
+    ts->sel_generation = 0;
+    record_put(r);
+    return start(arg);
+}
+
+static int resolve(void) {
+    if (!real_pthread_create) real_pthread_create = dlsym(RTLD_NEXT, "pthread_create");
+    if (!real_pthread_setname_np) real_pthread_setname_np = dlsym(RTLD_NEXT, "pthread_setname_np");
+    return real_pthread_create && real_pthread_setname_np ? 0 : -1;
+}
+
+void thread_numbering(int on) {
+    atomic_store_explicit(&numbering, on, memory_order_relaxed);
+}
+
+int thread_create_internal(pthread_t *thread, void *(*start)(void *), const char *name) {
+    if (resolve() != 0 || real_pthread_create(thread, NULL, start, NULL) != 0) return -1;
+    real_pthread_setname_np(*thread, name);
+    return 0;
+}
+
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                   void *(*start)(void *), void *arg) {
+    if (resolve() != 0) return EAGAIN;
+    if (!atomic_load_explicit(&numbering, memory_order_relaxed))
+        return real_pthread_create(thread, attr, start, arg);
+    struct start_record *r = record_get();
+    if (!r) return real_pthread_create(thread, attr, start, arg);
+    r->start = start;
+    r->arg = arg;
+    r->ordinal = atomic_fetch_add_explicit(&next_ordinal, 1, memory_order_relaxed) + 1;
+    int rc = real_pthread_create(thread, attr, thread_start, r);
+    if (rc != 0) record_put(r);
+    return rc;
+}
+
+int pthread_setname_np(pthread_t thread, const char *name) {
+    if (resolve() != 0) return ENOSYS;
+    int rc = real_pthread_setname_np(thread, name);
+    if (rc == 0) thread_sel_invalidate();
+    return rc;
+}
@@ -0,0 +1,65 @@
+#ifndef THREADS_H
+#define THREADS_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "thread_state.h"
+
+/* Per-thread indexing (MALLOC_FAIL_AT="<thread>:<spec>").
+ *
+ * The global index depends on how threads interleave, so the same spec
+ * hits a different allocation on every run of a multithreaded program.
+ * Counting each thread's own allocations instead is reproducible as long
+ * as the thread itself is deterministic.
+ *
+ * A thread is selected by creation ordinal ("#3": the third thread
+ * started with pthread_create, the main thread is "#0") or by the name
+ * given to pthread_setname_np ("worker-3"). Both calls are interposed:
+ * pthread_create numbers threads in the order they are created, and
+ * pthread_setname_np invalidates the cached match of every thread.
+ */
+
+#define THREAD_ORDINAL_NONE UINT32_MAX  /* not started through pthread_create */
+#define THREAD_NAME_MAX 16              /* kernel comm length, with the NUL */
+
+struct thread_sel {
+    enum { THREAD_SEL_NONE, THREAD_SEL_ORDINAL, THREAD_SEL_NAME } kind;
+    uint32_t ordinal;
+    char name[THREAD_NAME_MAX];
+};
+
+/* Split "worker-3:10-20" or "#2:5" at the last ':'. Fills sel and returns
+ * the spec after the selector; returns s unchanged (kind NONE) if there is
+ * no selector. */
+const char *thread_sel_parse(struct thread_sel *sel, const char *s);
+
+/* Whether pthread_create numbers new threads. Off, it calls straight
+ * through and new threads get no ordinal. */
+void thread_numbering(int on);
+
+/* Start one of the interceptor's own threads: it gets no ordinal, so
+ * program threads are numbered the same whichever features are on */
+int thread_create_internal(pthread_t *thread, void *(*start)(void *), const char *name);
+
+/* Bumped by every rename and policy change; cached matches compare it */
+extern _Atomic uint32_t thread_sel_generation;
+
+/* Recompute ts's match against sel (slow path of thread_sel_match) */
+int thread_sel_refresh(const struct thread_sel *sel, struct thread_state *ts);
+
+/* Is the calling thread (owner of ts) the one sel names? */
+static inline int thread_sel_match(const struct thread_sel *sel, struct thread_state *ts) {
+    if (__builtin_expect(ts->sel_generation ==
+                         atomic_load_explicit(&thread_sel_generation, memory_order_relaxed), 1))
+        return ts->sel_match;
+    return thread_sel_refresh(sel, ts);
+}
+
+/* Forget every cached match, e.g. after a new policy was installed */
+static inline void thread_sel_invalidate(void) {
+    atomic_fetch_add_explicit(&thread_sel_generation, 1, memory_order_relaxed);
+}
+
+#endif
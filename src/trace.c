@@ -0,0 +1,177 @@
+#define _GNU_SOURCE
+#include "trace.h"
+#include "arena.h"
+#include "diag.h"
+#include "threads.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE_RING_RECORDS 65536 /* power of two */
+#define TRACE_FLUSH_INTERVAL_NS 2000000L
+
+/* Single-producer (owning thread) / single-consumer (flusher) ring.
+ * head and tail live on separate lines so the producer never shares a
+ * line with the flusher's stores. */
+struct trace_ring {
+    _Atomic uint64_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+    _Atomic uint64_t dropped;
+    _Atomic uint64_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+    struct trace_ring *next;
+    struct trace_record records[TRACE_RING_RECORDS] __attribute__((aligned(CACHE_LINE_SIZE)));
+};
+
+static int trace_fd = -1;
+static _Atomic int trace_live = 0;     /* records are accepted */
+static _Atomic int flusher_run = 0;
+static int flusher_started = 0;
+static pthread_t flusher;
+static uint64_t records_written = 0;   /* flusher-owned */
+
+static _Atomic(struct trace_ring *) rings = NULL;
+
+/* Copy out everything between tail and head. Only one thread drains at a
+ * time: the flusher while it runs, then trace_finish after joining it. */
+static void drain_all(void) {
+    for (struct trace_ring *r = atomic_load_explicit(&rings, memory_order_acquire);
+         r; r = r->next) {
+        uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        while (tail < head) {
+            uint64_t pos = tail & (TRACE_RING_RECORDS - 1);
+            uint64_t n = head - tail;
+            if (n > TRACE_RING_RECORDS - pos) n = TRACE_RING_RECORDS - pos;
+            diag_write(trace_fd, &r->records[pos], n * sizeof(struct trace_record));
+            records_written += n;
+            tail += n;
+        }
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+    }
+}
+
+static void *flusher_main(void *arg) {
+    (void)arg;
+    /* Leave every signal to the application's own threads */
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    struct timespec interval = { 0, TRACE_FLUSH_INTERVAL_NS };
+    while (atomic_load_explicit(&flusher_run, memory_order_relaxed)) {
+        drain_all();
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+/* The flusher does not survive fork() and the child would interleave its
+ * records with the parent's, so children simply stop tracing. */
+static void trace_atfork_child(void) {
+    atomic_store_explicit(&trace_live, 0, memory_order_relaxed);
+    atomic_store_explicit(&flusher_run, 0, memory_order_relaxed);
+    flusher_started = 0;
+    if (trace_fd >= 0) close(trace_fd);
+    trace_fd = -1;
+}
+
+int trace_open(const char *path, int64_t offset) {
+    trace_fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace_fd < 0) return -1;
+
+    struct trace_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    hdr.version = TRACE_VERSION;
+    hdr.record_size = sizeof(struct trace_record);
+    hdr.offset = offset;
+    diag_write(trace_fd, &hdr, sizeof(hdr));
+
+    pthread_atfork(NULL, NULL, trace_atfork_child);
+    atomic_store(&flusher_run, 1);
+    if (thread_create_internal(&flusher, flusher_main, "malloc-trace") == 0)
+        flusher_started = 1;
+    /* Without a flusher records are still written, just only at exit */
+    atomic_store(&trace_live, 1);
+    return 0;
+}
+
+static struct trace_ring *ring_attach(struct thread_state *ts) {
+    struct trace_ring *r = arena_map(sizeof(*r));
+    if (!r) return NULL;
+    struct trace_ring *head = atomic_load_explicit(&rings, memory_order_relaxed);
+    do {
+        r->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&rings, &head, r,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+    ts->trace = r;
+    return r;
+}
+
+void trace_emit(struct thread_state *ts, enum alloc_fn fn, uint64_t abs_index,
+                uint64_t visible_index, uint64_t size, int decision) {
+    if (!atomic_load_explicit(&trace_live, memory_order_relaxed)) return;
+    struct trace_ring *r = ts->trace;
+    if (!r && !(r = ring_attach(ts))) return;
+
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&r->tail, memory_order_acquire) >= TRACE_RING_RECORDS) {
+        counter_inc(&r->dropped);
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    struct trace_record *rec = &r->records[head & (TRACE_RING_RECORDS - 1)];
+    rec->timestamp_ns = (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+    rec->abs_index = abs_index;
+    rec->visible_index = visible_index;
+    rec->size = size;
+    rec->tid = ts->tid;
+    rec->fn = (uint16_t)fn;
+    rec->decision = (uint8_t)decision;
+    rec->reserved = 0;
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+void trace_finish(void) {
+    if (trace_fd < 0) return;
+    atomic_store(&trace_live, 0);
+    if (flusher_started) {
+        atomic_store(&flusher_run, 0);
+        pthread_join(flusher, NULL);
+        flusher_started = 0;
+    }
+    drain_all();
+
+    uint64_t dropped = 0;
+    for (struct trace_ring *r = atomic_load(&rings); r; r = r->next)
+        dropped += atomic_load_explicit(&r->dropped, memory_order_relaxed);
+
+    struct trace_header hdr;
+    int hdr_ok = 0;
+    if (pread(trace_fd, &hdr, sizeof(hdr), 0) == (ssize_t)sizeof(hdr)) {
+        hdr.records = records_written;
+        hdr.dropped = dropped;
+        hdr_ok = pwrite(trace_fd, &hdr, sizeof(hdr), 0) == (ssize_t)sizeof(hdr);
+    }
+    if (!hdr_ok) {
+        const char *msg = "interceptor: warning: trace: could not update the file header\n";
+        diag_write(2, msg, strlen(msg));
+    }
+    close(trace_fd);
+    trace_fd = -1;
+
+    if (dropped > 0) {
+        char buf[128];
+        int len = snprintf(buf, sizeof(buf),
+                           "interceptor: trace: %" PRIu64 " records dropped (ring full)\n", dropped);
+        if (len > 0) diag_write(2, buf, (size_t)len);
+    }
+}
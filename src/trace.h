@@ -0,0 +1,51 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#include "thread_state.h"
+
+/* Binary decision trace (MALLOC_FAIL_TRACE=<file>).
+ *
+ * Each thread appends fixed-size records to its own single-producer ring;
+ * a background thread drains all rings into the file. Nothing on the
+ * allocation path formats text or makes a syscall, and a full ring drops
+ * the record (counted) instead of blocking. tools/trace_decode.c turns the
+ * file back into the MALLOC_FAIL_DEBUG text format.
+ */
+
+#define TRACE_MAGIC "MFTRACE"
+#define TRACE_VERSION 1
+
+/* File layout: one header followed by records in per-thread order */
+struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    int64_t offset;       /* MALLOC_FAIL_OFFSET in effect */
+    uint64_t records;     /* filled in at exit */
+    uint64_t dropped;     /* filled in at exit */
+};
+
+struct trace_record {
+    uint64_t timestamp_ns; /* CLOCK_MONOTONIC */
+    uint64_t abs_index;
+    uint64_t visible_index;
+    uint64_t size;
+    uint32_t tid;
+    uint16_t fn;           /* enum alloc_fn */
+    uint8_t decision;
+    uint8_t reserved;
+};
+
+/* Open the file and start the flusher. Returns 0 on success. */
+int trace_open(const char *path, int64_t offset);
+
+/* Queue one record for the calling thread */
+void trace_emit(struct thread_state *ts, enum alloc_fn fn, uint64_t abs_index,
+                uint64_t visible_index, uint64_t size, int decision);
+
+/* Stop the flusher, drain every ring and finalize the header */
+void trace_finish(void);
+
+#endif
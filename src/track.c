@@ -0,0 +1,211 @@
+#define _GNU_SOURCE
+#include "track.h"
+#include "arena.h"
+#include "diag.h"
+#include "sites.h"
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define TRACK_SHARDS 256           /* power of two */
+#define TRACK_SHARD_INITIAL 1024   /* slots, power of two */
+#define TRACK_AGG_SIZE 4096        /* report: distinct callers, power of two */
+
+/* One independently locked open-addressed table, padded so neighbouring
+ * shards never share a cache line */
+struct shard {
+    atomic_flag lock;
+    struct track_entry *slots;
+    size_t mask;                   /* capacity - 1, or 0 before first use */
+    size_t used;
+} __attribute__((aligned(64)));
+
+static struct shard shards[TRACK_SHARDS] = {
+    [0 ... TRACK_SHARDS - 1] = { .lock = ATOMIC_FLAG_INIT }
+};
+
+static inline uint64_t hash_ptr(uintptr_t ptr) {
+    return (uint64_t)(ptr >> 4) * 0x9e3779b97f4a7c15ULL;
+}
+
+static inline struct shard *shard_of(uint64_t h) {
+    return &shards[h >> 56 & (TRACK_SHARDS - 1)];
+}
+
+static inline void shard_lock(struct shard *s) {
+    while (atomic_flag_test_and_set_explicit(&s->lock, memory_order_acquire))
+        ;
+}
+
+static inline void shard_unlock(struct shard *s) {
+    atomic_flag_clear_explicit(&s->lock, memory_order_release);
+}
+
+/* Double the table (or create it). Called with the shard locked. */
+static int shard_grow(struct shard *s) {
+    size_t cap = s->mask ? (s->mask + 1) * 2 : TRACK_SHARD_INITIAL;
+    struct track_entry *slots = arena_map(cap * sizeof(*slots));
+    if (!slots) return -1;
+    for (size_t i = 0; s->mask && i <= s->mask; ++i) {
+        if (!s->slots[i].ptr) continue;
+        size_t j = hash_ptr(s->slots[i].ptr) & (cap - 1);
+        while (slots[j].ptr) j = (j + 1) & (cap - 1);
+        slots[j] = s->slots[i];
+    }
+    if (s->mask) arena_unmap(s->slots, (s->mask + 1) * sizeof(*slots));
+    s->slots = slots;
+    s->mask = cap - 1;
+    return 0;
+}
+
+int track_insert(uintptr_t ptr, uint64_t size, uintptr_t caller, uint64_t index) {
+    uint64_t h = hash_ptr(ptr);
+    struct shard *s = shard_of(h);
+    shard_lock(s);
+    /* Keep the load factor under 3/4 */
+    if ((s->used + 1) * 4 > (s->mask + 1) * 3 && shard_grow(s) != 0) {
+        shard_unlock(s);
+        return -1;
+    }
+    size_t i = h & s->mask;
+    while (s->slots[i].ptr && s->slots[i].ptr != ptr) i = (i + 1) & s->mask;
+    if (!s->slots[i].ptr) s->used++;
+    s->slots[i] = (struct track_entry){ ptr, size, caller, index };
+    shard_unlock(s);
+    return 0;
+}
+
+int track_remove(uintptr_t ptr, struct track_entry *out) {
+    uint64_t h = hash_ptr(ptr);
+    struct shard *s = shard_of(h);
+    shard_lock(s);
+    if (!s->mask) {
+        shard_unlock(s);
+        return -1;
+    }
+    size_t i = h & s->mask;
+    while (s->slots[i].ptr && s->slots[i].ptr != ptr) i = (i + 1) & s->mask;
+    if (!s->slots[i].ptr) {
+        shard_unlock(s);
+        return -1;
+    }
+    if (out) *out = s->slots[i];
+
+    /* Backward-shift deletion: later entries of the probe run move up so
+     * lookups never need tombstones */
+    size_t hole = i;
+    for (size_t j = (i + 1) & s->mask; s->slots[j].ptr; j = (j + 1) & s->mask) {
+        size_t home = hash_ptr(s->slots[j].ptr) & s->mask;
+        /* j may fill the hole unless its home lies cyclically in (hole, j] */
+        if (((j - home) & s->mask) >= ((j - hole) & s->mask)) {
+            s->slots[hole] = s->slots[j];
+            hole = j;
+        }
+    }
+    s->slots[hole].ptr = 0;
+    s->used--;
+    shard_unlock(s);
+    return 0;
+}
+
+/* Outstanding blocks grouped by allocating caller */
+struct track_agg {
+    uintptr_t caller;
+    uint64_t blocks;
+    uint64_t bytes;
+    uint64_t before;       /* blocks allocated before the first failure */
+    uint64_t first_index;
+};
+
+void track_report(int fd, uint64_t first_failure, unsigned top) {
+    struct track_agg *agg = arena_map(TRACK_AGG_SIZE * sizeof(*agg));
+    uint64_t blocks = 0, bytes = 0, before_blocks = 0, before_bytes = 0, other = 0;
+
+    for (unsigned n = 0; n < TRACK_SHARDS; ++n) {
+        struct shard *s = &shards[n];
+        shard_lock(s);
+        for (size_t i = 0; s->mask && i <= s->mask; ++i) {
+            const struct track_entry *e = &s->slots[i];
+            if (!e->ptr) continue;
+            int before = first_failure && e->index && e->index < first_failure;
+            blocks++;
+            bytes += e->size;
+            if (before) {
+                before_blocks++;
+                before_bytes += e->size;
+            }
+            if (!agg) continue;
+            size_t j = (size_t)hash_ptr(e->caller) & (TRACK_AGG_SIZE - 1);
+            size_t probes = 0;
+            while (agg[j].caller && agg[j].caller != e->caller && ++probes < TRACK_AGG_SIZE)
+                j = (j + 1) & (TRACK_AGG_SIZE - 1);
+            if (probes == TRACK_AGG_SIZE) {
+                other++;
+                continue;
+            }
+            if (!agg[j].caller || e->index < agg[j].first_index) agg[j].first_index = e->index;
+            agg[j].caller = e->caller;
+            agg[j].blocks++;
+            agg[j].bytes += e->size;
+            agg[j].before += (uint64_t)before;
+        }
+        shard_unlock(s);
+    }
+
+    char buf[512];
+    int len = snprintf(buf, sizeof(buf), "--- live allocations: %" PRIu64 " blocks, %" PRIu64
+                       " bytes outstanding ---\n", blocks, bytes);
+    if (len > 0) diag_write(fd, buf, (size_t)len);
+    if (first_failure) {
+        len = snprintf(buf, sizeof(buf),
+                       "before first failure (#%" PRIu64 "): %" PRIu64 " blocks, %" PRIu64 " bytes\n"
+                       "from then on:%*s%" PRIu64 " blocks, %" PRIu64 " bytes\n",
+                       first_failure, before_blocks, before_bytes, 12, "",
+                       blocks - before_blocks, bytes - before_bytes);
+        if (len > 0) diag_write(fd, buf, (size_t)len);
+    }
+    if (!agg) return;
+
+    /* Selection of the callers holding the most bytes */
+    struct track_agg *best[64];
+    if (top > 64) top = 64;
+    unsigned found = 0;
+    for (size_t i = 0; i < TRACK_AGG_SIZE; ++i) {
+        if (!agg[i].caller) continue;
+        unsigned pos = found < top ? found++ : top;
+        while (pos > 0 && best[pos - 1]->bytes < agg[i].bytes) {
+            if (pos < top) best[pos] = best[pos - 1];
+            pos--;
+        }
+        if (pos < top) best[pos] = &agg[i];
+    }
+    for (unsigned i = 0; i < found; ++i) {
+        char where[256], first[24] = "-";
+        sites_describe(where, sizeof(where), best[i]->caller);
+        if (best[i]->first_index) snprintf(first, sizeof(first), "#%" PRIu64, best[i]->first_index);
+        len = snprintf(buf, sizeof(buf), "%10" PRIu64 " bytes %8" PRIu64 " blocks",
+                       best[i]->bytes, best[i]->blocks);
+        if (len > 0) diag_write(fd, buf, (size_t)len);
+        if (first_failure) {
+            len = snprintf(buf, sizeof(buf), " (%" PRIu64 " before failure)", best[i]->before);
+            if (len > 0) diag_write(fd, buf, (size_t)len);
+        }
+        len = snprintf(buf, sizeof(buf), "  first %-9s %s\n", first, where);
+        if (len > 0) diag_write(fd, buf, (size_t)len);
+    }
+    if (other) {
+        len = snprintf(buf, sizeof(buf), "(%" PRIu64 " blocks from further callers not grouped)\n", other);
+        if (len > 0) diag_write(fd, buf, (size_t)len);
+    }
+    arena_unmap(agg, TRACK_AGG_SIZE * sizeof(*agg));
+}
+
+void track_fork_prepare(void) {
+    for (unsigned n = 0; n < TRACK_SHARDS; ++n) shard_lock(&shards[n]);
+}
+
+void track_fork_release(void) {
+    for (unsigned n = TRACK_SHARDS; n-- > 0;) shard_unlock(&shards[n]);
+}
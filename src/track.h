@@ -0,0 +1,39 @@
+#ifndef TRACK_H
+#define TRACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Live allocation tracking (MALLOC_FAIL_TRACK).
+ *
+ * Every block handed out after init is recorded as ptr -> {size, caller,
+ * index} in a hash table split into independently locked shards, so
+ * threads only contend when their pointers hash to the same shard. Shards
+ * are open-addressed, grow by doubling and live in arena mappings; nothing
+ * here calls malloc. At exit the blocks still outstanding are reported,
+ * split around the first injected failure.
+ */
+
+struct track_entry {
+    uintptr_t ptr;      /* 0 = empty slot */
+    uint64_t size;      /* requested size */
+    uintptr_t caller;   /* return address of the allocating call */
+    uint64_t index;     /* visible index, 0 if none was assigned */
+};
+
+/* Record a block. Returns 0 on success, -1 if a shard could not grow. */
+int track_insert(uintptr_t ptr, uint64_t size, uintptr_t caller, uint64_t index);
+
+/* Forget a block; its record is copied to *out if out is non-NULL.
+ * Returns 0 if the block was tracked. */
+int track_remove(uintptr_t ptr, struct track_entry *out);
+
+/* Append the outstanding blocks to the statistics report. first_failure
+ * is the visible index of the first injected failure, 0 if none. */
+void track_report(int fd, uint64_t first_failure, unsigned top);
+
+/* pthread_atfork handlers: no shard lock is held across fork() */
+void track_fork_prepare(void);
+void track_fork_release(void);
+
+#endif
@@ -0,0 +1,163 @@
+#define _GNU_SOURCE
+#include "tree.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+uint32_t tree_self = TREE_NONE;
+int32_t tree_pid = 0;
+_Atomic uint64_t *tree_counter = NULL;
+
+static struct tree_segment *segment = NULL;
+static char segment_path[64];
+/* Counters inherited across fork(), subtracted from this process's own */
+static uint64_t base_total[FN_COUNT];
+static uint64_t base_failed[FN_COUNT];
+
+const char *tree_sel_parse(struct tree_sel *sel, const char *s) {
+    memset(sel, 0, sizeof(*sel));
+    if (s[0] != '@') return s;
+    const char *num = s + 1, *end = NULL;
+    if (*num == '*') {
+        sel->kind = TREE_SEL_ALL;
+        end = num + 1;
+    } else {
+        sel->kind = TREE_SEL_PID;
+        if (*num == '#') {
+            sel->kind = TREE_SEL_ORDINAL;
+            ++num;
+        }
+        char *stop;
+        unsigned long v = strtoul(num, &stop, 10);
+        /* Digits only: strtoul would also take a sign or blanks */
+        if (*num >= '0' && *num <= '9' && v <= UINT32_MAX) end = stop;
+        sel->value = (uint32_t)v;
+    }
+    if (!end || *end != ':') {
+        memset(sel, 0, sizeof(*sel));
+        return NULL;
+    }
+    return end + 1;
+}
+
+/* Slot of a running process, or TREE_NONE */
+static uint32_t find_running(int32_t pid) {
+    uint32_t n = atomic_load_explicit(&segment->procs, memory_order_acquire);
+    if (n > TREE_MAX_PROCS) n = TREE_MAX_PROCS;
+    for (uint32_t i = 0; i < n; ++i) {
+        const struct tree_proc *p = &segment->proc[i];
+        if (atomic_load_explicit(&p->state, memory_order_acquire) == TREE_RUNNING && p->pid == pid)
+            return i;
+    }
+    return TREE_NONE;
+}
+
+/* Take the next ordinal and, while they last, its slot */
+static void claim(uint32_t parent) {
+    tree_pid = (int32_t)getpid();
+    tree_self = atomic_fetch_add(&segment->procs, 1);
+    if (tree_self >= TREE_MAX_PROCS) return;
+    struct tree_proc *p = &segment->proc[tree_self];
+    p->pid = tree_pid;
+    p->parent = parent;
+    atomic_store_explicit(&p->state, TREE_RUNNING, memory_order_release);
+}
+
+static int create(void) {
+    snprintf(segment_path, sizeof(segment_path), TREE_PATH_FMT, (int)getpid());
+    int fd = open(segment_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    if (ftruncate(fd, sizeof(struct tree_segment)) != 0) {
+        close(fd);
+        unlink(segment_path);
+        return -1;
+    }
+    void *map = mmap(NULL, sizeof(struct tree_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        unlink(segment_path);
+        return -1;
+    }
+    segment = map;
+    memcpy(segment->magic, TREE_MAGIC, sizeof(TREE_MAGIC));
+    segment->version = TREE_VERSION;
+    segment->size = sizeof(struct tree_segment);
+    segment->root_pid = (int32_t)getpid();
+    atomic_store(&segment->next_index, 1);
+    tree_counter = &segment->next_index;
+    claim(TREE_NONE);
+    /* Inherited by everything this process starts */
+    return setenv(TREE_ENV, segment_path, 1);
+}
+
+static int join(const char *path) {
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) return -1;
+    void *map = mmap(NULL, sizeof(struct tree_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    struct tree_segment *seg = map;
+    if (memcmp(seg->magic, TREE_MAGIC, sizeof(TREE_MAGIC)) != 0 || seg->version != TREE_VERSION ||
+        seg->size != sizeof(struct tree_segment)) {
+        munmap(map, sizeof(struct tree_segment));
+        return -1;
+    }
+    segment = seg;
+    tree_counter = &segment->next_index;
+    snprintf(segment_path, sizeof(segment_path), "%s", path);
+
+    /* After fork+exec the slot claimed at the fork is still ours */
+    uint32_t self = find_running((int32_t)getpid());
+    if (self != TREE_NONE) {
+        tree_self = self;
+        tree_pid = (int32_t)getpid();
+        return 0;
+    }
+    claim(find_running((int32_t)getppid()));
+    return 0;
+}
+
+int tree_open(void) {
+    const char *path = getenv(TREE_ENV);
+    /* A tree whose root has exited is gone: start a new one */
+    if (path && *path && join(path) == 0) return 0;
+    return create();
+}
+
+void tree_fork_child(const struct stats_totals *totals) {
+    if (!segment) return;
+    memcpy(base_total, totals->total, sizeof(base_total));
+    memcpy(base_failed, totals->failed, sizeof(base_failed));
+    claim(tree_self);
+}
+
+void tree_finish(const struct stats_totals *totals) {
+    if (!segment) return;
+    if (tree_self < TREE_MAX_PROCS) {
+        struct tree_proc *p = &segment->proc[tree_self];
+        for (int fn = 0; fn < FN_COUNT; ++fn) {
+            p->total[fn] = totals->total[fn] - base_total[fn];
+            p->failed[fn] = totals->failed[fn] - base_failed[fn];
+        }
+        atomic_store_explicit(&p->state, TREE_EXITED, memory_order_release);
+    }
+    /* Later execs start a tree of their own */
+    if (tree_is_root()) unlink(segment_path);
+}
+
+int tree_is_root(void) {
+    return segment && segment->root_pid == tree_pid;
+}
+
+void tree_foreach(void (*fn)(uint32_t ordinal, const struct tree_proc *proc, void *arg), void *arg) {
+    if (!segment) return;
+    uint32_t n = atomic_load_explicit(&segment->procs, memory_order_acquire);
+    if (n > TREE_MAX_PROCS) n = TREE_MAX_PROCS;
+    for (uint32_t i = 0; i < n; ++i)
+        if (atomic_load_explicit(&segment->proc[i].state, memory_order_acquire))
+            fn(i, &segment->proc[i], arg);
+}
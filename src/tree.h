@@ -0,0 +1,105 @@
+#ifndef TREE_H
+#define TREE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "thread_state.h"
+
+/* Process-tree counting (MALLOC_FAIL_TREE=1, MALLOC_FAIL_AT="@<proc>:<spec>").
+ *
+ * The first process creates /dev/shm/malloc_fail_tree.<pid> and names it
+ * in MALLOC_FAIL_TREE_SEGMENT, so every process it forks or execs joins
+ * the same block. Each process gets an ordinal in the order it joined
+ * (the root is #0; an exec keeps the ordinal of the process it replaces)
+ * and a slot of its own, on its own cache lines, where its counters are
+ * written at exit for the root's report.
+ *
+ * In the tree each process numbers its allocations from 1, also after a
+ * fork, so "@#2:500" is the 500th allocation of process #2 and
+ * "@4242:500" that of pid 4242. These only touch process-local counters.
+ * "@*:N" is the Nth allocation of the whole tree: that one needs a shared
+ * counter, alone on its cache line and only incremented while an "@*"
+ * spec is in effect. An exec restarts the numbering, as for any new
+ * program, but keeps the ordinal.
+ */
+
+#define TREE_MAGIC "MFTREE"
+#define TREE_VERSION 1
+#define TREE_MAX_PROCS 1024          /* slots; later processes still get ordinals */
+#define TREE_PATH_FMT "/dev/shm/malloc_fail_tree.%d"
+#define TREE_ENV "MALLOC_FAIL_TREE_SEGMENT"
+#define TREE_NONE UINT32_MAX         /* no ordinal, or no parent */
+
+enum tree_state {
+    TREE_RUNNING = 1,
+    TREE_EXITED = 2,                 /* counters are final */
+};
+
+/* One process. Only its owner writes it. */
+struct tree_proc {
+    _Atomic uint32_t state;          /* 0 = not claimed yet */
+    int32_t pid;
+    uint32_t parent;                 /* ordinal, TREE_NONE for the root */
+    uint32_t reserved;
+    uint64_t total[FN_COUNT];
+    uint64_t failed[FN_COUNT];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct tree_segment {
+    char magic[8];
+    uint32_t version;
+    uint32_t size;                   /* sizeof(struct tree_segment) */
+    int32_t root_pid;
+    _Atomic uint32_t procs;          /* ordinals handed out */
+    _Atomic uint64_t next_index __attribute__((aligned(CACHE_LINE_SIZE)));
+    struct tree_proc proc[TREE_MAX_PROCS];
+};
+
+/* "@#2:", "@4242:" or "@*:" in front of a MALLOC_FAIL_AT spec */
+struct tree_sel {
+    enum { TREE_SEL_NONE, TREE_SEL_ORDINAL, TREE_SEL_PID, TREE_SEL_ALL } kind;
+    uint32_t value;
+};
+
+/* This process's ordinal and pid, TREE_NONE/0 outside a tree */
+extern uint32_t tree_self;
+extern int32_t tree_pid;
+/* The segment's next_index, NULL outside a tree */
+extern _Atomic uint64_t *tree_counter;
+
+/* Split "@#2:500" after the selector. Fills sel and returns the spec;
+ * returns s unchanged (kind NONE) if it does not start with '@', and
+ * NULL if the selector is malformed. */
+const char *tree_sel_parse(struct tree_sel *sel, const char *s);
+
+/* Create the segment, or join the one named in the environment. Returns
+ * 0 on success. */
+int tree_open(void);
+
+/* Does sel name the calling process? */
+static inline int tree_sel_match(const struct tree_sel *sel) {
+    if (sel->kind == TREE_SEL_ORDINAL) return tree_self == sel->value;
+    return sel->kind == TREE_SEL_PID && (uint32_t)tree_pid == sel->value;
+}
+
+/* Next tree-wide index, 0 outside a tree */
+static inline uint64_t tree_next_index(void) {
+    if (!tree_counter) return 0;
+    return atomic_fetch_add_explicit(tree_counter, 1, memory_order_relaxed);
+}
+
+/* In a forked child: take a new ordinal and slot and count from zero.
+ * totals are the counters the child inherited. */
+void tree_fork_child(const struct stats_totals *totals);
+
+/* Write this process's final counters to its slot */
+void tree_finish(const struct stats_totals *totals);
+
+/* Whether this process created the segment (and so reports on it) */
+int tree_is_root(void);
+
+/* Visit every claimed slot, in ordinal order */
+void tree_foreach(void (*fn)(uint32_t ordinal, const struct tree_proc *proc, void *arg), void *arg);
+
+#endif
@@ -6,6 +6,8 @@
 #include <errno.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <signal.h>
+#include <sys/wait.h>
 
 /* Forward declarations for alignment functions */
 int posix_memalign(void **memptr, size_t alignment, size_t size);
@@ -131,12 +133,20 @@ void test_errno_on_fail(void) {
 /* Thread-safe test */
 static void *thread_malloc_test(void *arg) {
     int thread_id = (intptr_t)arg;
+    char name[16];
+    snprintf(name, sizeof(name), "worker-%d", thread_id);
+    pthread_setname_np(pthread_self(), name);
+
+    int failed = 0, first = 0;
     for (int i = 0; i < 100; i++) {
         void *p = malloc(100 + (thread_id * 10) + i);
         if (p) {
             free(p);
+        } else if (failed++ == 0) {
+            first = i + 1;
         }
     }
+    if (failed) fprintf(stderr, "%s: %d of 100 allocations failed, first #%d\n", name, failed, first);
     return NULL;
 }
 
@@ -144,17 +154,75 @@ void test_thread_safety(void) {
     fprintf(stderr, "\n=== Test: thread safety ===\n");
 
     pthread_t threads[4];
+    int created[4];
     for (int i = 0; i < 4; i++) {
         int ret = pthread_create(&threads[i], NULL, thread_malloc_test, (void *)(intptr_t)i);
+        created[i] = (ret == 0);
         ASSERT_TRUE(ret == 0, "pthread_create should succeed");
     }
 
     for (int i = 0; i < 4; i++) {
-        pthread_join(threads[i], NULL);
+        if (created[i]) pthread_join(threads[i], NULL);
+    }
+}
+
+/* Pre-fork worker pool: run with "fork" and MALLOC_FAIL_AT="@#2:5" */
+static void test_fork_workers(void) {
+    fprintf(stderr, "\n=== Test: forked workers ===\n");
+
+    for (int w = 1; w <= 3; w++) {
+        pid_t pid = fork();
+        ASSERT_TRUE(pid >= 0, "fork should succeed");
+        if (pid != 0) {
+            waitpid(pid, NULL, 0); /* one at a time, so the output is ordered */
+            continue;
+        }
+        int failed = 0, first = 0;
+        for (int i = 0; i < 20; i++) {
+            void *p = malloc(64 + i);
+            if (p) {
+                free(p);
+            } else if (failed++ == 0) {
+                first = i + 1;
+            }
+        }
+        fprintf(stderr, "process %d: %d of 20 allocations failed, first #%d\n", w, failed, first);
+        exit(0);
     }
 }
 
-int main(void) {
+/* Provided by the interceptor, NULL without it */
+unsigned long malloc_fail_control_generation(void) __attribute__((weak));
+
+/* Policy reload halfway through: run with "reload" and MALLOC_FAIL_CONTROL */
+static void test_reload(void) {
+    fprintf(stderr, "\n=== Test: reload ===\n");
+
+    for (int i = 1; i <= 20; i++) {
+        if (i == 11 && malloc_fail_control_generation) {
+            unsigned long before = malloc_fail_control_generation();
+            ASSERT_TRUE(raise(SIGUSR2) == 0, "raise should succeed");
+            /* The swap happens on a background thread: wait up to 10 s */
+            for (int tries = 0; tries < 10000 && malloc_fail_control_generation() == before; tries++)
+                usleep(1000);
+            ASSERT_TRUE(malloc_fail_control_generation() != before, "the reload should complete");
+        }
+        void *p = malloc(32);
+        if (p) free(p);
+        else fprintf(stderr, "reload: allocation %d failed\n", i);
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "fork") == 0) {
+        test_fork_workers();
+        return tests_failed > 0 ? 1 : 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "reload") == 0) {
+        test_reload();
+        return tests_failed > 0 ? 1 : 0;
+    }
+
     fprintf(stderr, "====================================\n");
     fprintf(stderr, "Malloc Interceptor Test Suite\n");
     fprintf(stderr, "====================================\n");
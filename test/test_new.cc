@@ -0,0 +1,105 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+/* Every operator new variant once, checked against what the rule below
+ * must do to it: the throwing variants it names throw std::bad_alloc,
+ * the nothrow ones return NULL, the others succeed. new[] of 77 bytes
+ * goes through a new_handler that gives up on its third call, and so
+ * does a nothrow new too large for any allocator, whose real failure
+ * must still run the handler. Exits non-zero if any check fails.
+ */
+
+#define EXPECTED_RULE "fn==new || fn==new_aligned || fn==new_array_nothrow || size==77"
+
+struct alignas(64) Wide {
+    char bytes[64];
+};
+
+struct Huge {
+    char bytes[SIZE_MAX / 4];
+};
+
+enum outcome { OK, NUL, BAD_ALLOC };
+
+static const char *const outcome_names[] = { "ok", "null", "bad_alloc" };
+
+static int tests_run = 0;
+static int tests_failed = 0;
+static int handler_calls = 0;
+
+#define ASSERT_TRUE(cond, msg) do { \
+    tests_run++; \
+    if (!(cond)) { \
+        tests_failed++; \
+        std::fprintf(stderr, "FAIL: %s\n", msg); \
+    } \
+} while (0)
+
+static void give_up_later() {
+    if (++handler_calls == 3) std::set_new_handler(nullptr);
+}
+
+template <typename F>
+static void attempt(const char *name, enum outcome expected, F allocate) {
+    enum outcome got;
+    try {
+        void *volatile p = allocate();
+        got = p ? OK : NUL;
+    } catch (const std::bad_alloc &) {
+        got = BAD_ALLOC;
+    }
+    std::fprintf(stderr, "%-26s %s\n", name, outcome_names[got]);
+    ASSERT_TRUE(got == expected, name);
+}
+
+int main() {
+    const char *rule = std::getenv("MALLOC_FAIL_RULE");
+    ASSERT_TRUE(rule && std::strcmp(rule, EXPECTED_RULE) == 0, "run with MALLOC_FAIL_RULE=\"" EXPECTED_RULE "\"");
+
+    attempt("new", BAD_ALLOC, [] { void *p = new int(1); delete static_cast<int *>(p); return p; });
+    attempt("new_array", OK, [] { void *p = new int[4]; delete[] static_cast<int *>(p); return p; });
+    attempt("new_aligned", BAD_ALLOC, [] { void *p = new Wide; delete static_cast<Wide *>(p); return p; });
+    attempt("new_array_aligned", OK, [] { void *p = new Wide[2]; delete[] static_cast<Wide *>(p); return p; });
+    attempt("new_nothrow", OK, [] {
+        int *p = new (std::nothrow) int(1);
+        delete p;
+        return static_cast<void *>(p);
+    });
+    attempt("new_array_nothrow", NUL, [] {
+        int *p = new (std::nothrow) int[4];
+        delete[] p;
+        return static_cast<void *>(p);
+    });
+    attempt("new_aligned_nothrow", OK, [] {
+        Wide *p = new (std::nothrow) Wide;
+        delete p;
+        return static_cast<void *>(p);
+    });
+    attempt("new_array_aligned_nothrow", OK, [] {
+        Wide *p = new (std::nothrow) Wide[2];
+        delete[] p;
+        return static_cast<void *>(p);
+    });
+
+    std::set_new_handler(give_up_later);
+    attempt("new_array (77 bytes)", BAD_ALLOC,
+            [] { void *p = new char[77]; delete[] static_cast<char *>(p); return p; });
+    std::fprintf(stderr, "new_handler calls: %d\n", handler_calls);
+    ASSERT_TRUE(handler_calls == 3, "the handler runs until it gives up");
+
+    handler_calls = 0;
+    std::set_new_handler(give_up_later);
+    attempt("new_nothrow (huge)", NUL, [] {
+        Huge *p = new (std::nothrow) Huge;
+        delete p;
+        return static_cast<void *>(p);
+    });
+    std::fprintf(stderr, "new_handler calls: %d\n", handler_calls);
+    ASSERT_TRUE(handler_calls == 3, "a real nothrow failure runs the handler");
+
+    std::fprintf(stderr, "\noperator new: %d/%d passed\n", tests_run - tests_failed, tests_run);
+    return tests_failed > 0 ? 1 : 0;
+}
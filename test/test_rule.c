@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "../src/alloc_fn.h"
+#include "../src/rule.h"
+
+/* MALLOC_FAIL_RULE parser: precedence, negation, the limits and where
+ * errors are reported. Exits non-zero if any check fails. */
+
+static int tests_run = 0;
+static int tests_failed = 0;
+
+#define ASSERT_TRUE(cond, msg) do { \
+    tests_run++; \
+    if (!(cond)) { \
+        tests_failed++; \
+        fprintf(stderr, "FAIL: %s\n", msg); \
+    } \
+} while (0)
+
+#define USES_ALL (RULE_USES_FN | RULE_USES_IDX)
+
+/* Whether rule s matches the call; -1 if it does not parse */
+static int matches(const char *s, unsigned fn, uint64_t size, uint64_t idx) {
+    struct rule_set rules;
+    const char *error, *where;
+    if (rule_parse(&rules, s, &error, &where) != 0) return -1;
+    return rule_match(&rules, USES_ALL, fn, size, idx);
+}
+
+/* The error message for s, with its offset in *at; NULL if it parses */
+static const char *parse_error(const char *s, long *at) {
+    struct rule_set rules;
+    const char *error, *where;
+    if (rule_parse(&rules, s, &error, &where) == 0) return NULL;
+    *at = where - s;
+    return error;
+}
+
+static void test_precedence(void) {
+    fprintf(stderr, "\n=== Test: && binds tighter than || ===\n");
+    const char *r = "fn==malloc || fn==calloc && size>100";
+    ASSERT_TRUE(matches(r, FN_MALLOC, 10, 1) == 1, "malloc matches the first alternative");
+    ASSERT_TRUE(matches(r, FN_CALLOC, 10, 1) == 0, "small calloc matches neither");
+    ASSERT_TRUE(matches(r, FN_CALLOC, 200, 1) == 1, "large calloc matches the second");
+    ASSERT_TRUE(matches("(fn==malloc || fn==calloc) && size>100", FN_MALLOC, 10, 1) == 0,
+                "parentheses group the ||");
+    ASSERT_TRUE(matches("idx==3; size==7", FN_REALLOC, 7, 1) == 1, "';' separates alternatives");
+}
+
+static void test_negation(void) {
+    fprintf(stderr, "\n=== Test: ! binds tighter than && and || ===\n");
+    const char *r = "!fn==malloc && size<10";
+    ASSERT_TRUE(matches(r, FN_CALLOC, 5, 1) == 1, "! applies to fn==malloc only");
+    ASSERT_TRUE(matches(r, FN_MALLOC, 5, 1) == 0, "malloc is excluded");
+    ASSERT_TRUE(matches(r, FN_CALLOC, 50, 1) == 0, "size<10 still applies");
+    ASSERT_TRUE(matches("!fn==malloc || size<10", FN_MALLOC, 5, 1) == 1, "! does not cover the ||");
+    ASSERT_TRUE(matches("!(fn==malloc || size<10)", FN_CALLOC, 5, 1) == 0, "! of a group");
+    ASSERT_TRUE(matches("!(fn==malloc || size<10)", FN_CALLOC, 50, 1) == 1, "De Morgan");
+    ASSERT_TRUE(matches("!!idx%2==0", FN_MALLOC, 1, 4) == 1, "double negation");
+    ASSERT_TRUE(matches("!idx%2==0", FN_MALLOC, 1, 4) == 0, "negated modulo");
+    ASSERT_TRUE(matches("size!=8", FN_MALLOC, 8, 1) == 0, "!= is not a negation");
+}
+
+static void test_limits(void) {
+    fprintf(stderr, "\n=== Test: clause and modifier limits ===\n");
+    long at = -1;
+    char rule[512] = "";
+    /* 2^6 = RULE_MAX_CLAUSES alternatives fit, 2^7 do not */
+    for (int i = 0; i < 6; i++) strcat(rule, i ? " && (idx==1 || size==1)" : "(idx==1 || size==1)");
+    ASSERT_TRUE(parse_error(rule, &at) == NULL, "64 alternatives parse");
+    strcat(rule, " && (idx==1 || size==1)");
+    const char *error = parse_error(rule, &at);
+    ASSERT_TRUE(error && strcmp(error, "too many alternatives") == 0, "65+ alternatives are refused");
+
+    ASSERT_TRUE(parse_error("size%2==0 && size%3==0 && idx%5==0 && idx%7==0", &at) == NULL,
+                "RULE_MAX_MODS modulo terms fit");
+    error = parse_error("size%2==0 && size%3==0 && idx%5==0 && idx%7==0 && size%11==0", &at);
+    ASSERT_TRUE(error && strcmp(error, "too many % terms in one alternative") == 0,
+                "a fifth modulo term is refused");
+    ASSERT_TRUE(parse_error("size%2==0 && size%3==0 && idx%5==0 && idx%7==0 || size%11==0", &at) == NULL,
+                "the limit is per alternative");
+}
+
+static void test_error_position(void) {
+    fprintf(stderr, "\n=== Test: reported error position ===\n");
+    static const struct {
+        const char *rule;
+        const char *error;
+        long at;
+    } cases[] = {
+        { "fn==mallocx", "unknown function", 4 },
+        { "size>=4K && foo==1", "expected fn, size or idx", 12 },
+        { "size=>4", "expected a comparison", 4 },
+        { "fn<malloc", "fn only takes == and !=", 2 },
+        { "idx%3<1", "% only takes == and !=", 5 },
+        { "idx%0==1", "modulo by zero", 4 },
+        { "(size>1 && idx<5", "expected ')'", 16 },
+        { "size>1 idx<5", "unexpected text", 7 },
+        { "idx>99999999999999999999", "number too large", 4 },
+        { "size<=99999999999G", "number too large", 6 },
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        long at = -1;
+        const char *error = parse_error(cases[i].rule, &at);
+        int ok = error && strcmp(error, cases[i].error) == 0 && at == cases[i].at;
+        if (!ok) fprintf(stderr, "  \"%s\": %s at %ld\n", cases[i].rule, error ? error : "(parsed)", at);
+        ASSERT_TRUE(ok, cases[i].error);
+    }
+}
+
+int main(void) {
+    test_precedence();
+    test_negation();
+    test_limits();
+    test_error_position();
+
+    fprintf(stderr, "\nRule parser: %d/%d passed\n", tests_run - tests_failed, tests_run);
+    return tests_failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,417 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/record.h"
+
+/* Replay a MALLOC_FAIL_RECORD file against the allocator this process
+ * runs with (LD_PRELOAD=libjemalloc.so malloc_replay trace.rec).
+ *
+ *   malloc_replay [-w] [-d] trace.rec
+ *
+ * Events are decoded and put in recorded order; every recorded block
+ * becomes a slot, so reused addresses never get confused. Each recorded
+ * thread is replayed by its own thread. An operation on a block another
+ * thread allocates waits until that allocation has been replayed, which
+ * is the only synchronisation. -w writes every allocated block, -d prints
+ * the decoded events instead of replaying them.
+ */
+
+#define NO_SLOT UINT32_MAX
+#define FAILED ((void *)1) /* the replayed allocation returned NULL */
+
+struct event {
+    uint64_t seq;
+    uint64_t size;
+    uint64_t align;
+    uint64_t ptr;
+    uint64_t old;
+    uint32_t thread;
+    uint8_t op;
+};
+
+struct op {
+    uint8_t op;
+    uint32_t slot;
+    uint32_t old_slot;
+    uint64_t size;
+    uint64_t align;
+};
+
+struct replay_thread {
+    uint32_t tid;
+    struct op *ops;
+    size_t count;
+    size_t cap;
+    pthread_t thread;
+    double busy_ns;
+};
+
+static _Atomic(void *) *slots;
+static struct replay_thread *threads;
+static size_t thread_count;
+static int touch;
+static pthread_barrier_t start_line;
+
+static void usage(void) {
+    fprintf(stderr, "usage: malloc_replay [-w] [-d] <record file>\n");
+    exit(2);
+}
+
+static void *xrealloc(void *p, size_t n) {
+    p = realloc(p, n);
+    if (!p) {
+        fprintf(stderr, "malloc_replay: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static int get_varint(const uint8_t **p, const uint8_t *end, uint64_t *out) {
+    uint64_t v = 0;
+    for (unsigned shift = 0; *p < end && shift < 64; shift += 7) {
+        uint8_t b = *(*p)++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *out = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static uint32_t thread_index(uint32_t tid) {
+    for (size_t i = 0; i < thread_count; ++i)
+        if (threads[i].tid == tid) return (uint32_t)i;
+    threads = xrealloc(threads, (thread_count + 1) * sizeof(*threads));
+    memset(&threads[thread_count], 0, sizeof(*threads));
+    threads[thread_count].tid = tid;
+    return (uint32_t)thread_count++;
+}
+
+/* Decode one chunk, appending to *events */
+static int decode_chunk(const struct record_chunk *c, struct event **events, size_t *count,
+                        size_t *cap) {
+    const uint8_t *p = (const uint8_t *)(c + 1), *end = p + c->bytes;
+    uint32_t thread = thread_index(c->tid);
+    uint64_t seq = c->base_seq, last_ptr = 0, v;
+    while (p < end) {
+        if (*count == *cap) {
+            *cap = *cap ? *cap * 2 : 4096;
+            *events = xrealloc(*events, *cap * sizeof(**events));
+        }
+        struct event *e = &(*events)[*count];
+        memset(e, 0, sizeof(*e));
+        e->op = *p++;
+        e->thread = thread;
+        if (get_varint(&p, end, &v)) return -1;
+        e->seq = seq += v;
+        if (e->op == RECORD_FREE) {
+            if (get_varint(&p, end, &v)) return -1;
+            e->ptr = last_ptr += (uint64_t)record_unzigzag(v);
+        } else if (e->op == FN_REALLOC) {
+            if (get_varint(&p, end, &v)) return -1;
+            e->old = last_ptr + (uint64_t)record_unzigzag(v);
+            if (get_varint(&p, end, &e->size) || get_varint(&p, end, &v)) return -1;
+            e->ptr = e->old + (uint64_t)record_unzigzag(v);
+            if (e->ptr) last_ptr = e->ptr;
+        } else if (e->op < FN_COUNT) {
+            if (get_varint(&p, end, &e->size)) return -1;
+            if (record_has_align(e->op) && get_varint(&p, end, &e->align)) return -1;
+            if (get_varint(&p, end, &v)) return -1;
+            e->ptr = last_ptr + (uint64_t)record_unzigzag(v);
+            if (e->ptr) last_ptr = e->ptr;
+        } else {
+            return -1;
+        }
+        (*count)++;
+    }
+    return 0;
+}
+
+static int by_seq(const void *a, const void *b) {
+    const struct event *x = a, *y = b;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/* Recorded address -> slot of the block currently living there */
+struct ptr_map {
+    uint64_t *keys;   /* 0 = empty */
+    uint32_t *vals;
+    size_t mask;
+    size_t used;
+};
+
+static uint64_t hash_ptr(uint64_t p) {
+    return (p >> 4) * 0x9e3779b97f4a7c15ULL;
+}
+
+static void map_put(struct ptr_map *m, uint64_t key, uint32_t val);
+
+static void map_grow(struct ptr_map *m) {
+    struct ptr_map old = *m;
+    size_t cap = old.mask ? (old.mask + 1) * 2 : 1024;
+    m->keys = calloc(cap, sizeof(*m->keys));
+    m->vals = calloc(cap, sizeof(*m->vals));
+    if (!m->keys || !m->vals) xrealloc(NULL, SIZE_MAX);
+    m->mask = cap - 1;
+    m->used = 0;
+    for (size_t i = 0; old.mask && i <= old.mask; ++i)
+        if (old.keys[i]) map_put(m, old.keys[i], old.vals[i]);
+    free(old.keys);
+    free(old.vals);
+}
+
+static void map_put(struct ptr_map *m, uint64_t key, uint32_t val) {
+    if ((m->used + 1) * 2 > m->mask + 1) map_grow(m);
+    size_t i = hash_ptr(key) & m->mask;
+    while (m->keys[i] && m->keys[i] != key) i = (i + 1) & m->mask;
+    if (!m->keys[i]) m->used++;
+    m->keys[i] = key;
+    m->vals[i] = val;
+}
+
+/* Remove key, returning its slot or NO_SLOT */
+static uint32_t map_take(struct ptr_map *m, uint64_t key) {
+    if (!m->mask) return NO_SLOT;
+    size_t i = hash_ptr(key) & m->mask;
+    while (m->keys[i] && m->keys[i] != key) i = (i + 1) & m->mask;
+    if (!m->keys[i]) return NO_SLOT;
+    uint32_t val = m->vals[i];
+    /* Backward-shift deletion */
+    size_t hole = i;
+    for (size_t j = (i + 1) & m->mask; m->keys[j]; j = (j + 1) & m->mask) {
+        size_t home = hash_ptr(m->keys[j]) & m->mask;
+        if (((j - home) & m->mask) >= ((j - hole) & m->mask)) {
+            m->keys[hole] = m->keys[j];
+            m->vals[hole] = m->vals[j];
+            hole = j;
+        }
+    }
+    m->keys[hole] = 0;
+    m->used--;
+    return val;
+}
+
+static void push_op(struct replay_thread *t, struct op op) {
+    if (t->count == t->cap) {
+        t->cap = t->cap ? t->cap * 2 : 1024;
+        t->ops = xrealloc(t->ops, t->cap * sizeof(*t->ops));
+    }
+    t->ops[t->count++] = op;
+}
+
+/* Block of another thread: wait until its allocation has been replayed */
+static void *wait_slot(uint32_t slot) {
+    void *p;
+    while (!(p = atomic_load_explicit(&slots[slot], memory_order_acquire))) sched_yield();
+    return p == FAILED ? NULL : p;
+}
+
+static void *replay_alloc(const struct op *o) {
+    void *p = NULL;
+    switch (o->op) {
+    case FN_CALLOC: return calloc(1, o->size);
+    case FN_POSIX_MEMALIGN: return posix_memalign(&p, o->align, o->size) == 0 ? p : NULL;
+    case FN_ALIGNED_ALLOC: return aligned_alloc(o->align, o->size);
+    case FN_MEMALIGN: return memalign(o->align, o->size);
+    case FN_VALLOC: return valloc(o->size);
+    case FN_PVALLOC: return pvalloc(o->size);
+    default:
+        /* operator new is malloc or aligned_alloc underneath */
+        return record_has_align(o->op) ? aligned_alloc(o->align, o->size) : malloc(o->size);
+    }
+}
+
+static void *replay_main(void *arg) {
+    struct replay_thread *t = arg;
+    pthread_barrier_wait(&start_line);
+    double t0 = now_ns();
+    for (size_t i = 0; i < t->count; ++i) {
+        const struct op *o = &t->ops[i];
+        void *p;
+        if (o->op == RECORD_FREE) {
+            free(wait_slot(o->slot));
+            continue;
+        }
+        if (o->op == FN_REALLOC) {
+            void *old = o->old_slot == NO_SLOT ? NULL : wait_slot(o->old_slot);
+            p = realloc(old, o->size);
+            if (o->slot == NO_SLOT) continue; /* realloc(p, 0) */
+        } else {
+            p = replay_alloc(o);
+        }
+        if (p && touch) memset(p, 0xa5, o->size);
+        atomic_store_explicit(&slots[o->slot], p ? p : FAILED, memory_order_release);
+    }
+    t->busy_ns = now_ns() - t0;
+    return NULL;
+}
+
+/* Current and peak resident set in KiB. Writing 5 to clear_refs resets
+ * the peak, so it can cover the replay alone. */
+static long status_kb(const char *field) {
+    char line[128];
+    long kb = 0;
+    size_t len = strlen(field);
+    FILE *f = fopen("/proc/self/status", "r");
+    if (!f) return 0;
+    while (fgets(line, sizeof(line), f))
+        if (strncmp(line, field, len) == 0) kb = strtol(line + len, NULL, 10);
+    fclose(f);
+    return kb;
+}
+
+static void reset_peak_rss(void) {
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd >= 0) {
+        if (write(fd, "5", 1) != 1) perror("malloc_replay: clear_refs");
+        close(fd);
+    }
+}
+
+int main(int argc, char **argv) {
+    int dump = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "wd")) != -1) {
+        if (opt == 'w') touch = 1;
+        else if (opt == 'd') dump = 1;
+        else usage();
+    }
+    if (optind + 1 != argc) usage();
+
+    int fd = open(argv[optind], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if ((size_t)st.st_size < sizeof(struct record_header)) {
+        fprintf(stderr, "%s: too short for a record file\n", argv[optind]);
+        return 1;
+    }
+    const char *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    const struct record_header *hdr = (const void *)map;
+    if (memcmp(hdr->magic, RECORD_MAGIC, sizeof(RECORD_MAGIC)) != 0 || hdr->version != RECORD_VERSION) {
+        fprintf(stderr, "%s: not a record file (or unsupported version)\n", argv[optind]);
+        return 1;
+    }
+
+    struct event *events = NULL;
+    size_t count = 0, cap = 0;
+    for (size_t off = sizeof(*hdr); off + sizeof(struct record_chunk) <= (size_t)st.st_size;) {
+        const struct record_chunk *c = (const void *)(map + off);
+        if (off + sizeof(*c) + c->bytes > (size_t)st.st_size ||
+            decode_chunk(c, &events, &count, &cap) != 0) {
+            fprintf(stderr, "%s: truncated or corrupt chunk at offset %zu\n", argv[optind], off);
+            break;
+        }
+        off += sizeof(*c) + c->bytes;
+    }
+    qsort(events, count, sizeof(*events), by_seq);
+
+    if (dump) {
+        for (size_t i = 0; i < count; ++i) {
+            const struct event *e = &events[i];
+            printf("%10" PRIu64 " tid %-7" PRIu32 " ", e->seq, threads[e->thread].tid);
+            if (e->op == RECORD_FREE)
+                printf("free(0x%" PRIx64 ")\n", e->ptr);
+            else if (e->op == FN_REALLOC)
+                printf("realloc(0x%" PRIx64 ", %" PRIu64 ") = 0x%" PRIx64 "\n", e->old, e->size, e->ptr);
+            else if (record_has_align(e->op))
+                printf("%s(%" PRIu64 ", %" PRIu64 ") = 0x%" PRIx64 "\n", alloc_fn_name(e->op),
+                       e->align, e->size, e->ptr);
+            else
+                printf("%s(%" PRIu64 ") = 0x%" PRIx64 "\n", alloc_fn_name(e->op), e->size, e->ptr);
+        }
+        return 0;
+    }
+
+    /* Give every recorded block its own slot */
+    struct ptr_map live = { 0 };
+    uint32_t slot_count = 0;
+    uint64_t live_bytes = 0, peak_bytes = 0, skipped = 0;
+    uint64_t *slot_size = NULL;
+    size_t slot_cap = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const struct event *e = &events[i];
+        struct op o = { e->op, NO_SLOT, NO_SLOT, e->size, e->align };
+        if (e->op == RECORD_FREE || e->op == FN_REALLOC) {
+            uint64_t addr = e->op == RECORD_FREE ? e->ptr : e->old;
+            o.old_slot = addr ? map_take(&live, addr) : NO_SLOT;
+            if (o.old_slot != NO_SLOT) live_bytes -= slot_size[o.old_slot];
+            if (e->op == RECORD_FREE) {
+                if (o.old_slot == NO_SLOT) { /* allocated before recording started */
+                    skipped++;
+                    continue;
+                }
+                o.slot = o.old_slot;
+                push_op(&threads[e->thread], o);
+                continue;
+            }
+            if (!e->ptr) { /* realloc(p, 0) */
+                push_op(&threads[e->thread], o);
+                continue;
+            }
+        }
+        if (slot_count == slot_cap) {
+            slot_cap = slot_cap ? slot_cap * 2 : 4096;
+            slot_size = xrealloc(slot_size, slot_cap * sizeof(*slot_size));
+        }
+        o.slot = slot_count++;
+        slot_size[o.slot] = e->size;
+        live_bytes += e->size;
+        if (live_bytes > peak_bytes) peak_bytes = live_bytes;
+        map_put(&live, e->ptr, o.slot);
+        push_op(&threads[e->thread], o);
+    }
+    free(events);
+    free(live.keys);
+    free(live.vals);
+
+    slots = calloc(slot_count ? slot_count : 1, sizeof(*slots));
+    if (!slots) xrealloc(NULL, SIZE_MAX);
+    memset(slots, 0, (slot_count ? slot_count : 1) * sizeof(*slots)); /* fault in before measuring */
+    reset_peak_rss();
+    long rss_before = status_kb("VmRSS:");
+    pthread_barrier_init(&start_line, NULL, (unsigned)thread_count + 1);
+    for (size_t i = 0; i < thread_count; ++i)
+        pthread_create(&threads[i].thread, NULL, replay_main, &threads[i]);
+    double t0 = now_ns();
+    pthread_barrier_wait(&start_line);
+    for (size_t i = 0; i < thread_count; ++i) pthread_join(threads[i].thread, NULL);
+    double elapsed = now_ns() - t0;
+
+    long rss_peak = status_kb("VmHWM:");
+    uint64_t ops = 0;
+    for (size_t i = 0; i < thread_count; ++i) ops += threads[i].count;
+    printf("replayed %" PRIu64 " operations on %zu threads in %.3f s: %.2f Mops/s, %.1f ns per op\n",
+           ops, thread_count, elapsed / 1e9, elapsed > 0 ? (double)ops / elapsed * 1e3 : 0.0,
+           ops ? elapsed / (double)ops : 0.0);
+    printf("%" PRIu32 " blocks, peak %" PRIu64 " bytes requested; peak RSS %.1f MiB (%.1f MiB above the replay's tables)\n",
+           slot_count, peak_bytes, (double)rss_peak / 1024, (double)(rss_peak - rss_before) / 1024);
+    if (skipped) printf("%" PRIu64 " frees of blocks allocated before recording were skipped\n", skipped);
+    return 0;
+}
@@ -0,0 +1,140 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/shmstats.h"
+
+/* Live view of a process running with MALLOC_FAIL_SHM=1.
+ *
+ *   malloc_stat [-i interval_s] [-n count] [-f] pid
+ *
+ * Maps /dev/shm/malloc_fail.<pid> read-only and prints one line per
+ * interval with allocation and failure rates. -f prints the per-function
+ * table instead. Reading never stops or traces the target.
+ */
+
+static void usage(void) {
+    fprintf(stderr, "usage: malloc_stat [-i interval_s] [-n count] [-f] pid\n");
+    exit(2);
+}
+
+/* Seqlock read: retry until a copy was taken between two equal even values */
+static int read_snapshot(const struct shm_stats *seg, struct shm_stats_data *out) {
+    for (int tries = 0; tries < 1000; ++tries) {
+        uint64_t before = atomic_load_explicit(&seg->seq, memory_order_acquire);
+        if (before & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(out, (const void *)&seg->data, sizeof(*out));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&seg->seq, memory_order_relaxed) == before) return before ? 0 : -1;
+    }
+    return -1;
+}
+
+static uint64_t sum(const uint64_t *v) {
+    uint64_t s = 0;
+    for (int fn = 0; fn < FN_COUNT; ++fn) s += v[fn];
+    return s;
+}
+
+static void print_functions(const struct shm_stats_data *cur, const struct shm_stats_data *prev,
+                            double dt) {
+    printf("%-16s %12s %12s %10s %10s\n", "function", "total", "calls/s", "failed", "fails/s");
+    for (int fn = 0; fn < FN_COUNT; ++fn) {
+        if (!cur->total[fn]) continue;
+        double calls = prev && dt > 0 ? (double)(cur->total[fn] - prev->total[fn]) / dt : 0;
+        double fails = prev && dt > 0 ? (double)(cur->failed[fn] - prev->failed[fn]) / dt : 0;
+        printf("%-16s %12" PRIu64 " %12.0f %10" PRIu64 " %10.0f\n", alloc_fn_name(fn),
+               cur->total[fn], calls, cur->failed[fn], fails);
+    }
+}
+
+int main(int argc, char **argv) {
+    double interval = 1.0;
+    long count = -1;
+    int functions = 0;
+    int c;
+    while ((c = getopt(argc, argv, "i:n:f")) != -1) {
+        switch (c) {
+        case 'i': interval = strtod(optarg, NULL); break;
+        case 'n': count = strtol(optarg, NULL, 10); break;
+        case 'f': functions = 1; break;
+        default: usage();
+        }
+    }
+    if (optind + 1 != argc || interval <= 0) usage();
+    pid_t pid = (pid_t)strtol(argv[optind], NULL, 10);
+
+    char path[64];
+    snprintf(path, sizeof(path), SHM_STATS_PATH_FMT, (int)pid);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "malloc_stat: %s: %s (is the process running with MALLOC_FAIL_SHM=1?)\n",
+                path, strerror(errno));
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct shm_stats)) {
+        fprintf(stderr, "malloc_stat: %s: too small\n", path);
+        return 1;
+    }
+    const struct shm_stats *seg = mmap(NULL, sizeof(*seg), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (seg == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    if (memcmp(seg->magic, SHM_STATS_MAGIC, sizeof(SHM_STATS_MAGIC)) != 0 ||
+        seg->version != SHM_STATS_VERSION || seg->size != sizeof(struct shm_stats)) {
+        fprintf(stderr, "malloc_stat: %s: unknown format (version %u)\n", path, seg->version);
+        return 1;
+    }
+
+    struct shm_stats_data prev, cur;
+    int have_prev = 0;
+    for (long n = 0; count < 0 || n < count; ++n) {
+        if (n > 0) {
+            struct timespec ts = { (time_t)interval, (long)((interval - (time_t)interval) * 1e9) };
+            nanosleep(&ts, NULL);
+        }
+        if (read_snapshot(seg, &cur) != 0) {
+            fprintf(stderr, "malloc_stat: no consistent snapshot yet\n");
+            continue;
+        }
+        double dt = have_prev ? (double)(cur.updated_ns - prev.updated_ns) / 1e9 : 0;
+        const char *state = cur.state == SHM_EXITED ? "exited"
+                          : kill(pid, 0) != 0 && errno == ESRCH ? "gone" : "running";
+
+        if (functions) {
+            printf("pid %d %s, %" PRIu64 " allocations after init, first failure #%" PRIu64 "\n",
+                   (int)pid, state, cur.visible, cur.first_failure);
+            print_functions(&cur, have_prev ? &prev : NULL, dt);
+        } else {
+            if (n % 20 == 0)
+                printf("%-8s %12s %12s %10s %10s %14s\n", "state", "visible", "calls/s",
+                       "failed", "fails/s", "live bytes");
+            uint64_t total = sum(cur.total), failed = sum(cur.failed);
+            double calls = dt > 0 ? (double)(total - sum(prev.total)) / dt : 0;
+            double fails = dt > 0 ? (double)(failed - sum(prev.failed)) / dt : 0;
+            printf("%-8s %12" PRIu64 " %12.0f %10" PRIu64 " %10.0f %14" PRId64 "\n", state,
+                   cur.visible, calls, failed, fails, cur.live_bytes);
+        }
+        fflush(stdout);
+        prev = cur;
+        have_prev = 1;
+        if (cur.state == SHM_EXITED || strcmp(state, "gone") == 0) break;
+    }
+    return 0;
+}
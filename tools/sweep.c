@@ -0,0 +1,625 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/forksrv.h"
+#include "../src/plan.h"
+
+/* Failure sweep driver.
+ *
+ *   malloc_sweep [-j jobs] [-t timeout] [-s first] [-e last] [-l lib] [-o report] [-v]
+ *                [-F index|hook] [-P plan] -- program [args...]
+ *
+ * A counting run with MALLOC_FAIL_STATS learns how many allocations the
+ * program makes after init. Then every index in [first, last] gets its own
+ * run with MALLOC_FAIL_AT=<index>, up to <jobs> at a time. Each run is
+ * classified by how it ended and the report lists the indices per outcome
+ * as compressed ranges.
+ *
+ * With -F the runs are forked from <jobs> fork servers (see
+ * src/forksrv.h) that stopped at the given allocation index or at the
+ * program's malloc_fail_forkserver() call, so startup is paid once per
+ * server instead of once per run.
+ *
+ * With -P the counting run also records a failure plan (src/plan.h) into
+ * the given file, and the sweep covers plan entries instead of indices:
+ * run k fails only the first allocation from the k-th call site.
+ */
+
+enum outcome_kind {
+    OUT_PENDING,
+    OUT_EXIT,    /* exited; code in detail (0 = handled cleanly) */
+    OUT_SIGNAL,  /* killed by a signal; number in detail */
+    OUT_HANG,    /* exceeded the per-run timeout */
+    OUT_SPAWN,   /* could not be started */
+};
+
+struct outcome {
+    uint8_t kind;
+    uint8_t detail;
+};
+
+struct slot {
+    pid_t pid;
+    uint64_t index;
+    double started;
+    int timed_out;
+};
+
+/* A target parked in fork-server mode, and the run it is serving */
+struct server {
+    pid_t pid;
+    int req_fd;
+    int rep_fd;
+    pid_t child;     /* 0 when idle */
+    uint64_t index;
+    double started;
+    int timed_out;
+};
+
+struct options {
+    unsigned jobs;
+    double timeout;
+    uint64_t first;
+    uint64_t last;
+    const char *lib;
+    const char *report;
+    int verbose;
+    const char *forksrv;
+    const char *plan;
+    char **argv;
+};
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: malloc_sweep [-j jobs] [-t timeout_s] [-s first] [-e last]\n"
+            "                    [-l interceptor.so] [-o report] [-v] [-F index|hook] [-P plan]\n"
+            "                    -- program [args...]\n");
+    exit(2);
+}
+
+/* Child side of a run: point the interceptor at <index> (a plan entry
+ * with -P) and exec */
+static void exec_target(const struct options *opt, const char *fail_at,
+                        const char *stats_file, int forksrv) {
+    setpgid(0, 0); /* so a timeout can kill everything the target forked */
+
+    const char *old = getenv("LD_PRELOAD");
+    char preload[PATH_MAX * 2];
+    if (old && *old) snprintf(preload, sizeof(preload), "%s:%s", opt->lib, old);
+    else snprintf(preload, sizeof(preload), "%s", opt->lib);
+    setenv("LD_PRELOAD", preload, 1);
+
+    unsetenv("MALLOC_FAIL_PLAN");
+    unsetenv("MALLOC_FAIL_PLAN_OUT");
+    if (fail_at && opt->plan) {
+        unsetenv("MALLOC_FAIL_AT");
+        unsetenv("MALLOC_FAIL_EVERY");
+        setenv("MALLOC_FAIL_PLAN", opt->plan, 1);
+        setenv("MALLOC_FAIL_PLAN_ENTRY", fail_at, 1);
+    } else if (fail_at) {
+        setenv("MALLOC_FAIL_AT", fail_at, 1);
+    } else {
+        unsetenv("MALLOC_FAIL_AT");
+        unsetenv("MALLOC_FAIL_EVERY");
+        if (opt->plan && stats_file) setenv("MALLOC_FAIL_PLAN_OUT", opt->plan, 1);
+    }
+    if (stats_file) {
+        setenv("MALLOC_FAIL_STATS", "1", 1);
+        setenv("MALLOC_FAIL_STATS_FILE", stats_file, 1);
+        unsetenv("MALLOC_FAIL_STATS_FORMAT"); /* count_allocations reads the text report */
+    } else {
+        unsetenv("MALLOC_FAIL_STATS");
+        unsetenv("MALLOC_FAIL_STATS_FILE");
+    }
+    if (forksrv) {
+        char fd[16];
+        snprintf(fd, sizeof(fd), "%d", FORKSRV_FD_DEFAULT);
+        setenv("MALLOC_FAIL_FORKSRV", opt->forksrv, 1);
+        setenv("MALLOC_FAIL_FORKSRV_FD", fd, 1);
+    } else {
+        unsetenv("MALLOC_FAIL_FORKSRV");
+    }
+
+    int devnull = open("/dev/null", O_RDWR);
+    if (devnull >= 0) {
+        dup2(devnull, 0);
+        if (!opt->verbose) {
+            dup2(devnull, 1);
+            dup2(devnull, 2);
+        }
+        if (devnull > 2) close(devnull);
+    }
+    execvp(opt->argv[0], opt->argv);
+    _exit(127);
+}
+
+/* Counting run: returns the number of visible allocations, or 0 */
+static uint64_t count_allocations(const struct options *opt) {
+    char stats_file[] = "/tmp/malloc_sweep.XXXXXX";
+    int fd = mkstemp(stats_file);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 0;
+    }
+    close(fd);
+
+    pid_t pid = fork();
+    if (pid == 0) exec_target(opt, NULL, stats_file, 0);
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+        perror("counting run");
+        unlink(stats_file);
+        return 0;
+    }
+    if (WIFSIGNALED(status))
+        fprintf(stderr, "malloc_sweep: warning: counting run died with %s\n",
+                strsignal(WTERMSIG(status)));
+    else if (WEXITSTATUS(status) != 0)
+        fprintf(stderr, "malloc_sweep: warning: counting run exited with %d\n",
+                WEXITSTATUS(status));
+
+    uint64_t visible = 0;
+    FILE *f = fopen(stats_file, "r");
+    if (f) {
+        char line[256];
+        while (fgets(line, sizeof(line), f))
+            if (sscanf(line, "visible: %" SCNu64, &visible) == 1) break;
+        fclose(f);
+    }
+    unlink(stats_file);
+    return visible;
+}
+
+/* Entries of the plan the counting run recorded, or NULL */
+static struct plan_entry *read_plan(const char *path, uint32_t *count) {
+    struct plan_header hdr;
+    struct plan_entry *entries = NULL;
+    FILE *f = fopen(path, "rb");
+    *count = 0;
+    if (!f) return NULL;
+    if (fread(&hdr, sizeof(hdr), 1, f) == 1 && memcmp(hdr.magic, PLAN_MAGIC, sizeof(PLAN_MAGIC)) == 0 &&
+        hdr.version == PLAN_VERSION && hdr.entry_size == sizeof(struct plan_entry) &&
+        (entries = calloc(hdr.count ? hdr.count : 1, sizeof(*entries))) != NULL) {
+        *count = (uint32_t)fread(entries, sizeof(*entries), hdr.count, f);
+    }
+    fclose(f);
+    return entries;
+}
+
+static void classify(struct outcome *out, int status, int timed_out) {
+    if (timed_out) {
+        out->kind = OUT_HANG;
+    } else if (WIFSIGNALED(status)) {
+        out->kind = OUT_SIGNAL;
+        out->detail = (uint8_t)WTERMSIG(status);
+    } else if (WEXITSTATUS(status) == 127) {
+        out->kind = OUT_SPAWN;
+    } else {
+        out->kind = OUT_EXIT;
+        out->detail = (uint8_t)WEXITSTATUS(status);
+    }
+}
+
+static void run_sweep(const struct options *opt, struct outcome *results) {
+    struct slot *slots = calloc(opt->jobs, sizeof(*slots));
+    if (!slots) {
+        perror("calloc");
+        exit(1);
+    }
+
+    /* SIGCHLD is only waited for, never delivered */
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, NULL);
+
+    uint64_t next = opt->first;
+    unsigned running = 0;
+    uint64_t done = 0, total = opt->last - opt->first + 1;
+
+    while (next <= opt->last || running > 0) {
+        /* Fill free slots from the queue of indices */
+        for (unsigned i = 0; i < opt->jobs && next <= opt->last; ++i) {
+            if (slots[i].pid) continue;
+            char fail_at[32];
+            snprintf(fail_at, sizeof(fail_at), "%" PRIu64, next);
+            pid_t pid = fork();
+            if (pid == 0) {
+                sigprocmask(SIG_UNBLOCK, &chld, NULL);
+                exec_target(opt, fail_at, NULL, 0);
+            }
+            if (pid < 0) {
+                results[next - opt->first].kind = OUT_SPAWN;
+                done++;
+            } else {
+                slots[i] = (struct slot){ pid, next, now_s(), 0 };
+                running++;
+            }
+            next++;
+        }
+
+        /* Reap whatever finished */
+        int status;
+        pid_t pid;
+        while (running > 0 && (pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (unsigned i = 0; i < opt->jobs; ++i) {
+                if (slots[i].pid != pid) continue;
+                classify(&results[slots[i].index - opt->first], status, slots[i].timed_out);
+                slots[i].pid = 0;
+                running--;
+                done++;
+                break;
+            }
+        }
+
+        /* Kill runs that exceeded the timeout */
+        double now = now_s();
+        for (unsigned i = 0; i < opt->jobs; ++i) {
+            if (slots[i].pid && !slots[i].timed_out && now - slots[i].started > opt->timeout) {
+                slots[i].timed_out = 1;
+                kill(-slots[i].pid, SIGKILL);
+                kill(slots[i].pid, SIGKILL);
+            }
+        }
+
+        if (isatty(2))
+            fprintf(stderr, "\rmalloc_sweep: %" PRIu64 "/%" PRIu64 " runs", done, total);
+
+        if (running == opt->jobs || (next > opt->last && running > 0)) {
+            struct timespec wait = { 0, 20 * 1000 * 1000 };
+            sigtimedwait(&chld, NULL, &wait);
+        }
+    }
+    if (isatty(2)) fputc('\n', stderr);
+    free(slots);
+}
+
+/* Start one fork server and wait for its hello. Returns the first index
+ * its children can fail, or 0 if the target never reached the stop point. */
+static uint64_t start_server(const struct options *opt, struct server *srv) {
+    int req[2], rep[2];
+    if (pipe(req) != 0) return 0;
+    if (pipe(rep) != 0) {
+        close(req[0]);
+        close(req[1]);
+        return 0;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(req[0], FORKSRV_FD_DEFAULT);
+        dup2(rep[1], FORKSRV_FD_DEFAULT + 1);
+        close(req[0]); close(req[1]); close(rep[0]); close(rep[1]);
+        exec_target(opt, NULL, NULL, 1);
+    }
+    close(req[0]);
+    close(rep[1]);
+    memset(srv, 0, sizeof(*srv));
+    srv->pid = pid;
+    srv->req_fd = req[1];
+    srv->rep_fd = rep[0];
+    if (pid < 0) return 0;
+
+    uint64_t hello = 0;
+    struct pollfd pfd = { rep[0], POLLIN, 0 };
+    if (poll(&pfd, 1, (int)(opt->timeout * 1000)) != 1 ||
+        read(rep[0], &hello, sizeof(hello)) != (ssize_t)sizeof(hello))
+        return 0;
+    return hello;
+}
+
+static void stop_server(struct server *srv) {
+    if (srv->req_fd >= 0) close(srv->req_fd);
+    if (srv->rep_fd >= 0) close(srv->rep_fd);
+    if (srv->pid > 0) {
+        kill(srv->pid, SIGKILL);
+        waitpid(srv->pid, NULL, 0);
+    }
+    srv->pid = 0;
+    srv->req_fd = srv->rep_fd = -1;
+}
+
+static int read_i32(int fd, int32_t *v) {
+    return read(fd, v, sizeof(*v)) == (ssize_t)sizeof(*v) ? 0 : -1;
+}
+
+static void run_forksrv_sweep(struct options *opt, struct outcome **results) {
+    struct server *servers = calloc(opt->jobs, sizeof(*servers));
+    struct pollfd *pfds = calloc(opt->jobs, sizeof(*pfds));
+    if (!servers || !pfds) {
+        perror("calloc");
+        exit(1);
+    }
+
+    uint64_t first_failable = 0;
+    for (unsigned i = 0; i < opt->jobs; ++i) {
+        uint64_t hello = start_server(opt, &servers[i]);
+        if (hello == 0) {
+            fprintf(stderr, "malloc_sweep: target never reached fork-server point %s\n",
+                    opt->forksrv);
+            exit(1);
+        }
+        first_failable = hello;
+    }
+    if (opt->first < first_failable) {
+        fprintf(stderr, "malloc_sweep: fork server starts at index %" PRIu64
+                ", sweeping from there\n", first_failable);
+        opt->first = first_failable;
+        if (opt->last < opt->first) opt->last = opt->first;
+        free(*results);
+        *results = calloc(opt->last - opt->first + 1, sizeof(**results));
+        if (!*results) {
+            perror("calloc");
+            exit(1);
+        }
+    }
+    struct outcome *res = *results;
+
+    uint64_t next = opt->first;
+    unsigned busy = 0;
+    while (next <= opt->last || busy > 0) {
+        /* Hand out indices to idle servers */
+        for (unsigned i = 0; i < opt->jobs && next <= opt->last; ++i) {
+            struct server *srv = &servers[i];
+            if (srv->child) continue;
+            int32_t child = -1;
+            if (write(srv->req_fd, &next, sizeof(next)) != (ssize_t)sizeof(next) ||
+                read_i32(srv->rep_fd, &child) != 0) {
+                /* Server is gone: replace it and retry this index */
+                stop_server(srv);
+                if (start_server(opt, srv) == 0) {
+                    fprintf(stderr, "malloc_sweep: could not restart fork server\n");
+                    exit(1);
+                }
+                --i;
+                continue;
+            }
+            if (child <= 0) {
+                int32_t status;
+                read_i32(srv->rep_fd, &status);
+                res[next - opt->first].kind = OUT_SPAWN;
+                next++;
+                continue;
+            }
+            srv->child = child;
+            srv->index = next++;
+            srv->started = now_s();
+            srv->timed_out = 0;
+            busy++;
+        }
+
+        /* Wait for any run to finish */
+        for (unsigned i = 0; i < opt->jobs; ++i) {
+            pfds[i].fd = servers[i].child ? servers[i].rep_fd : -1;
+            pfds[i].events = POLLIN;
+            pfds[i].revents = 0;
+        }
+        poll(pfds, opt->jobs, 20);
+        for (unsigned i = 0; i < opt->jobs; ++i) {
+            struct server *srv = &servers[i];
+            if (!srv->child || !(pfds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            int32_t status;
+            struct outcome *out = &res[srv->index - opt->first];
+            if (read_i32(srv->rep_fd, &status) == 0) {
+                classify(out, status, srv->timed_out);
+            } else {
+                out->kind = srv->timed_out ? OUT_HANG : OUT_SPAWN;
+                stop_server(srv);
+                if (start_server(opt, srv) == 0) {
+                    fprintf(stderr, "malloc_sweep: could not restart fork server\n");
+                    exit(1);
+                }
+            }
+            srv->child = 0;
+            busy--;
+        }
+
+        double now = now_s();
+        for (unsigned i = 0; i < opt->jobs; ++i) {
+            struct server *srv = &servers[i];
+            if (srv->child && !srv->timed_out && now - srv->started > opt->timeout) {
+                srv->timed_out = 1;
+                kill(srv->child, SIGKILL);
+            }
+        }
+    }
+
+    for (unsigned i = 0; i < opt->jobs; ++i) stop_server(&servers[i]);
+    free(pfds);
+    free(servers);
+}
+
+static const char *outcome_label(const struct outcome *o, char *buf, size_t len) {
+    switch (o->kind) {
+    case OUT_EXIT:
+        if (o->detail == 0) return "ok (exit 0)";
+        snprintf(buf, len, "exit %u", o->detail);
+        return buf;
+    case OUT_SIGNAL:
+        snprintf(buf, len, "crash SIG%s", sigabbrev_np(o->detail) ? sigabbrev_np(o->detail) : "?");
+        return buf;
+    case OUT_HANG:
+        return "hang (timeout)";
+    case OUT_SPAWN:
+        return "could not run";
+    default:
+        return "not run";
+    }
+}
+
+static int same_outcome(const struct outcome *a, const struct outcome *b) {
+    return a->kind == b->kind && a->detail == b->detail;
+}
+
+/* One line per distinct outcome with its indices as ranges, crashes first */
+static void print_report(FILE *out, const struct options *opt, const struct outcome *results,
+                         const struct plan_entry *plan, double elapsed) {
+    uint64_t n = opt->last - opt->first + 1;
+    uint8_t *printed = calloc(n, 1);
+    if (!printed) return;
+
+    fprintf(out, "malloc_sweep: %s %" PRIu64 "-%" PRIu64 ", %u jobs, %.1f s\n",
+            plan ? "plan entries" : "indices", opt->first, opt->last, opt->jobs, elapsed);
+
+    static const uint8_t order[] = { OUT_SIGNAL, OUT_HANG, OUT_SPAWN, OUT_EXIT, OUT_PENDING };
+    for (size_t k = 0; k < sizeof(order); ++k) {
+        for (uint64_t i = 0; i < n; ++i) {
+            if (printed[i] || results[i].kind != order[k]) continue;
+            if (order[k] == OUT_EXIT && results[i].detail == 0) continue; /* ok goes last */
+
+            char label[32];
+            const struct outcome *cls = &results[i];
+            uint64_t count = 0;
+            fprintf(out, "  %-16s", outcome_label(cls, label, sizeof(label)));
+            const char *sep = " ";
+            for (uint64_t j = i; j < n; ++j) {
+                if (printed[j] || !same_outcome(&results[j], cls)) continue;
+                uint64_t end = j;
+                while (end + 1 < n && same_outcome(&results[end + 1], cls)) end++;
+                if (end == j) fprintf(out, "%s%" PRIu64, sep, opt->first + j);
+                else fprintf(out, "%s%" PRIu64 "-%" PRIu64, sep, opt->first + j, opt->first + end);
+                sep = ",";
+                for (uint64_t m = j; m <= end; ++m) printed[m] = 1;
+                count += end - j + 1;
+                j = end;
+            }
+            fprintf(out, "  (%" PRIu64 ")\n", count);
+        }
+    }
+
+    uint64_t ok = 0;
+    for (uint64_t i = 0; i < n; ++i)
+        if (!printed[i]) ok++;
+    fprintf(out, "  %-16s %" PRIu64 " runs\n", "ok (exit 0)", ok);
+    free(printed);
+
+    /* With a plan, name the call site behind every run that went wrong */
+    for (uint64_t i = 0; plan && i < n; ++i) {
+        const struct outcome *o = &results[i];
+        if (o->kind == OUT_EXIT && o->detail == 0) continue;
+        const struct plan_entry *e = &plan[opt->first + i - 1];
+        char label[32];
+        fprintf(out, "  #%-6" PRIu64 " %-16s first #%-8" PRIu64 " %.*s\n", opt->first + i,
+                outcome_label(o, label, sizeof(label)), e->first_index,
+                (int)sizeof(e->where), e->where);
+    }
+}
+
+int main(int argc, char **argv) {
+    struct options opt = { 0 };
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    opt.jobs = cpus > 0 ? (unsigned)cpus : 1;
+    opt.timeout = 10.0;
+    opt.first = 1;
+    opt.lib = "./interceptor.so";
+
+    int c;
+    while ((c = getopt(argc, argv, "+j:t:s:e:l:o:vF:P:")) != -1) {
+        switch (c) {
+        case 'j': opt.jobs = (unsigned)strtoul(optarg, NULL, 10); break;
+        case 't': opt.timeout = strtod(optarg, NULL); break;
+        case 's': opt.first = strtoull(optarg, NULL, 10); break;
+        case 'e': opt.last = strtoull(optarg, NULL, 10); break;
+        case 'l': opt.lib = optarg; break;
+        case 'o': opt.report = optarg; break;
+        case 'v': opt.verbose = 1; break;
+        case 'F': opt.forksrv = optarg; break;
+        case 'P': opt.plan = optarg; break;
+        default: usage();
+        }
+    }
+    if (optind >= argc || opt.jobs == 0 || opt.timeout <= 0 || opt.first == 0) usage();
+    if (opt.plan && opt.forksrv) {
+        fprintf(stderr, "malloc_sweep: -P and -F cannot be combined\n");
+        return 2;
+    }
+    opt.argv = &argv[optind];
+
+    /* The target may chdir, so hand it an absolute library path */
+    static char lib_path[PATH_MAX];
+    if (!realpath(opt.lib, lib_path)) {
+        perror(opt.lib);
+        return 1;
+    }
+    opt.lib = lib_path;
+
+    /* Same for the plan, which has to exist for realpath */
+    static char plan_path[PATH_MAX];
+    if (opt.plan) {
+        int fd = open(opt.plan, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || !realpath(opt.plan, plan_path)) {
+            perror(opt.plan);
+            return 1;
+        }
+        close(fd);
+        opt.plan = plan_path;
+    }
+
+    uint64_t visible = count_allocations(&opt);
+    uint32_t sites = 0;
+    struct plan_entry *plan = NULL;
+    if (opt.plan) {
+        plan = read_plan(opt.plan, &sites);
+        if (!plan) {
+            fprintf(stderr, "malloc_sweep: counting run wrote no plan to %s\n", opt.plan);
+            return 1;
+        }
+        if (opt.last == 0 || opt.last > sites) opt.last = sites;
+    } else if (opt.last == 0) {
+        opt.last = visible;
+    }
+    if (opt.last < opt.first) {
+        fprintf(stderr, "malloc_sweep: nothing to do (%" PRIu64 " allocations counted)\n", visible);
+        return 1;
+    }
+    fprintf(stderr, "malloc_sweep: counting run saw %" PRIu64 " allocations", visible);
+    if (plan) fprintf(stderr, " from %" PRIu32 " call sites", sites);
+    fputc('\n', stderr);
+
+    uint64_t n = opt.last - opt.first + 1;
+    struct outcome *results = calloc(n, sizeof(*results));
+    if (!results) {
+        perror("calloc");
+        return 1;
+    }
+
+    double t0 = now_s();
+    if (opt.forksrv) run_forksrv_sweep(&opt, &results);
+    else run_sweep(&opt, results);
+    double elapsed = now_s() - t0;
+
+    FILE *out = stdout;
+    if (opt.report && !(out = fopen(opt.report, "w"))) {
+        perror(opt.report);
+        out = stdout;
+    }
+    print_report(out, &opt, results, plan, elapsed);
+    if (out != stdout) fclose(out);
+
+    int crashed = 0;
+    n = opt.last - opt.first + 1;
+    for (uint64_t i = 0; i < n; ++i)
+        if (results[i].kind == OUT_SIGNAL || results[i].kind == OUT_HANG) crashed = 1;
+    free(results);
+    free(plan);
+    return crashed ? 3 : 0;
+}
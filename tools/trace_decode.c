@@ -0,0 +1,96 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../src/alloc_fn.h"
+#include "../src/trace.h"
+
+/* Decode a MALLOC_FAIL_TRACE file into the MALLOC_FAIL_DEBUG text format.
+ *
+ *   malloc_trace_decode [-t] trace.bin
+ *
+ * Records are stored per thread; they are printed in allocation-index
+ * order, which is the order MALLOC_FAIL_DEBUG would have logged them.
+ * -t prefixes each line with the timestamp and thread id.
+ */
+
+static int by_index(const void *a, const void *b) {
+    const struct trace_record *x = *(const struct trace_record *const *)a;
+    const struct trace_record *y = *(const struct trace_record *const *)b;
+    if (x->abs_index != y->abs_index) return x->abs_index < y->abs_index ? -1 : 1;
+    return x < y ? -1 : x > y;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: malloc_trace_decode [-t] <trace file>\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    int with_time = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "t")) != -1) {
+        if (opt == 't') with_time = 1;
+        else usage();
+    }
+    if (optind + 1 != argc) usage();
+
+    int fd = open(argv[optind], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if ((size_t)st.st_size < sizeof(struct trace_header)) {
+        fprintf(stderr, "%s: too short for a trace file\n", argv[optind]);
+        return 1;
+    }
+    const char *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    struct trace_header hdr;
+    memcpy(&hdr, map, sizeof(hdr));
+    if (memcmp(hdr.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 ||
+        hdr.version != TRACE_VERSION || hdr.record_size != sizeof(struct trace_record)) {
+        fprintf(stderr, "%s: not a version %d trace file\n", argv[optind], TRACE_VERSION);
+        return 1;
+    }
+
+    size_t count = ((size_t)st.st_size - sizeof(hdr)) / sizeof(struct trace_record);
+    const struct trace_record *recs = (const struct trace_record *)(map + sizeof(hdr));
+    const struct trace_record **order = malloc((count ? count : 1) * sizeof(*order));
+    if (!order) {
+        perror("malloc");
+        return 1;
+    }
+    for (size_t i = 0; i < count; ++i)
+        order[i] = &recs[i];
+    qsort(order, count, sizeof(*order), by_index);
+
+    for (size_t i = 0; i < count; ++i) {
+        const struct trace_record *r = order[i];
+        if (with_time)
+            printf("[%" PRIu64 ".%09" PRIu64 " tid=%" PRIu32 "] ",
+                   r->timestamp_ns / UINT64_C(1000000000), r->timestamp_ns % UINT64_C(1000000000), r->tid);
+        printf("interceptor: %s abs=%" PRIu64 " vis=%" PRIu64 " size=%" PRIu64 " offset=%lld decision=%d\n",
+               alloc_fn_name(r->fn), r->abs_index, r->visible_index, r->size,
+               (long long)hdr.offset, r->decision);
+    }
+
+    if (hdr.dropped > 0)
+        fprintf(stderr, "malloc_trace_decode: %" PRIu64 " records were dropped while tracing\n",
+                hdr.dropped);
+    if (hdr.records != count)
+        fprintf(stderr, "malloc_trace_decode: header lists %" PRIu64 " records, file has %zu"
+                " (process did not exit cleanly?)\n", hdr.records, count);
+    return 0;
+}